@@ -0,0 +1,351 @@
+// Microbenchmark for the sample conversion kernels and wave::writer.
+// wave.cxx has no platform dependencies, so this builds anywhere:
+//   clang++ -O2 -std=c++14 bench.cxx wave.cxx peaks.cxx -o bench
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "CLI11.hpp"
+#include "wave.hxx"
+
+#ifdef _WIN32
+static const char *NULL_DEVICE = "NUL";
+#else
+static const char *NULL_DEVICE = "/dev/null";
+#endif
+
+typedef std::chrono::steady_clock benchclock;
+
+typedef struct result
+{
+	std::string name;
+	int channels;
+	size_t frames;
+	uint64_t iterations;
+	double nsPerFrame;
+	double gbPerSec;
+} result;
+
+static const char *typename_(capture::pcm_type t)
+{
+	switch (t)
+	{
+	case capture::pcm_type::pcm_u8:
+		return "pcm_u8";
+	case capture::pcm_type::pcm_s16:
+		return "pcm_s16";
+	case capture::pcm_type::pcm_f32:
+		return "pcm_f32";
+	default:
+		return "unknown";
+	}
+}
+
+// Deterministic noise in every input format
+static std::vector<unsigned char> makeinput(capture::pcm_type t, size_t samplecount)
+{
+	std::vector<float> noise(samplecount);
+	uint32_t seed = 12345;
+
+	for (float &v: noise)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		v = ((float) (seed >> 8) / 8388608.0f - 1.0f) * 0.9f;
+	}
+
+	std::vector<unsigned char> out(samplecount * wave::pcmtype_size(t));
+	wave::convert(out.data(), t, noise.data(), capture::pcm_type::pcm_f32, samplecount);
+	return out;
+}
+
+// Runs "fn" in batches until each took at least "seconds" / 5 and keeps the
+// median batch.
+template<typename F>
+static double measure(F fn, double seconds, uint64_t &iterations)
+{
+	fn();
+
+	uint64_t count = 1;
+	double target = seconds / 5.0;
+
+	while (true)
+	{
+		benchclock::time_point start = benchclock::now();
+		for (uint64_t i = 0; i < count; i++)
+			fn();
+
+		double elapsed = std::chrono::duration<double>(benchclock::now() - start).count();
+		if (elapsed >= target)
+			break;
+
+		count = elapsed > 0 ? std::max(count * 2, (uint64_t) (count * target / elapsed * 1.2)) : count * 16;
+	}
+
+	std::vector<double> batches;
+	for (int b = 0; b < 5; b++)
+	{
+		benchclock::time_point start = benchclock::now();
+		for (uint64_t i = 0; i < count; i++)
+			fn();
+
+		batches.push_back(std::chrono::duration<double>(benchclock::now() - start).count() / count);
+	}
+
+	std::sort(batches.begin(), batches.end());
+	iterations = count * 5;
+	return batches[2];
+}
+
+static void report(std::vector<result> &results, const std::string &name, int channels, size_t frames, size_t inbytes, double seconds, uint64_t iterations)
+{
+	result r = {name, channels, frames, iterations, seconds * 1e9 / frames, inbytes / seconds / 1e9};
+	fprintf(stderr, "%-36s %3dch %6zu frames %10.3f ns/frame %8.3f GB/s\n", name.c_str(), channels, frames, r.nsPerFrame, r.gbPerSec);
+	results.push_back(r);
+}
+
+static bool writejson(const char *path, const std::vector<result> &results)
+{
+	FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+	if (f == nullptr)
+		return false;
+
+	fprintf(f, "{\n\t\"benchmark\": \"wave\",\n\t\"results\": [\n");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const result &r = results[i];
+		fprintf(
+			f,
+			"\t\t{\"name\": \"%s\", \"channels\": %d, \"frames\": %zu, \"iterations\": %llu, \"ns_per_frame\": %.4f, \"gb_per_s\": %.4f}%s\n",
+			r.name.c_str(),
+			r.channels,
+			r.frames,
+			(unsigned long long) r.iterations,
+			r.nsPerFrame,
+			r.gbPerSec,
+			i + 1 < results.size() ? "," : ""
+		);
+	}
+	fprintf(f, "\t]\n}\n");
+
+	return f == stdout || fclose(f) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	CLI::App parser("Sample conversion and WAV writer benchmark", argv[0]);
+
+	std::string jsonPath;
+	std::string filter;
+	std::string outputPath = NULL_DEVICE;
+	double seconds = 0.1;
+	std::vector<int> channelCounts = {1, 2, 8, 32};
+	std::vector<size_t> blockSizes = {64, 480, 4096, 65536};
+
+	parser.add_option("--json", jsonPath, "Write the results as JSON to this file (- for stdout).");
+	parser.add_option("--filter", filter, "Only run cases whose name contains this.");
+	parser.add_option("--output", outputPath, "Where the writer cases write to (default: the null device, so only CPU time is measured).");
+	parser.add_option("--seconds", seconds, "Measuring time per case.");
+	parser.add_option("--channels", channelCounts, "Channel counts to test.")->delimiter(',');
+	parser.add_option("--frames", blockSizes, "Block sizes to test, in frames.")->delimiter(',');
+
+	try
+	{
+		parser.parse(argc, argv);
+	}
+	catch (const CLI::ParseError &e)
+	{
+		return parser.exit(e);
+	}
+
+	const capture::pcm_type types[] = {capture::pcm_type::pcm_u8, capture::pcm_type::pcm_s16, capture::pcm_type::pcm_f32};
+	std::vector<result> results;
+
+	for (capture::pcm_type intype: types)
+	{
+		for (capture::pcm_type outtype: types)
+		{
+			if (intype == outtype)
+				continue;
+
+			std::string name = std::string("convert/") + typename_(intype) + "->" + typename_(outtype);
+			if (name.find(filter) == std::string::npos)
+				continue;
+
+			for (int channels: channelCounts)
+			{
+				for (size_t frames: blockSizes)
+				{
+					size_t samplecount = frames * channels;
+					std::vector<unsigned char> input = makeinput(intype, samplecount);
+					std::vector<unsigned char> output(samplecount * wave::pcmtype_size(outtype));
+					uint64_t iterations = 0;
+
+					double t = measure([&]() {
+						wave::convert(output.data(), outtype, input.data(), intype, samplecount);
+					}, seconds, iterations);
+
+					report(results, name, channels, frames, input.size(), t, iterations);
+				}
+			}
+		}
+	}
+
+	// The same with clipping and peaks measured, as the writer does it
+	for (capture::pcm_type intype: types)
+	{
+		for (capture::pcm_type outtype: types)
+		{
+			if (intype == outtype || outtype == capture::pcm_type::pcm_f32)
+				continue;
+
+			std::string name = std::string("convert_levels/") + typename_(intype) + "->" + typename_(outtype);
+			if (name.find(filter) == std::string::npos)
+				continue;
+
+			for (int channels: channelCounts)
+			{
+				for (size_t frames: blockSizes)
+				{
+					size_t samplecount = frames * channels;
+					std::vector<unsigned char> input = makeinput(intype, samplecount);
+					std::vector<unsigned char> output(samplecount * wave::pcmtype_size(outtype));
+					std::vector<wave::channel_levels> levels(channels, wave::channel_levels {0, 0.0f});
+					uint64_t iterations = 0;
+
+					double t = measure([&]() {
+						wave::convert(output.data(), outtype, input.data(), intype, frames, channels, levels.data());
+					}, seconds, iterations);
+
+					report(results, name, channels, frames, input.size(), t, iterations);
+				}
+			}
+		}
+	}
+
+	// Interleaved to one buffer per channel and back, as used by
+	// --split-channels and planar::block
+	for (capture::pcm_type intype: types)
+	{
+		for (capture::pcm_type outtype: types)
+		{
+			std::string deinterleaveName = std::string("deinterleave/") + typename_(intype) + "->" + typename_(outtype);
+			std::string levelsName = std::string("deinterleave_levels/") + typename_(intype) + "->" + typename_(outtype);
+			std::string interleaveName = std::string("interleave/") + typename_(intype) + "->" + typename_(outtype);
+			bool runDeinterleave = deinterleaveName.find(filter) != std::string::npos;
+			// Measured as --split-channels does it
+			bool runLevels = intype != outtype && outtype != capture::pcm_type::pcm_f32 && levelsName.find(filter) != std::string::npos;
+			bool runInterleave = interleaveName.find(filter) != std::string::npos;
+
+			if (!runDeinterleave && !runLevels && !runInterleave)
+				continue;
+
+			for (int channels: channelCounts)
+			{
+				for (size_t frames: blockSizes)
+				{
+					std::vector<unsigned char> input = makeinput(intype, frames * channels);
+					std::vector<unsigned char> output(frames * channels * wave::pcmtype_size(outtype));
+					std::vector<std::vector<unsigned char>> inplanes(channels, std::vector<unsigned char>(frames * wave::pcmtype_size(intype)));
+					std::vector<std::vector<unsigned char>> outplanes(channels, std::vector<unsigned char>(frames * wave::pcmtype_size(outtype)));
+					std::vector<void *> src, dest;
+
+					for (int c = 0; c < channels; c++)
+					{
+						src.push_back(inplanes[c].data());
+						dest.push_back(outplanes[c].data());
+					}
+
+					wave::deinterleave(src.data(), intype, input.data(), intype, frames, channels);
+					uint64_t iterations = 0;
+
+					if (runDeinterleave)
+					{
+						double t = measure([&]() {
+							wave::deinterleave(dest.data(), outtype, input.data(), intype, frames, channels);
+						}, seconds, iterations);
+
+						report(results, deinterleaveName, channels, frames, input.size(), t, iterations);
+					}
+
+					if (runLevels)
+					{
+						std::vector<wave::channel_levels> levels(channels, wave::channel_levels {0, 0.0f});
+						double t = measure([&]() {
+							wave::deinterleave(dest.data(), outtype, input.data(), intype, frames, channels, levels.data());
+						}, seconds, iterations);
+
+						report(results, levelsName, channels, frames, input.size(), t, iterations);
+					}
+
+					if (runInterleave)
+					{
+						double t = measure([&]() {
+							wave::interleave(output.data(), outtype, src.data(), intype, frames, channels);
+						}, seconds, iterations);
+
+						report(results, interleaveName, channels, frames, input.size(), t, iterations);
+					}
+				}
+			}
+		}
+	}
+
+	// The whole writer path including write_pass and the header update
+	const wave::encoding encodings[] = {wave::encoding::pcm, wave::encoding::ima_adpcm};
+
+	for (wave::encoding enc: encodings)
+	{
+		for (capture::pcm_type outtype: types)
+		{
+			for (capture::pcm_type intype: types)
+			{
+				std::string name = std::string(enc == wave::encoding::ima_adpcm ? "writer/ima_adpcm/" : "writer/") + typename_(intype) + "->" + typename_(outtype);
+				if (name.find(filter) == std::string::npos)
+					continue;
+
+				for (int channels: channelCounts)
+				{
+					wave::options opts;
+					opts.format = enc;
+
+					wave::writer *writer = nullptr;
+					try
+					{
+						writer = wave::newwriter(outputPath.c_str(), channels, 48000, outtype, opts);
+					}
+					catch (const std::runtime_error &)
+					{
+						// Combination not supported by the writer
+						break;
+					}
+
+					for (size_t frames: blockSizes)
+					{
+						std::vector<unsigned char> input = makeinput(intype, frames * channels);
+						uint64_t iterations = 0;
+
+						double t = measure([&]() {
+							wave::write(writer, input.data(), frames, intype);
+						}, seconds, iterations);
+
+						report(results, name, channels, frames, input.size(), t, iterations);
+					}
+
+					wave::close(writer);
+				}
+			}
+		}
+	}
+
+	if (!jsonPath.empty() && !writejson(jsonPath.c_str(), results))
+	{
+		fprintf(stderr, "Error: cannot write %s\n", jsonPath.c_str());
+		return 1;
+	}
+
+	return 0;
+}
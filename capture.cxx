@@ -14,6 +14,8 @@
 
 #include "capture.hxx"
 #include "conv.hxx"
+#include "trace.hxx"
+#include "wave.hxx"
 
 namespace capture
 {
@@ -287,7 +289,10 @@ struct context
 	device_info getInfo() const noexcept;
 	bool startCapture(size_t ringbufsize);
 	bool stopCapture();
-	std::vector<unsigned char> getBuffers();
+	std::vector<unsigned char> getBuffers(buffer_info *info = nullptr);
+	size_t getBuffers(unsigned char *dest, size_t capacity, buffer_info *info);
+	size_t getPlanar(float *const *dest, size_t capacity, buffer_info *info);
+	size_t getBufferSize() const noexcept;
 
 private:
 	WAVEFORMATEXTENSIBLE format;
@@ -297,6 +302,10 @@ private:
 	COMWrapper<IAudioCaptureClient> audioCaptureClient;
 	size_t bufcount;
 	bool capture;
+	std::vector<void *> planes;
+
+	template<typename F>
+	size_t readPackets(size_t capacity, buffer_info *info, F deliver);
 };
 
 context::context(const std::string &device, name_match match)
@@ -307,6 +316,7 @@ context::context(const std::string &device, name_match match)
 , audioCaptureClient(nullptr)
 , bufcount(0)
 , capture(false)
+, planes()
 {
 	COMWrapper<IMMDeviceEnumerator> enumerator(__uuidof(MMDeviceEnumerator), CLSCTX_ALL);
 	COMWrapper<IMMDevice> targetDevice;
@@ -375,6 +385,7 @@ context::context(const std::string &device, name_match match)
 	audioClient = targetAudioClient;
 	format = *formatTemp;
 	name = conv::fromwstring(realDeviceName.pwszVal);
+	planes.resize(format.Format.nChannels);
 
 	CoTaskMemFree(formatTemp);
 }
@@ -418,34 +429,103 @@ bool context::startCapture(size_t ringbufsize)
 	return capture = true;
 }
 
-std::vector<unsigned char> context::getBuffers()
+std::vector<unsigned char> context::getBuffers(buffer_info *info)
 {
-	std::vector<unsigned char> result;
-	size_t pos = 0;
-	size_t cursize = 0;
 	size_t framesize = pcmtype_size(pcmtype_from_waveformat(format)) * format.Format.nChannels;
+
+	// The whole device buffer fits, so nothing is left behind
+	std::vector<unsigned char> result(bufcount * framesize);
+	result.resize(getBuffers(result.data(), result.size(), info));
+	return result;
+}
+
+// Hands every whole packet that fits in "capacity" frames to
+// deliver(data, pos, frames), with "data" null for silence
+template<typename F>
+size_t context::readPackets(size_t capacity, buffer_info *info, F deliver)
+{
+	size_t pos = 0;
 	DWORD flags = 0;
 
+	if (info)
+		*info = {0, 0, 0, 0, false};
+
 	while (true)
 	{
 		UINT32 packetSize = 0;
 		checkHRESULT(audioCaptureClient->GetNextPacketSize(&packetSize));
 
-		if (packetSize == 0)
+		// Packets can't be split, the rest waits for the next call
+		if (packetSize == 0 || pos + packetSize > capacity)
 			break;
 
 		BYTE *dataPtr = nullptr;
-		checkHRESULT(audioCaptureClient->GetBuffer(&dataPtr, &packetSize, &flags, nullptr, nullptr));
-		result.resize(cursize += packetSize * framesize, 0);
+		UINT64 devicePosition = 0;
+		UINT64 qpcPosition = 0;
+		checkHRESULT(audioCaptureClient->GetBuffer(&dataPtr, &packetSize, &flags, &devicePosition, &qpcPosition));
 
-		if (!(flags & AUDCLNT_BUFFERFLAGS_SILENT))
-			std::copy(dataPtr, dataPtr + packetSize * framesize, result.begin() + pos);
+		if (info)
+		{
+			if (info->packets == 0)
+			{
+				info->position = devicePosition;
+				info->timestamp = qpcPosition;
+			}
 
-		pos += packetSize * framesize;
+			info->packets++;
+			info->silentPackets += (flags & AUDCLNT_BUFFERFLAGS_SILENT) ? 1 : 0;
+			info->discontinuity |= (flags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY) != 0;
+		}
+
+		deliver((flags & AUDCLNT_BUFFERFLAGS_SILENT) ? nullptr : dataPtr, pos, packetSize);
+
+		pos += packetSize;
 		checkHRESULT(audioCaptureClient->ReleaseBuffer(packetSize));
 	}
 
-	return result;
+	return pos;
+}
+
+size_t context::getBuffers(unsigned char *dest, size_t capacity, buffer_info *info)
+{
+	TRACE_SCOPE("getBuffers");
+
+	size_t framesize = pcmtype_size(pcmtype_from_waveformat(format)) * format.Format.nChannels;
+
+	return framesize * readPackets(capacity / framesize, info, [&](const BYTE *data, size_t pos, size_t frames)
+	{
+		if (data == nullptr)
+			std::fill(dest + pos * framesize, dest + (pos + frames) * framesize, 0);
+		else
+			std::copy(data, data + frames * framesize, dest + pos * framesize);
+	});
+}
+
+size_t context::getPlanar(float *const *dest, size_t capacity, buffer_info *info)
+{
+	TRACE_SCOPE("getPlanar");
+
+	pcm_type type = pcmtype_from_waveformat(format);
+	int channels = format.Format.nChannels;
+
+	return readPackets(capacity, info, [&](const BYTE *data, size_t pos, size_t frames)
+	{
+		for (int c = 0; c < channels; c++)
+		{
+			planes[c] = dest[c] + pos;
+			if (data == nullptr)
+				std::fill(dest[c] + pos, dest[c] + pos + frames, 0.0f);
+		}
+
+		// Straight from the device buffer, no interleaved copy in between
+		if (data)
+			wave::deinterleave(planes.data(), pcm_type::pcm_f32, data, type, frames, channels);
+	});
+}
+
+size_t context::getBufferSize() const noexcept
+{
+	return bufcount;
 }
 
 bool context::stopCapture()
@@ -541,6 +621,21 @@ std::vector<unsigned char> getbuf(context *ctx)
 	return ctx->getBuffers();
 }
 
+size_t getbuf(context *ctx, void *dest, size_t capacity, buffer_info &info)
+{
+	return ctx->getBuffers((unsigned char *) dest, capacity, &info);
+}
+
+size_t getplanar(context *ctx, float *const *dest, size_t capacity, buffer_info &info)
+{
+	return ctx->getPlanar(dest, capacity, &info);
+}
+
+size_t buffersize(context *ctx) noexcept
+{
+	return ctx->getBufferSize();
+}
+
 void sleep(double nsec)
 {
 	Sleep(DWORD(nsec * 1000.0));
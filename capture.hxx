@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -26,6 +27,18 @@ typedef struct device_info
 	pcm_type dataType;
 } device_info;
 
+typedef struct buffer_info
+{
+	// Device position of the first frame, in frames
+	uint64_t position;
+	// Performance counter time of the first frame, in 100ns units
+	uint64_t timestamp;
+	size_t packets;
+	size_t silentPackets;
+	// Audio was lost before this buffer
+	bool discontinuity;
+} buffer_info;
+
 typedef enum class name_match
 {
 	exact,
@@ -42,5 +55,14 @@ device_info getinfo(context *ctx) noexcept;
 bool start(context *ctx, size_t ringbufsize);
 bool stop(context *ctx);
 std::vector<unsigned char> getbuf(context *ctx);
+// Fills "dest" without allocating and returns the byte count. Whole packets
+// only, so "capacity" should hold buffersize() frames.
+size_t getbuf(context *ctx, void *dest, size_t capacity, buffer_info &info);
+// Like the above, but converted to float with one array per channel, so
+// per channel processing gets contiguous samples. "capacity" and the result
+// are in frames. See planar::block.
+size_t getplanar(context *ctx, float *const *dest, size_t capacity, buffer_info &info);
+// Device buffer length in frames, known after start().
+size_t buffersize(context *ctx) noexcept;
 
 }
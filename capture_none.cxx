@@ -0,0 +1,64 @@
+#include <stdexcept>
+
+#include "capture.hxx"
+
+// Stand-in for platforms without a loopback backend. Only --bench works.
+namespace capture
+{
+
+struct context
+{
+};
+
+context *open(const std::string &device, name_match devmatch)
+{
+	throw std::runtime_error("No capture backend on this platform");
+}
+
+void close(context *&ctx)
+{
+	delete ctx;
+	ctx = nullptr;
+}
+
+std::vector<device_info> listdevices()
+{
+	return {};
+}
+
+device_info getinfo(context *ctx) noexcept
+{
+	return {};
+}
+
+bool start(context *ctx, size_t ringbufsize)
+{
+	return false;
+}
+
+bool stop(context *ctx)
+{
+	return false;
+}
+
+std::vector<unsigned char> getbuf(context *ctx)
+{
+	return {};
+}
+
+size_t getbuf(context *ctx, void *dest, size_t capacity, buffer_info &info)
+{
+	return 0;
+}
+
+size_t getplanar(context *ctx, float *const *dest, size_t capacity, buffer_info &info)
+{
+	return 0;
+}
+
+size_t buffersize(context *ctx) noexcept
+{
+	return 0;
+}
+
+}
@@ -0,0 +1,681 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "fileio.hxx"
+
+namespace fileio
+{
+
+struct mapping
+{
+	mapping(const char *path, bool writable);
+	~mapping();
+
+	unsigned char *base;
+	uint64_t length;
+	bool writable;
+	void prefetch(uint64_t offset, size_t size) noexcept;
+	bool flush();
+private:
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE section;
+#else
+	int fd;
+#endif
+};
+
+#ifdef _WIN32
+mapping::mapping(const char *path, bool canwrite)
+: base(nullptr)
+, length(0)
+, writable(canwrite)
+, file(INVALID_HANDLE_VALUE)
+, section(nullptr)
+{
+	file = CreateFileA(path, GENERIC_READ | (writable ? GENERIC_WRITE : 0), FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error(std::string("Cannot open ") + path);
+
+	LARGE_INTEGER filesize;
+	if (!GetFileSizeEx(file, &filesize))
+	{
+		CloseHandle(file);
+		throw std::runtime_error(std::string("Cannot get the size of ") + path);
+	}
+
+	length = (uint64_t) filesize.QuadPart;
+
+	// Empty files cannot be mapped
+	if (length == 0)
+		return;
+
+	section = CreateFileMappingA(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+	base = section ? (unsigned char *) MapViewOfFile(section, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0) : nullptr;
+
+	if (base == nullptr)
+	{
+		if (section)
+			CloseHandle(section);
+
+		CloseHandle(file);
+		throw std::runtime_error(std::string("Cannot map ") + path);
+	}
+}
+
+mapping::~mapping()
+{
+	if (base)
+		UnmapViewOfFile(base);
+
+	if (section)
+		CloseHandle(section);
+
+	CloseHandle(file);
+}
+
+void mapping::prefetch(uint64_t offset, size_t size) noexcept
+{
+	if (offset >= length)
+		return;
+
+	WIN32_MEMORY_RANGE_ENTRY range = {base + offset, (SIZE_T) std::min<uint64_t>(size, length - offset)};
+	PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+}
+
+bool mapping::flush()
+{
+	if (base == nullptr)
+		return true;
+
+	return FlushViewOfFile(base, 0) && FlushFileBuffers(file);
+}
+#else
+mapping::mapping(const char *path, bool canwrite)
+: base(nullptr)
+, length(0)
+, writable(canwrite)
+, fd(-1)
+{
+	fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error(std::string("Cannot open ") + path);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		::close(fd);
+		throw std::runtime_error(std::string("Cannot get the size of ") + path);
+	}
+
+	length = (uint64_t) st.st_size;
+
+	// Empty files cannot be mapped
+	if (length == 0)
+		return;
+
+	void *result = mmap(nullptr, (size_t) length, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+	if (result == MAP_FAILED)
+	{
+		::close(fd);
+		throw std::runtime_error(std::string("Cannot map ") + path);
+	}
+
+	base = (unsigned char *) result;
+	madvise(base, (size_t) length, MADV_SEQUENTIAL);
+}
+
+mapping::~mapping()
+{
+	if (base)
+		munmap(base, (size_t) length);
+
+	::close(fd);
+}
+
+void mapping::prefetch(uint64_t offset, size_t size) noexcept
+{
+	if (offset >= length)
+		return;
+
+	// madvise() wants a page aligned start
+	uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+	uint64_t start = offset / page * page;
+	uint64_t end = std::min<uint64_t>(offset + size, length);
+	madvise(base + start, (size_t) (end - start), MADV_WILLNEED);
+}
+
+bool mapping::flush()
+{
+	if (base == nullptr)
+		return true;
+
+	return msync(base, (size_t) length, MS_SYNC) == 0 && fsync(fd) == 0;
+}
+#endif
+
+mapping *map(const char *path, bool writable)
+{
+	return new mapping(path, writable);
+}
+
+const unsigned char *data(mapping *m) noexcept
+{
+	return m->base;
+}
+
+unsigned char *writabledata(mapping *m) noexcept
+{
+	return m->writable ? m->base : nullptr;
+}
+
+uint64_t size(mapping *m) noexcept
+{
+	return m->length;
+}
+
+void prefetch(mapping *m, uint64_t offset, size_t size) noexcept
+{
+	m->prefetch(offset, size);
+}
+
+bool flush(mapping *m)
+{
+	return m->flush();
+}
+
+void unmap(mapping *m)
+{
+	delete m;
+}
+
+struct output
+{
+	output(const char *path, const output_options &opts);
+	~output();
+
+	bool direct;
+	bool writeat(uint64_t offset, const void *buf, size_t size);
+	bool finish(uint64_t length);
+private:
+	uint64_t extentBytes;
+	uint64_t allocated;
+#ifdef _WIN32
+	HANDLE file;
+#else
+	int fd;
+#endif
+
+	void reserve(uint64_t end) noexcept;
+	bool buffered();
+};
+
+#ifdef _WIN32
+output::output(const char *path, const output_options &opts)
+: direct(opts.direct)
+, extentBytes(opts.extentBytes)
+, allocated(0)
+, file(INVALID_HANDLE_VALUE)
+{
+	if (direct)
+		file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, nullptr);
+
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		direct = false;
+		file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	}
+
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error(std::string("Cannot open ") + path);
+}
+
+output::~output()
+{
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+}
+
+void output::reserve(uint64_t end) noexcept
+{
+	if (extentBytes == 0 || end <= allocated)
+		return;
+
+	FILE_ALLOCATION_INFO info;
+	info.AllocationSize.QuadPart = (LONGLONG) (end + extentBytes);
+
+	if (SetFileInformationByHandle(file, FileAllocationInfo, &info, sizeof(info)))
+		allocated = end + extentBytes;
+	else
+		extentBytes = 0;
+}
+
+// Continues on a cached handle to the same file
+bool output::buffered()
+{
+	HANDLE h = ReOpenFile(file, GENERIC_WRITE, FILE_SHARE_READ, 0);
+	if (h == INVALID_HANDLE_VALUE)
+		return false;
+
+	CloseHandle(file);
+	file = h;
+	direct = false;
+	return true;
+}
+
+bool output::writeat(uint64_t offset, const void *buf, size_t size)
+{
+	reserve(offset + size);
+
+	OVERLAPPED ov = {};
+	ov.Offset = (DWORD) offset;
+	ov.OffsetHigh = (DWORD) (offset >> 32);
+
+	DWORD written = 0;
+	if (WriteFile(file, buf, (DWORD) size, &written, &ov) && written == size)
+		return true;
+
+	if (direct && GetLastError() == ERROR_INVALID_PARAMETER && buffered())
+		return writeat(offset, buf, size);
+
+	return false;
+}
+
+bool output::finish(uint64_t length)
+{
+	FILE_END_OF_FILE_INFO eof;
+	eof.EndOfFile.QuadPart = (LONGLONG) length;
+
+	// Also gives back what was allocated past the end
+	FILE_ALLOCATION_INFO info;
+	info.AllocationSize.QuadPart = (LONGLONG) length;
+
+	bool result = SetFileInformationByHandle(file, FileEndOfFileInfo, &eof, sizeof(eof))
+		&& SetFileInformationByHandle(file, FileAllocationInfo, &info, sizeof(info));
+
+	result = CloseHandle(file) && result;
+	file = INVALID_HANDLE_VALUE;
+	return result;
+}
+#else
+output::output(const char *path, const output_options &opts)
+: direct(opts.direct)
+, extentBytes(opts.extentBytes)
+, allocated(0)
+, fd(-1)
+{
+#ifdef O_DIRECT
+	if (direct)
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+#endif
+
+	// tmpfs and some network file systems refuse O_DIRECT
+	if (fd < 0)
+	{
+		direct = false;
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	}
+
+	if (fd < 0)
+		throw std::runtime_error(std::string("Cannot open ") + path);
+
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+	direct = direct && fcntl(fd, F_NOCACHE, 1) == 0;
+#endif
+}
+
+output::~output()
+{
+	if (fd >= 0)
+		::close(fd);
+}
+
+void output::reserve(uint64_t end) noexcept
+{
+	if (extentBytes == 0 || end <= allocated)
+		return;
+
+#ifdef __linux__
+	// Without changing the size, so a crash leaves no zeros after the data.
+	// posix_fallocate() would write those zeros itself where the file
+	// system cannot allocate.
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t) allocated, (off_t) (end + extentBytes - allocated)) == 0)
+		allocated = end + extentBytes;
+	else
+		extentBytes = 0;
+#else
+	extentBytes = 0;
+#endif
+}
+
+bool output::buffered()
+{
+#ifdef O_DIRECT
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) != 0)
+		return false;
+#endif
+
+	direct = false;
+	return true;
+}
+
+bool output::writeat(uint64_t offset, const void *buf, size_t size)
+{
+	reserve(offset + size);
+
+	const unsigned char *data = (const unsigned char *) buf;
+	while (size > 0)
+	{
+		ssize_t written = pwrite(fd, data, size, (off_t) offset);
+		if (written < 0 && errno == EINTR)
+			continue;
+
+		if (written < 0 && errno == EINVAL && direct && buffered())
+			continue;
+
+		if (written <= 0)
+			return false;
+
+		data += written;
+		offset += (uint64_t) written;
+		size -= (size_t) written;
+	}
+
+	return true;
+}
+
+bool output::finish(uint64_t length)
+{
+	bool result = ftruncate(fd, (off_t) length) == 0;
+	result = ::close(fd) == 0 && result;
+	fd = -1;
+	return result;
+}
+#endif
+
+output *create(const char *path, const output_options &opts)
+{
+	return new output(path, opts);
+}
+
+bool direct(output *out) noexcept
+{
+	return out->direct;
+}
+
+bool writeat(output *out, uint64_t offset, const void *buf, size_t size)
+{
+	return out->writeat(offset, buf, size);
+}
+
+bool close(output *out, uint64_t length)
+{
+	bool result = out->finish(length);
+	delete out;
+	return result;
+}
+
+void *allocaligned(size_t size)
+{
+#ifdef _WIN32
+	void *p = _aligned_malloc(size, OUTPUT_ALIGNMENT);
+#else
+	void *p = nullptr;
+	if (posix_memalign(&p, OUTPUT_ALIGNMENT, size) != 0)
+		p = nullptr;
+#endif
+
+	if (p == nullptr)
+		throw std::bad_alloc();
+
+	return p;
+}
+
+void freealigned(void *p) noexcept
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+#ifdef _WIN32
+static bool fileid(const char *path, BY_HANDLE_FILE_INFORMATION &info)
+{
+	HANDLE h = CreateFileA(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (h == INVALID_HANDLE_VALUE)
+		return false;
+
+	bool result = GetFileInformationByHandle(h, &info) != 0;
+	CloseHandle(h);
+	return result;
+}
+
+bool samefile(const char *a, const char *b)
+{
+	BY_HANDLE_FILE_INFORMATION ia, ib;
+	return fileid(a, ia) && fileid(b, ib)
+		&& ia.dwVolumeSerialNumber == ib.dwVolumeSerialNumber
+		&& ia.nFileIndexHigh == ib.nFileIndexHigh
+		&& ia.nFileIndexLow == ib.nFileIndexLow;
+}
+#else
+bool samefile(const char *a, const char *b)
+{
+	struct stat sa, sb;
+	return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+#endif
+
+template<typename T>
+static T readint(const unsigned char *buf)
+{
+	T result = 0;
+	for (size_t i = 0; i < sizeof(T); i++)
+		result |= (T) buf[i] << (i * 8);
+
+	return result;
+}
+
+bool parsewav(const unsigned char *buf, uint64_t size, wav_info &info)
+{
+	if (buf == nullptr || size < 12 || memcmp(buf, "RIFF", 4) != 0 || memcmp(buf + 8, "WAVE", 4) != 0)
+		return false;
+
+	bool hasFormat = false;
+	uint64_t pos = 12;
+	memset(&info, 0, sizeof(info));
+
+	while (pos + 8 <= size)
+	{
+		const unsigned char *chunk = buf + pos;
+		uint64_t chunkSize = readint<uint32_t>(chunk + 4);
+
+		if (memcmp(chunk, "fmt ", 4) == 0 && chunkSize >= 16 && pos + 8 + chunkSize <= size)
+		{
+			info.formatTag = readint<uint16_t>(chunk + 8);
+			info.channels = readint<uint16_t>(chunk + 10);
+			info.sampleRate = (int) readint<uint32_t>(chunk + 12);
+			info.blockAlign = readint<uint16_t>(chunk + 20);
+			info.bitsPerSample = readint<uint16_t>(chunk + 22);
+			info.samplesPerBlock = 1;
+
+			// IMA ADPCM stores it in the extension
+			if (info.formatTag == 0x11 && chunkSize >= 20)
+				info.samplesPerBlock = readint<uint16_t>(chunk + 26);
+
+			// WAVE_FORMAT_EXTENSIBLE keeps the real tag in the sub format GUID
+			uint16_t tag = info.formatTag;
+			if (tag == 0xFFFE && chunkSize >= 40)
+				tag = readint<uint16_t>(chunk + 32);
+
+			if (tag == 1 && info.bitsPerSample == 8)
+				info.format = capture::pcm_type::pcm_u8;
+			else if (tag == 1 && info.bitsPerSample == 16)
+				info.format = capture::pcm_type::pcm_s16;
+			else if (tag == 3 && info.bitsPerSample == 32)
+				info.format = capture::pcm_type::pcm_f32;
+
+			hasFormat = true;
+		}
+		else if (memcmp(chunk, "data", 4) == 0)
+		{
+			if (!hasFormat || info.blockAlign == 0)
+				return false;
+
+			// A size of 0 or past the end means the writer never finished
+			info.dataOffset = pos + 8;
+			info.dataSize = std::min<uint64_t>(chunkSize, size - info.dataOffset);
+			if (chunkSize == 0)
+				info.dataSize = size - info.dataOffset;
+
+			info.frames = info.dataSize / info.blockAlign;
+			return true;
+		}
+
+		// Chunks are padded to even sizes
+		pos += 8 + chunkSize + (chunkSize & 1);
+	}
+
+	return false;
+}
+
+static uint64_t filelength(FILE *f)
+{
+#ifdef _WIN32
+	struct _stat64 st;
+	return _fstat64(_fileno(f), &st) == 0 ? (uint64_t) st.st_size : 0;
+#else
+	struct stat st;
+	return fstat(fileno(f), &st) == 0 ? (uint64_t) st.st_size : 0;
+#endif
+}
+
+static bool truncatefile(FILE *f, uint64_t length)
+{
+	if (fflush(f) != 0)
+		return false;
+
+#ifdef _WIN32
+	return _chsize_s(_fileno(f), (long long) length) == 0;
+#else
+	return ftruncate(fileno(f), (off_t) length) == 0;
+#endif
+}
+
+bool resize(const char *path, uint64_t length)
+{
+	FILE *f = fopen(path, "r+b");
+	if (f == nullptr)
+		return false;
+
+	bool result = truncatefile(f, length);
+	return fclose(f) == 0 && result;
+}
+
+template<typename T>
+static bool writeint(FILE *f, uint64_t offset, T v)
+{
+	unsigned char buf[sizeof(T)];
+	for (size_t i = 0; i < sizeof(T); i++)
+		buf[i] = (unsigned char) (v >> (i * 8));
+
+	return fseek(f, (long) offset, SEEK_SET) == 0 && fwrite(buf, 1, sizeof(T), f) == sizeof(T);
+}
+
+bool repairwav(const char *path, wav_info &info)
+{
+	FILE *f = fopen(path, "r+b");
+	if (f == nullptr)
+		throw std::runtime_error(std::string("Cannot open ") + path);
+
+	// Everything up to the data chunk fits in here for any file we write
+	unsigned char header[4096];
+	size_t headerSize = fread(header, 1, sizeof(header), f);
+	uint64_t length = filelength(f);
+
+	if (!parsewav(header, headerSize, info) || length < info.dataOffset)
+	{
+		fclose(f);
+		throw std::runtime_error("not a WAV file");
+	}
+
+	uint64_t declared = readint<uint32_t>(header + info.dataOffset - 4);
+	uint64_t riffSize = readint<uint32_t>(header + 4);
+
+	// Also intact when other chunks (cue points) follow the data
+	if (declared > 0 && riffSize + 8 == length && info.dataOffset + declared <= length)
+	{
+		info.dataSize = declared;
+		info.frames = declared / info.blockAlign;
+		fclose(f);
+		return false;
+	}
+
+	// Whole blocks only. Past what the 32-bit sizes can hold they stay at
+	// their largest whole block, and the audio after that is kept for readers
+	// that go by the file length. Nothing is cut off, a trailing partial
+	// block stays behind the RIFF chunk.
+	uint64_t available = (length - info.dataOffset) / info.blockAlign * info.blockAlign;
+	uint64_t dataSize = std::min<uint64_t>(available, (0xFFFFFFFFULL - info.dataOffset) / info.blockAlign * info.blockAlign);
+	bool changed = declared != dataSize || riffSize != info.dataOffset + dataSize - 8;
+	bool result = true;
+
+	if (changed)
+	{
+		result = writeint<uint32_t>(f, 4, (uint32_t) (info.dataOffset + dataSize - 8))
+			&& writeint<uint32_t>(f, info.dataOffset - 4, (uint32_t) dataSize);
+	}
+
+	// IMA ADPCM keeps the length in frames in a fact chunk
+	uint64_t pos = 12;
+	uint64_t perBlock = info.samplesPerBlock;
+	while (result && info.formatTag == 0x11 && pos + 12 <= info.dataOffset)
+	{
+		uint64_t chunkSize = readint<uint32_t>(header + pos + 4);
+		if (memcmp(header + pos, "fact", 4) == 0)
+		{
+			// A count that ends inside the last block is already right
+			uint64_t blocks = dataSize / info.blockAlign;
+			uint64_t frames = readint<uint32_t>(header + pos + 8);
+			if (blocks == 0 || frames <= (blocks - 1) * perBlock || frames > blocks * perBlock)
+			{
+				result = writeint<uint32_t>(f, pos + 8, (uint32_t) std::min<uint64_t>(blocks * perBlock, 0xFFFFFFFFULL));
+				changed = true;
+			}
+		}
+
+		pos += 8 + chunkSize + (chunkSize & 1);
+	}
+
+	result = fclose(f) == 0 && result;
+	if (!result)
+		throw std::runtime_error(std::string("Cannot write ") + path);
+
+	info.dataSize = available;
+	info.frames = available / info.blockAlign;
+	return changed;
+}
+
+}
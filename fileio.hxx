@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "capture.hxx"
+
+namespace fileio
+{
+
+// Whole file mapped into memory
+typedef struct mapping mapping;
+
+mapping *map(const char *path, bool writable = false);
+const unsigned char *data(mapping *m) noexcept;
+// nullptr unless mapped writable
+unsigned char *writabledata(mapping *m) noexcept;
+uint64_t size(mapping *m) noexcept;
+// Tells the OS "size" bytes from "offset" are read next.
+void prefetch(mapping *m, uint64_t offset, size_t size) noexcept;
+// Writes changes back to disk before returning.
+bool flush(mapping *m);
+void unmap(mapping *m);
+
+// File written at explicit offsets, past the OS cache where the platform and
+// file system allow it, and allocated on disk ahead of the data
+typedef struct output output;
+
+typedef struct output_options
+{
+	// Direct I/O, falls back to buffered writes where it is not supported
+	bool direct = true;
+	// Allocate this much more whenever the data reaches the end of the
+	// allocation. 0 leaves it to the file system.
+	uint64_t extentBytes = 64 << 20;
+} output_options;
+
+// Offsets, sizes and addresses of direct writes must be multiples of this
+static constexpr size_t OUTPUT_ALIGNMENT = 4096;
+
+output *create(const char *path, const output_options &opts = output_options());
+// Whether writes still bypass the cache
+bool direct(output *out) noexcept;
+bool writeat(output *out, uint64_t offset, const void *buf, size_t size);
+// Cuts the file to "length", which need not be aligned, and closes it.
+bool close(output *out, uint64_t length);
+
+void *allocaligned(size_t size);
+void freealigned(void *p) noexcept;
+
+// Both paths name the same existing file
+bool samefile(const char *a, const char *b);
+// Cuts an existing file, which must not be mapped, to "length".
+bool resize(const char *path, uint64_t length);
+
+typedef struct wav_info
+{
+	int channels;
+	int sampleRate;
+	int bitsPerSample;
+	// unknown for formats wave::convert cannot read
+	capture::pcm_type format;
+	uint16_t formatTag;
+	uint16_t blockAlign;
+	// Sample frames in a block, 1 for PCM
+	uint32_t samplesPerBlock;
+	uint64_t dataOffset;
+	// Clamped to what the file actually holds
+	uint64_t dataSize;
+	// Whole blocks of "blockAlign", which is one frame for PCM
+	uint64_t frames;
+} wav_info;
+
+// Reads the RIFF chunks up to "data". Returns false if this is not a WAV
+// file.
+bool parsewav(const unsigned char *buf, uint64_t size, wav_info &info);
+
+// Fixes the RIFF and data sizes of a WAV file whose writer never finished,
+// from the file length in whole blocks. The file is never shortened: a
+// trailing partial block stays behind the RIFF chunk, and past 4 GiB the
+// sizes stay at the largest whole block they can hold while the audio after
+// it is kept. Only the header is read and written. "info" covers every whole
+// block in the file. Returns false if the file was intact.
+bool repairwav(const char *path, wav_info &info);
+
+}
@@ -0,0 +1,1187 @@
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "flac.hxx"
+#include "trace.hxx"
+#include "wave.hxx"
+
+namespace flac
+{
+
+static constexpr unsigned BLOCK_SIZE = 4096;
+static constexpr unsigned MAX_LPC_ORDER = 8;
+static constexpr unsigned QLP_PRECISION = 12;
+static constexpr unsigned MAX_PARTITION_ORDER = 8;
+static constexpr unsigned BITS_PER_SAMPLE = 16;
+
+static const uint8_t *crc8table()
+{
+	static const std::vector<uint8_t> table = []()
+	{
+		std::vector<uint8_t> t(256);
+		for (unsigned i = 0; i < 256; i++)
+		{
+			uint8_t crc = (uint8_t) i;
+			for (int j = 0; j < 8; j++)
+				crc = (crc & 0x80) ? (uint8_t) ((crc << 1) ^ 0x07) : (uint8_t) (crc << 1);
+			t[i] = crc;
+		}
+		return t;
+	}();
+	return table.data();
+}
+
+static const uint16_t *crc16table()
+{
+	static const std::vector<uint16_t> table = []()
+	{
+		std::vector<uint16_t> t(256);
+		for (unsigned i = 0; i < 256; i++)
+		{
+			uint16_t crc = (uint16_t) (i << 8);
+			for (int j = 0; j < 8; j++)
+				crc = (crc & 0x8000) ? (uint16_t) ((crc << 1) ^ 0x8005) : (uint16_t) (crc << 1);
+			t[i] = crc;
+		}
+		return t;
+	}();
+	return table.data();
+}
+
+static uint8_t crc8(const unsigned char *data, size_t len)
+{
+	const uint8_t *table = crc8table();
+	uint8_t crc = 0;
+	for (size_t i = 0; i < len; i++)
+		crc = table[crc ^ data[i]];
+	return crc;
+}
+
+static uint16_t crc16(const unsigned char *data, size_t len)
+{
+	const uint16_t *table = crc16table();
+	uint16_t crc = 0;
+	for (size_t i = 0; i < len; i++)
+		crc = (uint16_t) ((crc << 8) ^ table[(crc >> 8) ^ data[i]]);
+	return crc;
+}
+
+// MD5 of the decoded samples, stored in STREAMINFO for decoder verification
+class md5
+{
+public:
+	md5()
+	: state{0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476}
+	, length(0)
+	, buffer()
+	{
+	}
+
+	void update(const void *data, size_t len)
+	{
+		const unsigned char *in = (const unsigned char *) data;
+		size_t used = length % 64;
+		length += len;
+
+		if (used > 0)
+		{
+			size_t fill = std::min(len, 64 - used);
+			memcpy(buffer + used, in, fill);
+			in += fill;
+			len -= fill;
+
+			if (used + fill < 64)
+				return;
+
+			transform(buffer);
+		}
+
+		for (; len >= 64; in += 64, len -= 64)
+			transform(in);
+
+		memcpy(buffer, in, len);
+	}
+
+	void finish(unsigned char digest[16])
+	{
+		uint64_t bits = length * 8;
+		unsigned char pad[72] = {0x80};
+		size_t used = length % 64;
+		size_t padlen = (used < 56 ? 56 : 120) - used;
+
+		for (int i = 0; i < 8; i++)
+			pad[padlen + i] = (unsigned char) (bits >> (i * 8));
+
+		update(pad, padlen + 8);
+
+		for (int i = 0; i < 16; i++)
+			digest[i] = (unsigned char) (state[i / 4] >> ((i % 4) * 8));
+	}
+
+private:
+	uint32_t state[4];
+	uint64_t length;
+	unsigned char buffer[64];
+
+	static uint32_t rotl(uint32_t x, int c)
+	{
+		return (x << c) | (x >> (32 - c));
+	}
+
+	void transform(const unsigned char *block)
+	{
+		static const uint32_t K[64] = {
+			0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+			0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+			0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+			0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+			0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+			0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+			0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+			0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+		};
+		static const int R[64] = {
+			7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+			5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+			4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+			6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+		};
+
+		uint32_t w[16];
+		for (int i = 0; i < 16; i++)
+			w[i] = block[i * 4] | (block[i * 4 + 1] << 8) | (block[i * 4 + 2] << 16) | ((uint32_t) block[i * 4 + 3] << 24);
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+
+		for (int i = 0; i < 64; i++)
+		{
+			uint32_t f;
+			int g;
+
+			if (i < 16)
+			{
+				f = (b & c) | (~b & d);
+				g = i;
+			}
+			else if (i < 32)
+			{
+				f = (d & b) | (~d & c);
+				g = (5 * i + 1) % 16;
+			}
+			else if (i < 48)
+			{
+				f = b ^ c ^ d;
+				g = (3 * i + 5) % 16;
+			}
+			else
+			{
+				f = c ^ (b | ~d);
+				g = (7 * i) % 16;
+			}
+
+			uint32_t tmp = d;
+			d = c;
+			c = b;
+			b = b + rotl(a + f + K[i] + w[g], R[i]);
+			a = tmp;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+	}
+};
+
+class bitwriter
+{
+public:
+	bitwriter(std::vector<unsigned char> &dest)
+	: out(dest)
+	, acc(0)
+	, bits(0)
+	{
+	}
+
+	// Up to 32 bits at once
+	void put(uint32_t value, unsigned count)
+	{
+		if (count == 0)
+			return;
+
+		acc = (acc << count) | (value & (0xFFFFFFFFu >> (32 - count)));
+		bits += count;
+
+		while (bits >= 8)
+		{
+			bits -= 8;
+			out.push_back((unsigned char) (acc >> bits));
+		}
+	}
+
+	void putunary(uint32_t zeros)
+	{
+		for (; zeros >= 32; zeros -= 32)
+			put(0, 32);
+
+		put(1, zeros + 1);
+	}
+
+	void putrice(uint32_t value, unsigned param)
+	{
+		uint32_t q = value >> param;
+		if (q + 1 + param <= 32)
+			put((1u << param) | (value & ((1u << param) - 1)), q + 1 + param);
+		else
+		{
+			putunary(q);
+			put(value, param);
+		}
+	}
+
+	void align()
+	{
+		if (bits > 0)
+			put(0, 8 - bits);
+	}
+
+private:
+	std::vector<unsigned char> &out;
+	uint64_t acc;
+	unsigned bits;
+};
+
+typedef struct riceplan
+{
+	unsigned order;
+	unsigned paramBits;
+	uint64_t bits;
+	unsigned params[1 << MAX_PARTITION_ORDER];
+} riceplan;
+
+// Per-thread encoder scratch memory
+typedef struct scratch
+{
+	std::vector<int32_t> mid;
+	std::vector<int32_t> side;
+	std::vector<uint32_t> fixedResidual;
+	std::vector<uint32_t> lpcResidual;
+	std::vector<float> window;
+	std::vector<float> windowed;
+	std::vector<uint64_t> sums[MAX_PARTITION_ORDER + 1];
+} scratch;
+
+static inline uint32_t zigzag(int64_t v)
+{
+	int32_t v32 = (int32_t) v;
+	return ((uint32_t) v32 << 1) ^ (uint32_t) (v32 >> 31);
+}
+
+static unsigned bestparam(uint64_t sum, size_t count, uint64_t &bits)
+{
+	if (count == 0)
+	{
+		bits = 0;
+		return 0;
+	}
+
+	// Start from the mean and check the neighbours
+	unsigned guess = 0;
+	for (uint64_t mean = sum / count; mean > 1 && guess < 30; mean >>= 1)
+		guess++;
+
+	unsigned best = 0;
+	bits = UINT64_MAX;
+
+	for (unsigned k = guess > 0 ? guess - 1 : 0; k <= std::min(guess + 1, 30u); k++)
+	{
+		uint64_t cost = count * (k + 1) + (sum >> k);
+		if (cost < bits)
+		{
+			bits = cost;
+			best = k;
+		}
+	}
+
+	return best;
+}
+
+static void planresidual(const uint32_t *u, unsigned blocksize, unsigned order, scratch &s, riceplan &plan)
+{
+	unsigned maxorder = 0;
+	while (maxorder < MAX_PARTITION_ORDER && (blocksize % (2u << maxorder)) == 0 && (blocksize >> (maxorder + 1)) >= order)
+		maxorder++;
+
+	// Finest partition sums first, then merge pairs for each coarser order
+	{
+		std::vector<uint64_t> &sums = s.sums[maxorder];
+		unsigned parts = 1u << maxorder;
+		unsigned partsize = blocksize >> maxorder;
+		sums.assign(parts, 0);
+
+		const uint32_t *p = u;
+		for (unsigned i = 0; i < parts; i++)
+		{
+			unsigned count = partsize - (i == 0 ? order : 0);
+			uint64_t sum = 0;
+			for (unsigned j = 0; j < count; j++)
+				sum += p[j];
+
+			sums[i] = sum;
+			p += count;
+		}
+	}
+
+	for (unsigned o = maxorder; o > 0; o--)
+	{
+		std::vector<uint64_t> &fine = s.sums[o];
+		std::vector<uint64_t> &coarse = s.sums[o - 1];
+		coarse.resize(fine.size() / 2);
+
+		for (size_t i = 0; i < coarse.size(); i++)
+			coarse[i] = fine[i * 2] + fine[i * 2 + 1];
+	}
+
+	plan.bits = UINT64_MAX;
+	for (unsigned o = 0; o <= maxorder; o++)
+	{
+		unsigned parts = 1u << o;
+		unsigned partsize = blocksize >> o;
+		unsigned params[1 << MAX_PARTITION_ORDER];
+		unsigned maxparam = 0;
+		uint64_t total = 0;
+
+		for (unsigned i = 0; i < parts; i++)
+		{
+			uint64_t bits = 0;
+			params[i] = bestparam(s.sums[o][i], partsize - (i == 0 ? order : 0), bits);
+			maxparam = std::max(maxparam, params[i]);
+			total += bits;
+		}
+
+		unsigned parambits = maxparam > 14 ? 5 : 4;
+		total += 6 + parts * parambits;
+
+		if (total < plan.bits)
+		{
+			plan.bits = total;
+			plan.order = o;
+			plan.paramBits = parambits;
+			std::copy(params, params + parts, plan.params);
+		}
+	}
+}
+
+static void writeresidual(bitwriter &bw, const uint32_t *u, unsigned blocksize, unsigned order, const riceplan &plan)
+{
+	unsigned parts = 1u << plan.order;
+	unsigned partsize = blocksize >> plan.order;
+
+	bw.put(plan.paramBits == 5 ? 1 : 0, 2);
+	bw.put(plan.order, 4);
+
+	for (unsigned i = 0; i < parts; i++)
+	{
+		unsigned count = partsize - (i == 0 ? order : 0);
+		unsigned param = plan.params[i];
+		bw.put(param, plan.paramBits);
+
+		for (unsigned j = 0; j < count; j++)
+			bw.putrice(u[j], param);
+
+		u += count;
+	}
+}
+
+// Sum of absolute residuals for each fixed predictor order, in one pass
+static unsigned bestfixed(const int32_t *x, unsigned n, uint64_t &cost)
+{
+	uint64_t sums[5] = {0, 0, 0, 0, 0};
+
+	for (unsigned i = 4; i < n; i++)
+	{
+		int64_t e0 = x[i];
+		int64_t e1 = e0 - x[i - 1];
+		int64_t e2 = e1 - ((int64_t) x[i - 1] - x[i - 2]);
+		int64_t e3 = e2 - ((int64_t) x[i - 1] - 2LL * x[i - 2] + x[i - 3]);
+		int64_t e4 = e3 - ((int64_t) x[i - 1] - 3LL * x[i - 2] + 3LL * x[i - 3] - x[i - 4]);
+		sums[0] += (uint64_t) std::llabs(e0);
+		sums[1] += (uint64_t) std::llabs(e1);
+		sums[2] += (uint64_t) std::llabs(e2);
+		sums[3] += (uint64_t) std::llabs(e3);
+		sums[4] += (uint64_t) std::llabs(e4);
+	}
+
+	unsigned order = 0;
+	for (unsigned o = 1; o < 5; o++)
+	{
+		if (sums[o] < sums[order])
+			order = o;
+	}
+
+	cost = sums[order];
+	return order;
+}
+
+static bool fixedresidual(const int32_t *x, unsigned n, unsigned order, uint32_t *u)
+{
+	for (unsigned i = order; i < n; i++)
+	{
+		int64_t r;
+
+		switch (order)
+		{
+		case 0:
+		default:
+			r = x[i];
+			break;
+		case 1:
+			r = (int64_t) x[i] - x[i - 1];
+			break;
+		case 2:
+			r = (int64_t) x[i] - 2LL * x[i - 1] + x[i - 2];
+			break;
+		case 3:
+			r = (int64_t) x[i] - 3LL * x[i - 1] + 3LL * x[i - 2] - x[i - 3];
+			break;
+		case 4:
+			r = (int64_t) x[i] - 4LL * x[i - 1] + 6LL * x[i - 2] - 4LL * x[i - 3] + x[i - 4];
+			break;
+		}
+
+		if (r > INT32_MAX / 2 || r < INT32_MIN / 2)
+			return false;
+
+		u[i - order] = zigzag(r);
+	}
+
+	return true;
+}
+
+static void tukeywindow(std::vector<float> &window, unsigned n)
+{
+	// Tukey window with p = 0.5
+	window.assign(n, 1.0f);
+	unsigned taper = n / 4;
+	for (unsigned i = 0; i < taper; i++)
+	{
+		float w = 0.5f - 0.5f * (float) cos(3.14159265358979323846 * i / taper);
+		window[i] = w;
+		window[n - 1 - i] = w;
+	}
+}
+
+// Four independent accumulators per lag keep the loop free of a serial
+// dependency so it vectorizes without relaxed floating point.
+static void autocorrelation(const float *x, unsigned n, unsigned lags, double *autoc)
+{
+	for (unsigned lag = 0; lag < lags; lag++)
+	{
+		const float *y = x + lag;
+		unsigned count = n - lag;
+		float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+		double total = 0.0;
+		unsigned i = 0;
+
+		// Flush to double regularly so long blocks keep their precision
+		while (i + 4 <= count)
+		{
+			unsigned end = std::min(count & ~3u, i + 256);
+			for (; i < end; i += 4)
+			{
+				acc[0] += x[i] * y[i];
+				acc[1] += x[i + 1] * y[i + 1];
+				acc[2] += x[i + 2] * y[i + 2];
+				acc[3] += x[i + 3] * y[i + 3];
+			}
+
+			total += (double) acc[0] + acc[1] + acc[2] + acc[3];
+			acc[0] = acc[1] = acc[2] = acc[3] = 0.0f;
+		}
+
+		for (; i < count; i++)
+			total += (double) x[i] * y[i];
+
+		autoc[lag] = total;
+	}
+}
+
+// Levinson-Durbin recursion. coeffs[o - 1] holds the predictor of order o.
+static unsigned levinson(const double *autoc, unsigned maxorder, double coeffs[MAX_LPC_ORDER][MAX_LPC_ORDER], double *error)
+{
+	double lpc[MAX_LPC_ORDER];
+	double err = autoc[0];
+
+	for (unsigned i = 0; i < maxorder; i++)
+	{
+		double r = -autoc[i + 1];
+		for (unsigned j = 0; j < i; j++)
+			r -= lpc[j] * autoc[i - j];
+
+		if (err <= 0.0)
+			return i;
+
+		r /= err;
+		lpc[i] = r;
+
+		unsigned j = 0;
+		for (; j < (i >> 1); j++)
+		{
+			double tmp = lpc[j];
+			lpc[j] += r * lpc[i - 1 - j];
+			lpc[i - 1 - j] += r * tmp;
+		}
+
+		if (i & 1)
+			lpc[j] += lpc[j] * r;
+
+		err *= (1.0 - r * r);
+
+		for (j = 0; j <= i; j++)
+			coeffs[i][j] = -lpc[j];
+
+		error[i] = err;
+	}
+
+	return maxorder;
+}
+
+static bool quantize(const double *coeffs, unsigned order, unsigned precision, int32_t *qlp, int &shift)
+{
+	double cmax = 0.0;
+	for (unsigned i = 0; i < order; i++)
+		cmax = std::max(cmax, std::fabs(coeffs[i]));
+
+	if (cmax <= 0.0)
+		return false;
+
+	int log2cmax;
+	frexp(cmax, &log2cmax);
+	log2cmax--;
+
+	shift = std::min(std::max((int) precision - 1 - log2cmax - 1, 0), 15);
+
+	int32_t qmax = (1 << (precision - 1)) - 1;
+	int32_t qmin = -qmax - 1;
+	double error = 0.0;
+
+	for (unsigned i = 0; i < order; i++)
+	{
+		error += coeffs[i] * (1 << shift);
+		int32_t q = (int32_t) lround(error);
+		q = std::min(std::max(q, qmin), qmax);
+		error -= q;
+		qlp[i] = q;
+	}
+
+	return true;
+}
+
+static bool lpcresidual(const int32_t *x, unsigned n, const int32_t *qlp, unsigned order, int shift, uint32_t *u)
+{
+	for (unsigned i = order; i < n; i++)
+	{
+		int64_t sum = 0;
+		for (unsigned j = 0; j < order; j++)
+			sum += (int64_t) qlp[j] * x[i - j - 1];
+
+		int64_t r = x[i] - (sum >> shift);
+		if (r > INT32_MAX / 2 || r < INT32_MIN / 2)
+			return false;
+
+		u[i - order] = zigzag(r);
+	}
+
+	return true;
+}
+
+static void encodesubframe(bitwriter &bw, const int32_t *x, unsigned n, unsigned bps, scratch &s)
+{
+	bool constant = true;
+	for (unsigned i = 1; i < n && constant; i++)
+		constant = x[i] == x[0];
+
+	if (constant)
+	{
+		bw.put(0, 1);
+		bw.put(0, 6);
+		bw.put(0, 1);
+		bw.put((uint32_t) x[0], bps);
+		return;
+	}
+
+	uint64_t verbatimBits = (uint64_t) n * bps;
+	uint64_t bestBits = verbatimBits;
+	enum {VERBATIM, FIXED, LPC} kind = VERBATIM;
+
+	// Fixed predictors
+	unsigned fixedOrder = 0;
+	riceplan fixedPlan;
+	if (n > 4)
+	{
+		uint64_t cost = 0;
+		fixedOrder = bestfixed(x, n, cost);
+		s.fixedResidual.resize(n);
+
+		if (fixedresidual(x, n, fixedOrder, s.fixedResidual.data()))
+		{
+			planresidual(s.fixedResidual.data(), n, fixedOrder, s, fixedPlan);
+			uint64_t bits = fixedOrder * bps + fixedPlan.bits;
+			if (bits < bestBits)
+			{
+				bestBits = bits;
+				kind = FIXED;
+			}
+		}
+	}
+
+	// LPC
+	unsigned lpcOrder = 0;
+	int32_t qlp[MAX_LPC_ORDER];
+	int shift = 0;
+	riceplan lpcPlan;
+	if (n > MAX_LPC_ORDER * 4)
+	{
+		if (s.window.size() != n)
+			tukeywindow(s.window, n);
+
+		s.windowed.resize(n);
+		for (unsigned i = 0; i < n; i++)
+			s.windowed[i] = x[i] * s.window[i];
+
+		double autoc[MAX_LPC_ORDER + 1];
+		double coeffs[MAX_LPC_ORDER][MAX_LPC_ORDER];
+		double error[MAX_LPC_ORDER];
+		autocorrelation(s.windowed.data(), n, MAX_LPC_ORDER + 1, autoc);
+
+		unsigned maxorder = autoc[0] > 0.0 ? levinson(autoc, MAX_LPC_ORDER, coeffs, error) : 0;
+
+		// Pick the order with the smallest expected size
+		double bestEstimate = 0.0;
+		double errorScale = 0.5 / n;
+		for (unsigned o = 1; o <= maxorder; o++)
+		{
+			double bpsEstimate = error[o - 1] > 0.0 ? std::max(0.5 * log2(errorScale * error[o - 1]), 0.0) : 0.0;
+			double estimate = bpsEstimate * (n - o) + o * (bps + QLP_PRECISION);
+			if (lpcOrder == 0 || estimate < bestEstimate)
+			{
+				lpcOrder = o;
+				bestEstimate = estimate;
+			}
+		}
+
+		if (lpcOrder > 0 && quantize(coeffs[lpcOrder - 1], lpcOrder, QLP_PRECISION, qlp, shift))
+		{
+			s.lpcResidual.resize(n);
+
+			if (lpcresidual(x, n, qlp, lpcOrder, shift, s.lpcResidual.data()))
+			{
+				planresidual(s.lpcResidual.data(), n, lpcOrder, s, lpcPlan);
+				uint64_t bits = lpcOrder * (bps + QLP_PRECISION) + 9 + lpcPlan.bits;
+				if (bits < bestBits)
+				{
+					bestBits = bits;
+					kind = LPC;
+				}
+			}
+		}
+	}
+
+	bw.put(0, 1);
+
+	switch (kind)
+	{
+	case VERBATIM:
+		bw.put(1, 6);
+		bw.put(0, 1);
+		for (unsigned i = 0; i < n; i++)
+			bw.put((uint32_t) x[i], bps);
+		break;
+	case FIXED:
+		bw.put(8 | fixedOrder, 6);
+		bw.put(0, 1);
+		for (unsigned i = 0; i < fixedOrder; i++)
+			bw.put((uint32_t) x[i], bps);
+		writeresidual(bw, s.fixedResidual.data(), n, fixedOrder, fixedPlan);
+		break;
+	case LPC:
+		bw.put(32 | (lpcOrder - 1), 6);
+		bw.put(0, 1);
+		for (unsigned i = 0; i < lpcOrder; i++)
+			bw.put((uint32_t) x[i], bps);
+		bw.put(QLP_PRECISION - 1, 4);
+		bw.put((uint32_t) shift, 5);
+		for (unsigned i = 0; i < lpcOrder; i++)
+			bw.put((uint32_t) qlp[i], QLP_PRECISION);
+		writeresidual(bw, s.lpcResidual.data(), n, lpcOrder, lpcPlan);
+		break;
+	}
+}
+
+static unsigned sampleratecode(unsigned rate)
+{
+	switch (rate)
+	{
+	case 88200:
+		return 1;
+	case 176400:
+		return 2;
+	case 192000:
+		return 3;
+	case 8000:
+		return 4;
+	case 16000:
+		return 5;
+	case 22050:
+		return 6;
+	case 24000:
+		return 7;
+	case 32000:
+		return 8;
+	case 44100:
+		return 9;
+	case 48000:
+		return 10;
+	case 96000:
+		return 11;
+	default:
+		if (rate % 1000 == 0 && rate / 1000 <= 255)
+			return 12;
+		else if (rate <= 65535)
+			return 13;
+		else if (rate % 10 == 0 && rate / 10 <= 65535)
+			return 14;
+		else
+			return 0; // From STREAMINFO
+	}
+}
+
+static void encodeframe(const int32_t *samples, unsigned channels, unsigned blocksize, uint64_t index, unsigned samplerate, std::vector<unsigned char> &out, scratch &s)
+{
+	out.clear();
+	bitwriter bw(out);
+
+	// Stereo decorrelation. Pick the pair with the cheapest fixed residual.
+	unsigned assignment = channels - 1;
+	const int32_t *left = samples, *right = samples + BLOCK_SIZE;
+	if (channels == 2 && blocksize > 4)
+	{
+		s.mid.resize(blocksize);
+		s.side.resize(blocksize);
+		for (unsigned i = 0; i < blocksize; i++)
+		{
+			s.mid[i] = (left[i] + right[i]) >> 1;
+			s.side[i] = left[i] - right[i];
+		}
+
+		uint64_t costL, costR, costM, costS;
+		bestfixed(left, blocksize, costL);
+		bestfixed(right, blocksize, costR);
+		bestfixed(s.mid.data(), blocksize, costM);
+		bestfixed(s.side.data(), blocksize, costS);
+
+		uint64_t best = costL + costR;
+		if (costL + costS < best)
+		{
+			best = costL + costS;
+			assignment = 8;
+		}
+		if (costR + costS < best)
+		{
+			best = costR + costS;
+			assignment = 9;
+		}
+		if (costM + costS < best)
+			assignment = 10;
+	}
+
+	unsigned blockcode = blocksize == BLOCK_SIZE ? 12 : (blocksize <= 256 ? 6 : 7);
+	unsigned ratecode = sampleratecode(samplerate);
+
+	bw.put(0xFFF8, 16);
+	bw.put(blockcode, 4);
+	bw.put(ratecode, 4);
+	bw.put(assignment, 4);
+	bw.put(4, 3); // 16 bits per sample
+	bw.put(0, 1);
+
+	// Frame number in the extended UTF-8 coding
+	uint32_t number = (uint32_t) index;
+	if (number < 0x80)
+		bw.put(number, 8);
+	else
+	{
+		unsigned extra = number < 0x800 ? 1 : number < 0x10000 ? 2 : number < 0x200000 ? 3 : number < 0x4000000 ? 4 : 5;
+		bw.put(((0xFF00u >> (extra + 1)) & 0xFF) | (number >> (extra * 6)), 8);
+		for (unsigned i = extra; i > 0; i--)
+			bw.put(0x80 | ((number >> ((i - 1) * 6)) & 0x3F), 8);
+	}
+
+	if (blockcode == 6)
+		bw.put(blocksize - 1, 8);
+	else if (blockcode == 7)
+		bw.put(blocksize - 1, 16);
+
+	if (ratecode == 12)
+		bw.put(samplerate / 1000, 8);
+	else if (ratecode == 13)
+		bw.put(samplerate, 16);
+	else if (ratecode == 14)
+		bw.put(samplerate / 10, 16);
+
+	bw.put(crc8(out.data(), out.size()), 8);
+
+	switch (assignment)
+	{
+	case 8:
+		encodesubframe(bw, left, blocksize, BITS_PER_SAMPLE, s);
+		encodesubframe(bw, s.side.data(), blocksize, BITS_PER_SAMPLE + 1, s);
+		break;
+	case 9:
+		encodesubframe(bw, s.side.data(), blocksize, BITS_PER_SAMPLE + 1, s);
+		encodesubframe(bw, right, blocksize, BITS_PER_SAMPLE, s);
+		break;
+	case 10:
+		encodesubframe(bw, s.mid.data(), blocksize, BITS_PER_SAMPLE, s);
+		encodesubframe(bw, s.side.data(), blocksize, BITS_PER_SAMPLE + 1, s);
+		break;
+	default:
+		for (unsigned c = 0; c < channels; c++)
+			encodesubframe(bw, samples + c * BLOCK_SIZE, blocksize, BITS_PER_SAMPLE, s);
+		break;
+	}
+
+	bw.align();
+	bw.put(crc16(out.data(), out.size()), 16);
+}
+
+struct writer
+{
+	writer(const char *dest, int nchannels, int samplerate, int threads);
+	~writer();
+
+	bool write(const void *buf, size_t framecount, capture::pcm_type intype);
+	bool writeend();
+private:
+	static constexpr long STREAMINFO_OFF = 8;
+
+	typedef struct job
+	{
+		uint64_t index;
+		unsigned blocksize;
+		std::vector<int32_t> samples;
+		std::vector<unsigned char> out;
+		bool done;
+	} job;
+
+	FILE *outfile;
+	unsigned channels;
+	unsigned sampleRate;
+	uint64_t totalFrames;
+	uint64_t frameIndex;
+	size_t minFrameSize;
+	size_t maxFrameSize;
+	md5 digest;
+	std::vector<short> staging;
+
+	// Encoder pool. "pending" keeps submission order for output. These stay
+	// short, so plain vectors reserved up front beat deques, which keep
+	// allocating nodes as they move.
+	std::vector<std::unique_ptr<job>> jobs;
+	std::vector<job*> spare;
+	std::vector<job*> queue;
+	std::vector<job*> pending;
+	job *current;
+	size_t maxPending;
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable workReady;
+	std::condition_variable workDone;
+	bool stopping;
+
+	void work();
+	job *newjob();
+	void submit();
+	bool flush(size_t limit);
+	void stop();
+	bool writestreaminfo();
+};
+
+writer::writer(const char *dest, int nchannels, int samplerate, int threads)
+: outfile(nullptr)
+, channels(nchannels)
+, sampleRate(samplerate)
+, totalFrames(0)
+, frameIndex(0)
+, minFrameSize(0)
+, maxFrameSize(0)
+, digest()
+, staging()
+, jobs()
+, spare()
+, queue()
+, pending()
+, current(nullptr)
+, maxPending(0)
+, workers()
+, lock()
+, workReady()
+, workDone()
+, stopping(false)
+{
+	if (nchannels < 1 || nchannels > 8)
+		throw std::runtime_error("FLAC supports 1 to 8 channels");
+	if (samplerate < 1 || samplerate > 655350)
+		throw std::runtime_error("Sample rate not representable in FLAC");
+
+	outfile = fopen(dest, "wb");
+	if (outfile == nullptr)
+		throw std::runtime_error("Cannot open output file");
+
+	fwrite("fLaC", 1, 4, outfile);
+	// Last metadata block, STREAMINFO, 34 bytes
+	fwrite("\x80\x00\x00\x22", 1, 4, outfile);
+	writestreaminfo();
+
+	if (threads <= 0)
+		threads = std::max<int>(std::min<int>(std::thread::hardware_concurrency(), 4), 1);
+
+	maxPending = threads * 2;
+	jobs.reserve(maxPending + threads + 2);
+	spare.reserve(maxPending + threads + 2);
+	queue.reserve(maxPending + threads + 2);
+	pending.reserve(maxPending + threads + 2);
+	current = newjob();
+
+	for (int i = 0; i < threads; i++)
+		workers.emplace_back(&writer::work, this);
+}
+
+writer::~writer()
+{
+	stop();
+	fclose(outfile);
+}
+
+writer::job *writer::newjob()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	job *j;
+
+	if (spare.empty())
+	{
+		jobs.emplace_back(new job());
+		j = jobs.back().get();
+		j->samples.resize(BLOCK_SIZE * channels);
+		// Verbatim subframes with a 17-bit side channel plus headers
+		j->out.reserve(BLOCK_SIZE * channels * 3 + 64);
+	}
+	else
+	{
+		j = spare.back();
+		spare.pop_back();
+	}
+
+	j->index = 0;
+	j->blocksize = 0;
+	j->done = false;
+	return j;
+}
+
+void writer::work()
+{
+	TRACE_THREAD("flac");
+	scratch s;
+
+	while (true)
+	{
+		job *j;
+
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			workReady.wait(guard, [this]() {return stopping || !queue.empty();});
+			if (queue.empty())
+				return;
+
+			j = queue.front();
+			queue.erase(queue.begin());
+		}
+
+		{
+			TRACE_SCOPE("flac_encode");
+			encodeframe(j->samples.data(), channels, j->blocksize, j->index, sampleRate, j->out, s);
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			j->done = true;
+		}
+		workDone.notify_all();
+	}
+}
+
+void writer::submit()
+{
+	current->index = frameIndex++;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		queue.push_back(current);
+		pending.push_back(current);
+	}
+
+	workReady.notify_one();
+	current = newjob();
+}
+
+bool writer::flush(size_t limit)
+{
+	std::unique_lock<std::mutex> guard(lock);
+
+	while (!pending.empty())
+	{
+		job *j = pending.front();
+		if (!j->done)
+		{
+			if (pending.size() <= limit)
+				break;
+
+			workDone.wait(guard, [j]() {return j->done;});
+		}
+
+		pending.erase(pending.begin());
+		guard.unlock();
+
+		size_t size = j->out.size();
+		bool ok = fwrite(j->out.data(), 1, size, outfile) == size;
+		minFrameSize = minFrameSize == 0 ? size : std::min(minFrameSize, size);
+		maxFrameSize = std::max(maxFrameSize, size);
+
+		guard.lock();
+		spare.push_back(j);
+
+		if (!ok)
+			return false;
+	}
+
+	return true;
+}
+
+void writer::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+
+	workReady.notify_all();
+
+	for (std::thread &t: workers)
+		t.join();
+
+	workers.clear();
+}
+
+bool writer::write(const void *buf, size_t framecount, capture::pcm_type intype)
+{
+	const short *pcm = (const short *) buf;
+	size_t samplecount = framecount * channels;
+
+	if (intype != capture::pcm_type::unknown && intype != capture::pcm_type::pcm_s16)
+	{
+		staging.resize(samplecount);
+		if (!wave::convert(staging.data(), capture::pcm_type::pcm_s16, buf, intype, samplecount))
+			return false;
+
+		pcm = staging.data();
+	}
+
+	digest.update(pcm, samplecount * sizeof(short));
+	totalFrames += framecount;
+
+	while (framecount > 0)
+	{
+		unsigned count = (unsigned) std::min<size_t>(framecount, BLOCK_SIZE - current->blocksize);
+		int32_t *dest = current->samples.data() + current->blocksize;
+
+		for (unsigned c = 0; c < channels; c++)
+		{
+			for (unsigned i = 0; i < count; i++)
+				dest[c * BLOCK_SIZE + i] = pcm[i * channels + c];
+		}
+
+		current->blocksize += count;
+		pcm += count * channels;
+		framecount -= count;
+
+		if (current->blocksize == BLOCK_SIZE)
+			submit();
+	}
+
+	return flush(maxPending);
+}
+
+bool writer::writestreaminfo()
+{
+	unsigned char info[34] = {0};
+	std::vector<unsigned char> bytes;
+	bitwriter bw(bytes);
+
+	bw.put(BLOCK_SIZE, 16);
+	bw.put(BLOCK_SIZE, 16);
+	bw.put((uint32_t) minFrameSize, 24);
+	bw.put((uint32_t) maxFrameSize, 24);
+	bw.put(sampleRate, 20);
+	bw.put(channels - 1, 3);
+	bw.put(BITS_PER_SAMPLE - 1, 5);
+	bw.put((uint32_t) (totalFrames >> 32) & 0xF, 4);
+	bw.put((uint32_t) totalFrames, 32);
+	std::copy(bytes.begin(), bytes.end(), info);
+
+	if (totalFrames > 0)
+		digest.finish(info + 18);
+
+	fseek(outfile, STREAMINFO_OFF, SEEK_SET);
+	bool result = fwrite(info, 1, sizeof(info), outfile) == sizeof(info);
+	fseek(outfile, 0, SEEK_END);
+	return result;
+}
+
+bool writer::writeend()
+{
+	if (current->blocksize > 0)
+		submit();
+
+	bool result = flush(0);
+	stop();
+	return writestreaminfo() && result;
+}
+
+writer *newwriter(const char *dest, int nchannels, int samplerate, int threads)
+{
+	return new writer(dest, nchannels, samplerate, threads);
+}
+
+bool write(writer *writer, const void *buf, size_t framecount, capture::pcm_type intype)
+{
+	return writer->write(buf, framecount, intype);
+}
+
+bool close(writer *writer)
+{
+	bool result = writer->writeend();
+	delete writer;
+	return result;
+}
+
+}
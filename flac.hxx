@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdio>
+
+#include "capture.hxx"
+
+namespace flac
+{
+
+typedef struct writer writer;
+
+// Writes 16-bit FLAC. Frames are encoded by "threads" workers, 0 picks a
+// count from the available hardware threads.
+writer *newwriter(const char *dest, int nchannels, int samplerate, int threads = 0);
+bool write(writer *writer, const void *buf, size_t framecount, capture::pcm_type intype);
+bool close(writer *writer);
+
+}
@@ -0,0 +1,441 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+#include "gate.hxx"
+#include "trace.hxx"
+#include "wave.hxx"
+
+namespace gate
+{
+
+template<typename T>
+static double sumsquares(const T *buf, size_t samplecount, double offset, double scale)
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < samplecount; i++)
+	{
+		double v = (buf[i] - offset) * scale;
+		sum += v * v;
+	}
+
+	return sum;
+}
+
+struct detector
+{
+	detector(int nchannels, int samplerate, double opendb, double closedb, int holdms, const char *sidecar);
+	~detector();
+
+	void process(const void *buf, size_t framecount, capture::pcm_type intype, std::vector<span> &spans);
+	void flush(std::vector<span> &spans);
+private:
+	size_t channels;
+	int sampleRate;
+	double openLevel;
+	double closeLevel;
+	size_t blockFrames;
+	size_t holdFrames;
+
+	bool active;
+	size_t holdLeft;
+	size_t blockFill;
+	double blockEnergy;
+
+	// The frames of the current block from earlier buffers, waiting for its
+	// level. Two halves with room for the widest sample type, so new frames
+	// never overwrite a span that was just handed out.
+	std::vector<unsigned char> held;
+	size_t heldFrames;
+	size_t heldHalf;
+
+	// Positions for the sidecar log
+	FILE *log;
+	std::chrono::system_clock::time_point startTime;
+	size_t sourceFrames;
+	size_t outputFrames;
+	size_t blockStart;
+	size_t spanStart;
+	size_t spanOutput;
+	size_t spanIndex;
+
+	void decide(size_t framecount);
+	void emit(const unsigned char *data, int64_t offset, size_t count, std::vector<span> &spans);
+	void logspan(size_t end);
+};
+
+detector::detector(int nchannels, int samplerate, double opendb, double closedb, int holdms, const char *sidecar)
+: channels(nchannels)
+, sampleRate(samplerate)
+, openLevel(pow(10.0, opendb / 10.0))
+, closeLevel(pow(10.0, std::min(closedb, opendb) / 10.0))
+, blockFrames(std::max(samplerate / 100, 1))
+, holdFrames((size_t) holdms * samplerate / 1000)
+, active(false)
+, holdLeft(0)
+, blockFill(0)
+, blockEnergy(0.0)
+, held(2 * blockFrames * nchannels * wave::pcmtype_size(capture::pcm_type::pcm_f32))
+, heldFrames(0)
+, heldHalf(0)
+, log(nullptr)
+, startTime(std::chrono::system_clock::now())
+, sourceFrames(0)
+, outputFrames(0)
+, blockStart(0)
+, spanStart(0)
+, spanOutput(0)
+, spanIndex(0)
+{
+	if (sidecar)
+	{
+		log = fopen(sidecar, "w");
+		if (log == nullptr)
+			throw std::runtime_error("Cannot open activity log");
+
+		fprintf(log, "index,source_start,source_end,output_start,start_time\n");
+		fflush(log);
+	}
+}
+
+detector::~detector()
+{
+	if (active)
+		logspan(blockStart);
+
+	if (log)
+		fclose(log);
+}
+
+void detector::logspan(size_t end)
+{
+	if (log == nullptr)
+		return;
+
+	auto when = startTime + std::chrono::milliseconds(spanStart * 1000 / sampleRate);
+	time_t seconds = std::chrono::system_clock::to_time_t(when);
+	int millis = (int) (std::chrono::duration_cast<std::chrono::milliseconds>(when.time_since_epoch()).count() % 1000);
+	char stamp[64] = "";
+	struct tm *tm = gmtime(&seconds);
+	if (tm)
+		strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", tm);
+
+	fprintf(log, "%u,%llu,%llu,%llu,%s.%03dZ\n",
+		(unsigned int) spanIndex,
+		(unsigned long long) spanStart,
+		(unsigned long long) end,
+		(unsigned long long) spanOutput,
+		stamp,
+		millis
+	);
+	fflush(log);
+}
+
+// Sets the state of the block that just ended from its own level
+void detector::decide(size_t framecount)
+{
+	double level = blockEnergy / (framecount * channels);
+	bool wasActive = active;
+
+	if (level >= openLevel || (active && level >= closeLevel))
+	{
+		active = true;
+		holdLeft = holdFrames;
+	}
+	else if (active)
+	{
+		if (holdLeft > framecount)
+			holdLeft -= framecount;
+		else
+			active = false;
+	}
+
+	if (active && !wasActive)
+	{
+		spanStart = blockStart;
+		spanOutput = outputFrames;
+	}
+	else if (!active && wasActive)
+	{
+		logspan(blockStart);
+		spanIndex++;
+	}
+
+	blockStart += framecount;
+	blockFill = 0;
+	blockEnergy = 0.0;
+}
+
+void detector::emit(const unsigned char *data, int64_t offset, size_t count, std::vector<span> &spans)
+{
+	if (count == 0)
+		return;
+
+	if (active)
+		outputFrames += count;
+
+	// Only frames of the same buffer are contiguous
+	if (!spans.empty() && spans.back().active == active && spans.back().offset >= 0 && spans.back().offset + (int64_t) spans.back().count == offset)
+		spans.back().count += count;
+	else
+		spans.push_back({data, offset, count, active});
+}
+
+void detector::process(const void *buf, size_t framecount, capture::pcm_type intype, std::vector<span> &spans)
+{
+	TRACE_SCOPE("gate");
+
+	spans.clear();
+	const unsigned char *data = (const unsigned char *) buf;
+	size_t frameSize = channels * wave::pcmtype_size(intype);
+	size_t pos = 0;
+
+	while (pos < framecount)
+	{
+		size_t count = std::min(framecount - pos, blockFrames - blockFill);
+		size_t first = pos * channels;
+		size_t samplecount = count * channels;
+
+		switch (intype)
+		{
+		case capture::pcm_type::pcm_u8:
+			blockEnergy += sumsquares((const unsigned char *) buf + first, samplecount, 127.0, 1.0 / 127.0);
+			break;
+		case capture::pcm_type::pcm_s16:
+			blockEnergy += sumsquares((const short *) buf + first, samplecount, 0.0, 1.0 / 32767.0);
+			break;
+		case capture::pcm_type::pcm_f32:
+			blockEnergy += sumsquares((const float *) buf + first, samplecount, 0.0, 1.0);
+			break;
+		default:
+			break;
+		}
+
+		sourceFrames += count;
+		blockFill += count;
+
+		if (blockFill < blockFrames)
+		{
+			// The rest of the block comes with the next buffer
+			unsigned char *half = held.data() + heldHalf * held.size() / 2;
+			memcpy(half + heldFrames * frameSize, data + pos * frameSize, count * frameSize);
+			heldFrames += count;
+			break;
+		}
+
+		// The block takes the state decided by its own level, including the
+		// part held back from earlier buffers
+		decide(blockFrames);
+
+		if (heldFrames > 0)
+		{
+			emit(held.data() + heldHalf * held.size() / 2, -(int64_t) heldFrames, heldFrames, spans);
+			heldFrames = 0;
+			heldHalf ^= 1;
+		}
+
+		emit(data + pos * frameSize, (int64_t) pos, count, spans);
+		pos += count;
+	}
+}
+
+void detector::flush(std::vector<span> &spans)
+{
+	spans.clear();
+	if (heldFrames == 0)
+		return;
+
+	decide(heldFrames);
+	emit(held.data() + heldHalf * held.size() / 2, -(int64_t) heldFrames, heldFrames, spans);
+	heldFrames = 0;
+	heldHalf ^= 1;
+}
+
+// Index of the first frame with a sample at or above "threshold". Scans
+// in short runs with a branchless maximum the compiler can vectorize, and
+// only looks for the exact frame inside a run that crossed.
+template<typename T, typename F>
+static size_t findpeak(const T *buf, size_t framecount, size_t channels, F magnitude, decltype(magnitude(T())) threshold)
+{
+	const size_t RUN = 64;
+
+	for (size_t frame = 0; frame < framecount; frame += RUN)
+	{
+		size_t count = std::min(RUN, framecount - frame) * channels;
+		const T *run = buf + frame * channels;
+		decltype(magnitude(T())) peak = 0;
+
+		for (size_t i = 0; i < count; i++)
+			peak = std::max(peak, magnitude(run[i]));
+
+		if (peak < threshold)
+			continue;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			if (magnitude(run[i]) >= threshold)
+				return frame + i / channels;
+		}
+	}
+
+	return framecount;
+}
+
+struct trigger
+{
+	trigger(int nchannels, int samplerate, capture::pcm_type intype, double db, int prerollms);
+
+	size_t detect(const void *buf, size_t framecount);
+	size_t preroll(region parts[2]);
+	bool triggered() const noexcept;
+private:
+	bool fired;
+	size_t channels;
+	size_t frameSize;
+	capture::pcm_type type;
+	double threshold;
+
+	std::vector<unsigned char> ring;
+	size_t ringFrames;
+	size_t ringHead;
+	size_t ringFill;
+
+	void keep(const unsigned char *buf, size_t framecount);
+};
+
+trigger::trigger(int nchannels, int samplerate, capture::pcm_type intype, double db, int prerollms)
+: fired(false)
+, channels(nchannels)
+, frameSize(nchannels * wave::pcmtype_size(intype))
+, type(intype)
+, threshold(std::min(pow(10.0, db / 20.0), 1.0))
+, ring()
+, ringFrames((size_t) std::max(prerollms, 0) * samplerate / 1000)
+, ringHead(0)
+, ringFill(0)
+{
+	if (frameSize == 0)
+		throw std::runtime_error("Unsupported sample format for the trigger");
+
+	ring.resize(ringFrames * frameSize);
+}
+
+// Only the newest "ringFrames" survive
+void trigger::keep(const unsigned char *buf, size_t framecount)
+{
+	if (ringFrames == 0)
+		return;
+
+	if (framecount > ringFrames)
+	{
+		buf += (framecount - ringFrames) * frameSize;
+		framecount = ringFrames;
+	}
+
+	size_t end = (ringHead + ringFill) % ringFrames;
+	size_t first = std::min(framecount, ringFrames - end);
+	memcpy(ring.data() + end * frameSize, buf, first * frameSize);
+	memcpy(ring.data(), buf + first * frameSize, (framecount - first) * frameSize);
+
+	size_t total = ringFill + framecount;
+	if (total > ringFrames)
+	{
+		ringHead = (ringHead + total - ringFrames) % ringFrames;
+		ringFill = ringFrames;
+	}
+	else
+		ringFill = total;
+}
+
+size_t trigger::detect(const void *buf, size_t framecount)
+{
+	TRACE_SCOPE("trigger");
+
+	if (fired)
+		return 0;
+
+	size_t at = framecount;
+
+	switch (type)
+	{
+	case capture::pcm_type::pcm_u8:
+		at = findpeak((const unsigned char *) buf, framecount, channels, [](unsigned char v) { return std::abs((int) v - 127); }, (int) ceil(threshold * 127.0));
+		break;
+	case capture::pcm_type::pcm_s16:
+		at = findpeak((const short *) buf, framecount, channels, [](short v) { return v >= 0 ? (int) v : -(int) v; }, (int) ceil(threshold * 32767.0));
+		break;
+	case capture::pcm_type::pcm_f32:
+		at = findpeak((const float *) buf, framecount, channels, [](float v) { return fabsf(v); }, (float) threshold);
+		break;
+	default:
+		break;
+	}
+
+	keep((const unsigned char *) buf, at);
+	fired = at < framecount;
+	return at;
+}
+
+bool trigger::triggered() const noexcept
+{
+	return fired;
+}
+
+size_t trigger::preroll(region parts[2])
+{
+	size_t first = std::min(ringFill, ringFrames - ringHead);
+	parts[0] = {ring.data() + ringHead * frameSize, first};
+	parts[1] = {ring.data(), ringFill - first};
+	return ringFill;
+}
+
+detector *newdetector(int nchannels, int samplerate, double opendb, double closedb, int holdms, const char *sidecar)
+{
+	return new detector(nchannels, samplerate, opendb, closedb, holdms, sidecar);
+}
+
+void process(detector *det, const void *buf, size_t framecount, capture::pcm_type intype, std::vector<span> &spans)
+{
+	det->process(buf, framecount, intype, spans);
+}
+
+void flush(detector *det, std::vector<span> &spans)
+{
+	det->flush(spans);
+}
+
+void close(detector *det)
+{
+	delete det;
+}
+
+trigger *newtrigger(int nchannels, int samplerate, capture::pcm_type intype, double db, int prerollms)
+{
+	return new trigger(nchannels, samplerate, intype, db, prerollms);
+}
+
+size_t detect(trigger *trig, const void *buf, size_t framecount)
+{
+	return trig->detect(buf, framecount);
+}
+
+bool triggered(trigger *trig) noexcept
+{
+	return trig->triggered();
+}
+
+size_t preroll(trigger *trig, region parts[2])
+{
+	return trig->preroll(parts);
+}
+
+void close(trigger *trig)
+{
+	delete trig;
+}
+
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "capture.hxx"
+
+namespace gate
+{
+
+typedef struct detector detector;
+
+typedef struct span
+{
+	// Into the processed buffer, or into the detector for frames held back
+	// from earlier buffers. Valid until the next call.
+	const void *data;
+	// Position of the first frame relative to the start of the processed
+	// buffer, negative for held back frames
+	int64_t offset;
+	size_t count;
+	bool active;
+} span;
+
+// Energy gate with hysteresis, evaluated every 10ms. Opens when a block is
+// above "opendb" (dBFS RMS) and closes after the level stayed below "closedb"
+// for "holdms". If "sidecar" is given, every active span is logged there with
+// its source position, output position and wall clock time.
+detector *newdetector(int nchannels, int samplerate, double opendb, double closedb, int holdms, const char *sidecar = nullptr);
+// Splits a buffer into runs of active and inactive frames. Every block takes
+// the state decided by its own level, so the first block of a burst is
+// kept. Frames are held back until their block is complete, up to 10ms.
+void process(detector *det, const void *buf, size_t framecount, capture::pcm_type intype, std::vector<span> &spans);
+// Decides the last, partial block from what it has and returns its frames,
+// positioned relative to the end of the last buffer. Call when the input ends.
+void flush(detector *det, std::vector<span> &spans);
+void close(detector *det);
+
+typedef struct trigger trigger;
+
+typedef struct region
+{
+	const void *data;
+	size_t count;
+} region;
+
+// Holds audio back until any sample peaks at "db" (dBFS) or above. The last
+// "prerollms" before that point are kept in a ring allocated up front, so
+// the attack is not lost.
+trigger *newtrigger(int nchannels, int samplerate, capture::pcm_type intype, double db, int prerollms);
+// Returns the frame of "buf" where the trigger fired, or "framecount" if it
+// did not. The frames before it go into the pre-roll ring.
+size_t detect(trigger *trig, const void *buf, size_t framecount);
+bool triggered(trigger *trig) noexcept;
+// The pre-roll in order, in up to two parts. Valid until the next detect().
+// Returns the total frame count.
+size_t preroll(trigger *trig, region parts[2]);
+void close(trigger *trig);
+
+}
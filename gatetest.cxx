@@ -0,0 +1,159 @@
+// Test for the activity gate. Bursts of tone in silence are fed through
+// gate::detector in buffers of many sizes, and every frame must come out
+// exactly once, at its source position, with every frame of a burst kept.
+// The trigger must stay quiet on silence in every format:
+//   clang++ -O2 -std=c++14 gatetest.cxx gate.cxx wave.cxx peaks.cxx -o gatetest
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "gate.hxx"
+#include "wave.hxx"
+
+static constexpr int CHANNELS = 2;
+static constexpr int SAMPLE_RATE = 48000;
+
+typedef struct burst
+{
+	size_t start;
+	size_t count;
+} burst;
+
+// The first burst starts in the middle of a 10ms block, the second on a
+// block boundary, the third has one frame in its first block
+static const burst BURSTS[] = {{12345, 9000}, {48000, 4800}, {76799, 2400}};
+static constexpr size_t TOTAL_FRAMES = 96000;
+
+static std::vector<short> makeinput()
+{
+	std::vector<short> samples(TOTAL_FRAMES * CHANNELS, 0);
+
+	for (const burst &b: BURSTS)
+	{
+		for (size_t i = 0; i < b.count; i++)
+		{
+			// Full scale at the very first frame, so it cannot be mistaken
+			// for silence
+			short v = (short) (16384.0 * std::cos(2.0 * 3.14159265358979323846 * 1000.0 * i / SAMPLE_RATE));
+			for (int c = 0; c < CHANNELS; c++)
+				samples[(b.start + i) * CHANNELS + c] = v;
+		}
+	}
+
+	return samples;
+}
+
+// Returns the number of problems found
+static int runcase(const std::vector<short> &input, size_t bufferframes)
+{
+	gate::detector *det = gate::newdetector(CHANNELS, SAMPLE_RATE, -40.0, -46.0, 100);
+	std::vector<gate::span> spans;
+	std::vector<bool> active(TOTAL_FRAMES, false);
+	size_t frameSize = CHANNELS * sizeof(short);
+	size_t next = 0;
+	int problems = 0;
+
+	auto check = [&](size_t base)
+	{
+		for (const gate::span &span: spans)
+		{
+			size_t position = (size_t) ((int64_t) base + span.offset);
+			if (position != next || position + span.count > TOTAL_FRAMES || memcmp(span.data, &input[position * CHANNELS], span.count * frameSize) != 0)
+			{
+				if (problems++ == 0)
+					fprintf(stderr, "%zu frame buffers: wrong frames at %zu, expected %zu\n", bufferframes, position, next);
+
+				continue;
+			}
+
+			std::fill(active.begin() + position, active.begin() + position + span.count, span.active);
+			next = position + span.count;
+		}
+	};
+
+	for (size_t pos = 0; pos < TOTAL_FRAMES; pos += bufferframes)
+	{
+		size_t count = std::min(bufferframes, TOTAL_FRAMES - pos);
+		gate::process(det, &input[pos * CHANNELS], count, capture::pcm_type::pcm_s16, spans);
+		check(pos);
+	}
+
+	gate::flush(det, spans);
+	check(TOTAL_FRAMES);
+	gate::close(det);
+
+	if (next != TOTAL_FRAMES)
+	{
+		fprintf(stderr, "%zu frame buffers: %zu of %zu frames came out\n", bufferframes, next, TOTAL_FRAMES);
+		problems++;
+	}
+
+	for (const burst &b: BURSTS)
+	{
+		size_t kept = (size_t) std::count(active.begin() + b.start, active.begin() + b.start + b.count, true);
+		if (!active[b.start] || kept != b.count)
+		{
+			fprintf(stderr, "%zu frame buffers: burst at %zu kept %zu of %zu frames, first frame %s\n",
+				bufferframes, b.start, kept, b.count, active[b.start] ? "kept" : "dropped");
+			problems++;
+		}
+	}
+
+	// Silence long before the first burst stays out
+	if (active[0])
+	{
+		fprintf(stderr, "%zu frame buffers: silence at the start was kept\n", bufferframes);
+		problems++;
+	}
+
+	return problems;
+}
+
+static constexpr size_t TRIGGER_FRAMES = 4800;
+static constexpr size_t TRIGGER_AT = 1234;
+
+// "silence" is the zero of the format, "quiet" is a little above -48 dBFS
+template<typename T>
+static int runtrigger(const char *name, capture::pcm_type type, T silence, T quiet)
+{
+	std::vector<T> samples(TRIGGER_FRAMES * CHANNELS, silence);
+	int problems = 0;
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		size_t expected = pass == 0 ? TRIGGER_FRAMES : TRIGGER_AT;
+		if (pass == 1)
+			samples[TRIGGER_AT * CHANNELS + CHANNELS - 1] = quiet;
+
+		gate::trigger *trig = gate::newtrigger(CHANNELS, SAMPLE_RATE, type, -48.0, 10);
+		size_t at = gate::detect(trig, samples.data(), TRIGGER_FRAMES);
+		gate::close(trig);
+
+		if (at != expected)
+		{
+			fprintf(stderr, "%s trigger: fired at %zu, expected %zu\n", name, at, expected);
+			problems++;
+		}
+	}
+
+	return problems;
+}
+
+int main()
+{
+	std::vector<short> input = makeinput();
+	const size_t bufferSizes[] = {1, 7, 100, 479, 480, 481, 1024, 4800, TOTAL_FRAMES};
+	int problems = 0;
+
+	for (size_t frames: bufferSizes)
+		problems += runcase(input, frames);
+
+	problems += runtrigger<unsigned char>("pcm_u8", capture::pcm_type::pcm_u8, 127, 129);
+	problems += runtrigger<short>("pcm_s16", capture::pcm_type::pcm_s16, 0, 200);
+	problems += runtrigger<float>("pcm_f32", capture::pcm_type::pcm_f32, 0.0f, 0.01f);
+
+	printf("%s\n", problems == 0 ? "OK" : "FAILED");
+	return problems == 0 ? 0 : 1;
+}
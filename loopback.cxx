@@ -0,0 +1,366 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "capture.hxx"
+#include "flac.hxx"
+#include "planar.hxx"
+#include "trace.hxx"
+#include "wave.hxx"
+
+#define LOOPBACK_BUILD
+#include "loopback.h"
+
+static_assert((int) capture::pcm_type::pcm_u8 == LOOPBACK_FORMAT_U8 && (int) capture::pcm_type::pcm_s16 == LOOPBACK_FORMAT_S16 && (int) capture::pcm_type::pcm_f32 == LOOPBACK_FORMAT_F32, "loopback_format must match capture::pcm_type");
+
+static thread_local std::string lastError;
+
+static int fail(int status, const std::string &message)
+{
+	lastError = message;
+	return status;
+}
+
+static bool validformat(int format)
+{
+	return format > LOOPBACK_FORMAT_UNKNOWN && format <= LOOPBACK_FORMAT_F32;
+}
+
+struct loopback
+{
+	loopback(const char *device, bool partial);
+	~loopback();
+
+	int getInfo(loopback_info *info);
+	int setCallback(loopback_callback cb, void *data);
+	int setPlanar(bool enable);
+	int start(size_t bufferframes);
+	int stop();
+private:
+	capture::context *ctx;
+	capture::device_info devinfo;
+	loopback_callback callback;
+	void *userdata;
+	bool planar;
+
+	std::thread worker;
+	std::atomic<bool> running;
+	bool started;
+	// Set by the worker when the device failed
+	std::string error;
+
+	void run();
+};
+
+loopback::loopback(const char *device, bool partial)
+: ctx(capture::open(device ? device : "", partial ? capture::name_match::partial : capture::name_match::exact))
+, devinfo(capture::getinfo(ctx))
+, callback(nullptr)
+, userdata(nullptr)
+, planar(false)
+, worker()
+, running(false)
+, started(false)
+, error()
+{
+}
+
+loopback::~loopback()
+{
+	if (worker.joinable())
+		stop();
+
+	capture::close(ctx);
+}
+
+// loopback_info as of version 1. Callers built against it stay valid when
+// fields are added, so fields after it are only filled when they fit in
+// "size".
+static constexpr size_t INFO_V1_SIZE = offsetof(loopback_info, name) + sizeof(loopback_info::name);
+
+int loopback::getInfo(loopback_info *info)
+{
+	if (info == nullptr || info->size < INFO_V1_SIZE)
+		return fail(LOOPBACK_ERROR_ARGUMENT, "info is null or too small");
+
+	info->sample_rate = devinfo.sampleRate;
+	info->channels = devinfo.channels;
+	info->bits_per_sample = devinfo.bitsPerSample;
+	info->format = (int32_t) devinfo.dataType;
+
+	size_t length = std::min(devinfo.name.size(), sizeof(info->name) - 1);
+	memcpy(info->name, devinfo.name.data(), length);
+	info->name[length] = 0;
+	return LOOPBACK_OK;
+}
+
+int loopback::setCallback(loopback_callback cb, void *data)
+{
+	if (started)
+		return fail(LOOPBACK_ERROR_STATE, "capture already started");
+
+	callback = cb;
+	userdata = data;
+	return LOOPBACK_OK;
+}
+
+int loopback::setPlanar(bool enable)
+{
+	if (started)
+		return fail(LOOPBACK_ERROR_STATE, "capture already started");
+
+	planar = enable;
+	return LOOPBACK_OK;
+}
+
+int loopback::start(size_t bufferframes)
+{
+	if (started)
+		return fail(LOOPBACK_ERROR_STATE, "capture already started");
+
+	if (callback == nullptr)
+		return fail(LOOPBACK_ERROR_STATE, "no callback set");
+
+	if (!capture::start(ctx, bufferframes > 0 ? bufferframes : 16384))
+		return fail(LOOPBACK_ERROR_DEVICE, "cannot start capture");
+
+	started = true;
+	running = true;
+	worker = std::thread(&loopback::run, this);
+	return LOOPBACK_OK;
+}
+
+int loopback::stop()
+{
+	if (!worker.joinable())
+		return started ? LOOPBACK_OK : fail(LOOPBACK_ERROR_STATE, "capture not started");
+
+	running = false;
+	worker.join();
+
+	try
+	{
+		capture::stop(ctx);
+	}
+	catch (const std::runtime_error &e)
+	{
+		if (error.empty())
+			error = e.what();
+	}
+
+	return error.empty() ? LOOPBACK_OK : fail(LOOPBACK_ERROR_DEVICE, error);
+}
+
+void loopback::run()
+{
+	TRACE_THREAD("callback");
+
+	size_t framesize = devinfo.channels * (devinfo.bitsPerSample / 8);
+	std::vector<unsigned char> buffer;
+	planar::block block;
+
+	loopback_packet packet;
+	memset(&packet, 0, sizeof(packet));
+	packet.size = sizeof(packet);
+
+	if (planar)
+	{
+		planar::reset(block, devinfo.channels, capture::buffersize(ctx));
+		packet.format = LOOPBACK_FORMAT_F32;
+		packet.planes = block.planes.data();
+	}
+	else
+	{
+		buffer.resize(capture::buffersize(ctx) * framesize);
+		packet.format = (int32_t) devinfo.dataType;
+		packet.data = buffer.data();
+	}
+
+	try
+	{
+		while (running)
+		{
+			capture::buffer_info info;
+			size_t frames = planar
+				? capture::getplanar(ctx, block.planes.data(), block.capacity, info)
+				: capture::getbuf(ctx, buffer.data(), buffer.size(), info) / framesize;
+
+			if (frames == 0)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+				continue;
+			}
+
+			packet.frames = frames;
+			packet.position = info.position;
+			packet.timestamp = info.timestamp;
+			packet.packets = (uint32_t) info.packets;
+			packet.silent_packets = (uint32_t) info.silentPackets;
+			packet.discontinuity = info.discontinuity;
+			callback(userdata, &packet);
+		}
+	}
+	catch (const std::runtime_error &e)
+	{
+		error = e.what();
+	}
+}
+
+struct loopback_writer
+{
+	wave::writer *wav;
+	flac::writer *fl;
+};
+
+extern "C"
+{
+
+uint32_t loopback_version(void)
+{
+	return LOOPBACK_ABI_VERSION;
+}
+
+const char *loopback_last_error(void)
+{
+	return lastError.c_str();
+}
+
+int loopback_open(const char *device, int partial_match, loopback **result)
+{
+	if (result == nullptr)
+		return fail(LOOPBACK_ERROR_ARGUMENT, "result is null");
+
+	try
+	{
+		*result = new loopback(device, partial_match != 0);
+		return LOOPBACK_OK;
+	}
+	catch (const std::runtime_error &e)
+	{
+		*result = nullptr;
+		return fail(LOOPBACK_ERROR_DEVICE, e.what());
+	}
+}
+
+int loopback_get_info(loopback *lb, loopback_info *info)
+{
+	if (lb == nullptr)
+		return fail(LOOPBACK_ERROR_ARGUMENT, "handle is null");
+
+	return lb->getInfo(info);
+}
+
+int loopback_set_callback(loopback *lb, loopback_callback callback, void *userdata)
+{
+	if (lb == nullptr)
+		return fail(LOOPBACK_ERROR_ARGUMENT, "handle is null");
+
+	return lb->setCallback(callback, userdata);
+}
+
+int loopback_set_planar(loopback *lb, int planar)
+{
+	if (lb == nullptr)
+		return fail(LOOPBACK_ERROR_ARGUMENT, "handle is null");
+
+	return lb->setPlanar(planar != 0);
+}
+
+int loopback_start(loopback *lb, size_t buffer_frames)
+{
+	if (lb == nullptr)
+		return fail(LOOPBACK_ERROR_ARGUMENT, "handle is null");
+
+	try
+	{
+		return lb->start(buffer_frames);
+	}
+	catch (const std::runtime_error &e)
+	{
+		return fail(LOOPBACK_ERROR_DEVICE, e.what());
+	}
+}
+
+int loopback_stop(loopback *lb)
+{
+	if (lb == nullptr)
+		return fail(LOOPBACK_ERROR_ARGUMENT, "handle is null");
+
+	return lb->stop();
+}
+
+void loopback_close(loopback *lb)
+{
+	delete lb;
+}
+
+int loopback_writer_open(const char *path, int channels, int sample_rate, int codec, loopback_writer **result)
+{
+	if (result == nullptr || path == nullptr || channels <= 0 || sample_rate <= 0)
+		return fail(LOOPBACK_ERROR_ARGUMENT, "invalid argument");
+
+	*result = nullptr;
+	loopback_writer *w = new loopback_writer();
+
+	try
+	{
+		switch (codec)
+		{
+		case LOOPBACK_CODEC_PCM_U8:
+			w->wav = wave::newwriter(path, channels, sample_rate, capture::pcm_type::pcm_u8);
+			break;
+		case LOOPBACK_CODEC_PCM_S16:
+			w->wav = wave::newwriter(path, channels, sample_rate, capture::pcm_type::pcm_s16);
+			break;
+		case LOOPBACK_CODEC_IMA_ADPCM:
+		{
+			wave::options opts;
+			opts.format = wave::encoding::ima_adpcm;
+			w->wav = wave::newwriter(path, channels, sample_rate, capture::pcm_type::pcm_s16, opts);
+			break;
+		}
+		case LOOPBACK_CODEC_FLAC:
+			w->fl = flac::newwriter(path, channels, sample_rate);
+			break;
+		default:
+			delete w;
+			return fail(LOOPBACK_ERROR_ARGUMENT, "unknown codec");
+		}
+	}
+	catch (const std::runtime_error &e)
+	{
+		delete w;
+		return fail(LOOPBACK_ERROR_IO, e.what());
+	}
+
+	*result = w;
+	return LOOPBACK_OK;
+}
+
+int loopback_writer_write(loopback_writer *writer, const void *data, size_t frames, int format)
+{
+	if (writer == nullptr || (data == nullptr && frames > 0) || !validformat(format))
+		return fail(LOOPBACK_ERROR_ARGUMENT, "invalid argument");
+
+	capture::pcm_type intype = (capture::pcm_type) format;
+	bool result = writer->wav ? wave::write(writer->wav, data, frames, intype) : flac::write(writer->fl, data, frames, intype);
+	return result ? LOOPBACK_OK : fail(LOOPBACK_ERROR_IO, "write failed");
+}
+
+int loopback_writer_close(loopback_writer *writer)
+{
+	if (writer == nullptr)
+		return fail(LOOPBACK_ERROR_ARGUMENT, "handle is null");
+
+	bool result = writer->wav ? wave::close(writer->wav) : flac::close(writer->fl);
+	delete writer;
+	return result ? LOOPBACK_OK : fail(LOOPBACK_ERROR_IO, "cannot finish file");
+}
+
+}
@@ -0,0 +1,125 @@
+/* C interface to the loopback capture and the file writers, for linking
+ * the capture into another process instead of reading its stdout.
+ * Build the library with LOOPBACK_BUILD defined. */
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#ifdef LOOPBACK_BUILD
+#define LOOPBACK_API __declspec(dllexport)
+#else
+#define LOOPBACK_API __declspec(dllimport)
+#endif
+#else
+#define LOOPBACK_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bumped on incompatible changes. Structs with a "size" field may grow at the
+ * end without a bump, so set "size" to sizeof() before passing them in. Only
+ * the fields that fit in "size" are filled, and anything at least as large
+ * as the version 1 struct is accepted. */
+#define LOOPBACK_ABI_VERSION 1
+
+typedef struct loopback loopback;
+typedef struct loopback_writer loopback_writer;
+
+typedef enum loopback_status
+{
+	LOOPBACK_OK = 0,
+	LOOPBACK_ERROR_ARGUMENT = -1,
+	LOOPBACK_ERROR_DEVICE = -2,
+	LOOPBACK_ERROR_STATE = -3,
+	LOOPBACK_ERROR_IO = -4
+} loopback_status;
+
+typedef enum loopback_format
+{
+	LOOPBACK_FORMAT_UNKNOWN = 0,
+	LOOPBACK_FORMAT_U8 = 1,
+	LOOPBACK_FORMAT_S16 = 2,
+	LOOPBACK_FORMAT_F32 = 3
+} loopback_format;
+
+typedef enum loopback_codec
+{
+	LOOPBACK_CODEC_PCM_U8 = 0,
+	LOOPBACK_CODEC_PCM_S16 = 1,
+	LOOPBACK_CODEC_IMA_ADPCM = 2,
+	LOOPBACK_CODEC_FLAC = 3
+} loopback_codec;
+
+typedef struct loopback_info
+{
+	uint32_t size;
+	int32_t sample_rate;
+	int32_t channels;
+	int32_t bits_per_sample;
+	int32_t format;
+	/* UTF-8, truncated if needed */
+	char name[256];
+} loopback_info;
+
+typedef struct loopback_packet
+{
+	uint32_t size;
+	/* Interleaved frames in the device format, valid during the callback.
+	 * NULL with loopback_set_planar(). */
+	const void *data;
+	size_t frames;
+	int32_t format;
+	/* Device position of the first frame, in frames */
+	uint64_t position;
+	/* Performance counter time of the first frame, in 100ns units */
+	uint64_t timestamp;
+	uint32_t packets;
+	uint32_t silent_packets;
+	/* Audio was lost before this packet */
+	int32_t discontinuity;
+	/* With loopback_set_planar(), one array of "frames" floats per channel,
+	 * valid during the callback. NULL otherwise. */
+	const float *const *planes;
+} loopback_packet;
+
+/* Runs on the capture thread. Return quickly, the device buffer keeps
+ * filling meanwhile. */
+typedef void (*loopback_callback)(void *userdata, const loopback_packet *packet);
+
+LOOPBACK_API uint32_t loopback_version(void);
+/* Message for the last failed call on this thread */
+LOOPBACK_API const char *loopback_last_error(void);
+
+/* An empty or NULL "device" picks the default output device. With
+ * "partial_match" a device whose name contains "device" is used. */
+LOOPBACK_API int loopback_open(const char *device, int partial_match, loopback **result);
+LOOPBACK_API int loopback_get_info(loopback *lb, loopback_info *info);
+/* Only before loopback_start() */
+LOOPBACK_API int loopback_set_callback(loopback *lb, loopback_callback callback, void *userdata);
+/* Only before loopback_start(). Packets then carry float samples split per
+ * channel in "planes" instead of "data", ready for per channel processing. */
+LOOPBACK_API int loopback_set_planar(loopback *lb, int planar);
+/* Starts the capture thread. "buffer_frames" is the device buffer length, 0
+ * picks a default. A stopped capture cannot be started again. */
+LOOPBACK_API int loopback_start(loopback *lb, size_t buffer_frames);
+/* Waits for the capture thread. Fails if it stopped early on a device
+ * error. */
+LOOPBACK_API int loopback_stop(loopback *lb);
+LOOPBACK_API void loopback_close(loopback *lb);
+
+/* WAV or FLAC file. "format" in loopback_writer_write() is the format of
+ * "data" and is converted as needed. */
+LOOPBACK_API int loopback_writer_open(const char *path, int channels, int sample_rate, int codec, loopback_writer **result);
+LOOPBACK_API int loopback_writer_write(loopback_writer *writer, const void *data, size_t frames, int format);
+LOOPBACK_API int loopback_writer_close(loopback_writer *writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
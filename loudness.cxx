@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "fileio.hxx"
+#include "loudness.hxx"
+#include "trace.hxx"
+#include "wave.hxx"
+
+namespace loudness
+{
+
+static constexpr double GATE_LUFS = -70.0;
+static constexpr double MAX_LUFS = 5.0;
+static constexpr double BIN_LU = 0.01;
+static constexpr size_t BIN_COUNT = (size_t) ((MAX_LUFS - GATE_LUFS) / BIN_LU);
+// A block is 4 sub-blocks of 100 ms
+static constexpr size_t SUB_BLOCKS = 4;
+static constexpr size_t APPLY_FRAMES = 65536;
+
+static double tolufs(double power)
+{
+	return -0.691 + 10.0 * std::log10(power);
+}
+
+static double topower(double lufs)
+{
+	return std::pow(10.0, (lufs + 0.691) / 10.0);
+}
+
+typedef struct biquad
+{
+	double b0, b1, b2, a1, a2;
+} biquad;
+
+struct meter
+{
+	meter(int nchannels, int samplerate);
+
+	void add(const planar::block &block);
+	double integrated() const;
+	float peak;
+private:
+	size_t channels;
+	size_t subFrames;
+	size_t subFill;
+	uint64_t subCount;
+	// K-weighting: a high shelf for the head, then a high pass
+	biquad shelf;
+	biquad highpass;
+	// Per channel, two states for each filter
+	std::vector<double> state;
+	std::vector<double> energy;
+	std::vector<double> weights;
+	double subPower[SUB_BLOCKS];
+	std::vector<uint64_t> histogram;
+	std::vector<double> binPower;
+
+	void endsubblock();
+};
+
+meter::meter(int nchannels, int samplerate)
+: peak(0.0f)
+, channels(nchannels)
+, subFrames(std::max((samplerate + 5) / 10, 1))
+, subFill(0)
+, subCount(0)
+, shelf()
+, highpass()
+, state(nchannels * 4, 0.0)
+, energy(nchannels, 0.0)
+, weights(nchannels, 1.0)
+, subPower()
+, histogram(BIN_COUNT, 0)
+, binPower(BIN_COUNT)
+{
+	const double pi = 3.14159265358979323846;
+
+	// The filters of BS.1770 are given for 48 kHz, these are the analog
+	// prototypes they come from, for any rate
+	double k = std::tan(pi * 1681.974450955533 / samplerate);
+	double q = 0.7071752369554196;
+	double vh = std::pow(10.0, 3.999843853973347 / 20.0);
+	double vb = std::pow(vh, 0.4996667741545416);
+	double a0 = 1.0 + k / q + k * k;
+	shelf = {
+		(vh + vb * k / q + k * k) / a0,
+		2.0 * (k * k - vh) / a0,
+		(vh - vb * k / q + k * k) / a0,
+		2.0 * (k * k - 1.0) / a0,
+		(1.0 - k / q + k * k) / a0
+	};
+
+	k = std::tan(pi * 38.13547087602444 / samplerate);
+	q = 0.5003270373238773;
+	a0 = 1.0 + k / q + k * k;
+	highpass = {1.0, -2.0, 1.0, 2.0 * (k * k - 1.0) / a0, (1.0 - k / q + k * k) / a0};
+
+	// 5.1 and 7.1 in WAVE order: the LFE does not count, the surrounds
+	// count 1.5 dB more
+	if (nchannels == 6 || nchannels == 8)
+	{
+		weights[3] = 0.0;
+		for (int c = 4; c < nchannels; c++)
+			weights[c] = 1.41;
+	}
+
+	for (size_t i = 0; i < BIN_COUNT; i++)
+		binPower[i] = topower(GATE_LUFS + (i + 0.5) * BIN_LU);
+}
+
+void meter::add(const planar::block &block)
+{
+	TRACE_SCOPE("loudness");
+
+	for (size_t done = 0; done < block.frames;)
+	{
+		size_t count = std::min(block.frames - done, subFrames - subFill);
+
+		for (size_t c = 0; c < channels; c++)
+		{
+			const float *x = block.planes[c] + done;
+			double *s = &state[c * 4];
+			double sum = 0.0;
+			float top = peak;
+
+			for (size_t i = 0; i < count; i++)
+			{
+				double v = x[i];
+				top = std::max(top, std::fabs(x[i]));
+
+				double y = shelf.b0 * v + s[0];
+				s[0] = shelf.b1 * v - shelf.a1 * y + s[1];
+				s[1] = shelf.b2 * v - shelf.a2 * y;
+
+				double z = highpass.b0 * y + s[2];
+				s[2] = highpass.b1 * y - highpass.a1 * z + s[3];
+				s[3] = highpass.b2 * y - highpass.a2 * z;
+
+				sum += z * z;
+			}
+
+			energy[c] += sum;
+			peak = top;
+		}
+
+		subFill += count;
+		done += count;
+
+		if (subFill == subFrames)
+			endsubblock();
+	}
+}
+
+void meter::endsubblock()
+{
+	double power = 0.0;
+	for (size_t c = 0; c < channels; c++)
+	{
+		power += weights[c] * energy[c] / subFrames;
+		energy[c] = 0.0;
+	}
+
+	subPower[subCount % SUB_BLOCKS] = power;
+	subFill = 0;
+	subCount++;
+
+	if (subCount < SUB_BLOCKS)
+		return;
+
+	double block = 0.0;
+	for (double p: subPower)
+		block += p / SUB_BLOCKS;
+
+	double lufs = tolufs(block);
+	if (lufs > GATE_LUFS)
+		histogram[std::min((size_t) ((lufs - GATE_LUFS) / BIN_LU), BIN_COUNT - 1)]++;
+}
+
+double meter::integrated() const
+{
+	uint64_t count = 0;
+	double sum = 0.0;
+
+	for (size_t i = 0; i < BIN_COUNT; i++)
+	{
+		count += histogram[i];
+		sum += histogram[i] * binPower[i];
+	}
+
+	if (count == 0)
+		return -HUGE_VAL;
+
+	// Blocks below this are left out, by the middle of their bin
+	double relative = tolufs(sum / count) - 10.0;
+	size_t first = (size_t) std::max(std::ceil((relative - GATE_LUFS) / BIN_LU - 0.5), 0.0);
+	count = 0;
+	sum = 0.0;
+
+	for (size_t i = first; i < BIN_COUNT; i++)
+	{
+		count += histogram[i];
+		sum += histogram[i] * binPower[i];
+	}
+
+	return count > 0 ? tolufs(sum / count) : -HUGE_VAL;
+}
+
+meter *newmeter(int nchannels, int samplerate)
+{
+	return new meter(nchannels, samplerate);
+}
+
+void add(meter *meter, const planar::block &block)
+{
+	meter->add(block);
+}
+
+double integrated(meter *meter)
+{
+	return meter->integrated();
+}
+
+float peak(meter *meter)
+{
+	return meter->peak;
+}
+
+double gain(meter *meter, const options &opts)
+{
+	double lufs = meter->integrated();
+	if (lufs == -HUGE_VAL)
+		return 0.0;
+
+	double result = opts.targetLufs - lufs;
+	if (meter->peak > 0.0f)
+		result = std::min(result, opts.ceilingDb - 20.0 * std::log10((double) meter->peak));
+
+	return result;
+}
+
+void close(meter *meter)
+{
+	delete meter;
+}
+
+static void putuint32(unsigned char *p, uint32_t v)
+{
+	for (size_t i = 0; i < 4; i++)
+		p[i] = (unsigned char) (v >> (i * 8));
+}
+
+uint64_t applygain(const char *path, float gain, capture::pcm_type outtype)
+{
+	TRACE_SCOPE("applygain");
+
+	fileio::mapping *m = fileio::map(path, true);
+	unsigned char *base = fileio::writabledata(m);
+	uint64_t length = fileio::size(m);
+	fileio::wav_info info;
+
+	// The header is rewritten in place, so it must be the one pcmheader()
+	// makes
+	if (!fileio::parsewav(base, length, info) || info.format != capture::pcm_type::pcm_f32 || info.dataOffset != wave::PCM_HEADER_SIZE)
+	{
+		fileio::unmap(m);
+		throw std::runtime_error(std::string(path) + " is not a float WAV file");
+	}
+
+	// The writer has finished the file, so the declared size holds even when
+	// it is 0
+	uint64_t declared = 0;
+	for (size_t i = 0; i < 4; i++)
+		declared |= (uint64_t) base[info.dataOffset - 4 + i] << (i * 8);
+
+	info.dataSize = std::min(declared, length - info.dataOffset);
+	info.frames = info.dataSize / info.blockAlign;
+
+	size_t outsize = wave::pcmtype_size(outtype);
+	size_t blockSamples = APPLY_FRAMES * info.channels;
+	std::vector<float> scaled(blockSamples);
+	std::vector<wave::channel_levels> levels(info.channels, wave::channel_levels {0, 0.0f});
+	const float *src = (const float *) (base + info.dataOffset);
+	unsigned char *dest = base + info.dataOffset;
+	uint64_t samplecount = info.frames * info.channels;
+
+	fileio::prefetch(m, info.dataOffset, blockSamples * sizeof(float));
+
+	// The output is smaller and trails the input, and every block is read
+	// whole before it is written, so the two never overlap
+	for (uint64_t i = 0; i < samplecount; i += blockSamples)
+	{
+		size_t count = (size_t) std::min<uint64_t>(blockSamples, samplecount - i);
+		fileio::prefetch(m, info.dataOffset + (i + count) * sizeof(float), blockSamples * sizeof(float));
+
+		for (size_t j = 0; j < count; j++)
+			scaled[j] = src[i + j] * gain;
+
+		wave::convert(dest + i * outsize, outtype, scaled.data(), capture::pcm_type::pcm_f32, count / info.channels, info.channels, levels.data());
+	}
+
+	// Cue points and anything else after the data, on an even offset
+	uint64_t dataSize = samplecount * outsize;
+	uint64_t oldEnd = info.dataOffset + info.dataSize + (info.dataSize & 1);
+	uint64_t newEnd = info.dataOffset + dataSize;
+	uint64_t trailing = length > oldEnd ? length - oldEnd : 0;
+
+	if (dataSize & 1)
+		base[newEnd++] = 0;
+
+	memmove(base + newEnd, base + oldEnd, (size_t) trailing);
+	newEnd += trailing;
+
+	wave::pcmheader(base, info.channels, info.sampleRate, outtype, (uint32_t) dataSize);
+	putuint32(base + 4, (uint32_t) (newEnd - 8));
+	fileio::unmap(m);
+
+	if (!fileio::resize(path, newEnd))
+		throw std::runtime_error(std::string("Cannot write ") + path);
+
+	uint64_t clipped = 0;
+	for (const wave::channel_levels &l: levels)
+		clipped += l.clipped;
+
+	return clipped;
+}
+
+}
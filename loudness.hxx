@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "capture.hxx"
+#include "planar.hxx"
+
+namespace loudness
+{
+
+// Integrated loudness after ITU-R BS.1770: K-weighted, 400 ms blocks every
+// 100 ms, gated at -70 LUFS and 10 LU below the ungated mean. Block levels go
+// into a fixed histogram of 0.01 LU steps, so memory does not grow with the
+// length of the recording. Also keeps the sample peak.
+typedef struct meter meter;
+
+typedef struct options
+{
+	// Integrated loudness to reach, in LUFS
+	double targetLufs = -23.0;
+	// The gain is lowered so that sample peaks stay at or below this
+	// (dBFS). Nothing is limited, so this avoids clipping by giving up on
+	// the target.
+	double ceilingDb = -1.0;
+} options;
+
+meter *newmeter(int nchannels, int samplerate);
+// Takes the "frames" of "block", one channel at a time
+void add(meter *meter, const planar::block &block);
+// LUFS, -HUGE_VAL until a block passes the gates
+double integrated(meter *meter);
+// Largest magnitude of any channel, 1.0 is full scale
+float peak(meter *meter);
+// Gain in dB that brings the audio so far to "opts". 0 if nothing passed
+// the gates.
+double gain(meter *meter, const options &opts);
+void close(meter *meter);
+
+// Multiplies the float samples of "path", a file finished by wave::writer,
+// by "gain" and converts them in place to "outtype" through a writable
+// mapping, one pass over the data. Chunks after the data (cue points) move
+// up behind it and the file is cut to its new length. Until this returns the
+// file holds a mix of both formats. Returns the samples that clipped.
+uint64_t applygain(const char *path, float gain, capture::pcm_type outtype);
+
+}
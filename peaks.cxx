@@ -0,0 +1,339 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "peaks.hxx"
+#include "trace.hxx"
+
+namespace peaks
+{
+
+static constexpr uint32_t PEAK_VERSION = 1;
+static constexpr size_t HEADER_SIZE = 48;
+static constexpr size_t TOTAL_FRAMES_OFF = 32;
+// Accumulator lanes per channel, so the inner loops run over a wide
+// contiguous stride the compiler can vectorize
+static constexpr size_t LANE_SAMPLES = 16;
+
+template<typename T>
+inline bool writeint(FILE *f, T v)
+{
+	return fwrite(&v, 1, sizeof(v), f) == sizeof(v);
+}
+
+typedef struct summary
+{
+	float min;
+	float max;
+	double sumsquares;
+	size_t frames;
+} summary;
+
+static void reset(std::vector<summary> &s)
+{
+	for (summary &v: s)
+		v = {1.0f, -1.0f, 0.0, 0};
+}
+
+// Folds "count" frames into "acc", one summary per channel. Samples are
+// normalized to [-1, 1] first, the same way wave::convert does it.
+template<typename T>
+static void summarize(const T *buf, size_t count, size_t channels, float offset, float scale, std::vector<float> &lanemin, std::vector<float> &lanemax, std::vector<float> &lanesq, std::vector<summary> &acc)
+{
+	size_t stride = channels * std::max<size_t>(LANE_SAMPLES / channels, 1);
+	size_t samplecount = count * channels;
+	size_t whole = samplecount / stride * stride;
+
+	std::fill(lanemin.begin(), lanemin.begin() + stride, 1.0f);
+	std::fill(lanemax.begin(), lanemax.begin() + stride, -1.0f);
+	std::fill(lanesq.begin(), lanesq.begin() + stride, 0.0f);
+
+	float *mn = lanemin.data();
+	float *mx = lanemax.data();
+	float *sq = lanesq.data();
+
+	for (size_t i = 0; i < whole; i += stride)
+	{
+		for (size_t j = 0; j < stride; j++)
+		{
+			float v = (buf[i + j] - offset) * scale;
+			mn[j] = std::min(mn[j], v);
+			mx[j] = std::max(mx[j], v);
+			sq[j] += v * v;
+		}
+	}
+
+	// A partial stride always starts at channel 0
+	for (size_t j = 0; whole + j < samplecount; j++)
+	{
+		float v = (buf[whole + j] - offset) * scale;
+		mn[j] = std::min(mn[j], v);
+		mx[j] = std::max(mx[j], v);
+		sq[j] += v * v;
+	}
+
+	for (size_t j = 0; j < stride; j++)
+	{
+		summary &s = acc[j % channels];
+		s.min = std::min(s.min, mn[j]);
+		s.max = std::max(s.max, mx[j]);
+		s.sumsquares += sq[j];
+	}
+
+	for (summary &s: acc)
+		s.frames += count;
+}
+
+struct builder
+{
+	builder(const char *path, int nchannels, int samplerate, size_t baseframes, size_t factor, int levels);
+	~builder();
+
+	bool add(const void *buf, size_t framecount, capture::pcm_type intype);
+	bool finish();
+private:
+	FILE *file;
+	size_t channels;
+	size_t baseFrames;
+	size_t factor;
+	size_t levelCount;
+	uint64_t totalFrames;
+	uint64_t baseEntries;
+	bool failed;
+
+	// "pending[l]" is the entry of level "l" being filled. Levels above 0 are
+	// kept in memory until the end.
+	std::vector<std::vector<summary>> pending;
+	std::vector<size_t> pendingCount;
+	std::vector<std::vector<unsigned char>> levels;
+
+	std::vector<float> laneMin;
+	std::vector<float> laneMax;
+	std::vector<float> laneSquares;
+	std::vector<unsigned char> record;
+
+	void encode(const std::vector<summary> &s);
+	void emit(size_t level);
+	void complete(size_t level);
+};
+
+builder::builder(const char *path, int nchannels, int samplerate, size_t baseframes, size_t fac, int nlevels)
+: file(nullptr)
+, channels(nchannels)
+, baseFrames(std::max<size_t>(baseframes, 1))
+, factor(std::max<size_t>(fac, 2))
+, levelCount((size_t) std::max(nlevels, 1))
+, totalFrames(0)
+, baseEntries(0)
+, failed(false)
+, pending(levelCount, std::vector<summary>(nchannels))
+, pendingCount(levelCount, 0)
+, levels(levelCount)
+, laneMin(nchannels * LANE_SAMPLES)
+, laneMax(nchannels * LANE_SAMPLES)
+, laneSquares(nchannels * LANE_SAMPLES)
+, record(nchannels * 6)
+{
+	for (std::vector<summary> &p: pending)
+		reset(p);
+
+	// Room for an hour, so the coarser levels do not reallocate while
+	// recording
+	uint64_t frames = baseFrames;
+	for (size_t level = 1; level < levelCount; level++)
+	{
+		frames *= factor;
+		levels[level].reserve((size_t) ((uint64_t) samplerate * 3600 / frames + 1) * record.size());
+	}
+
+	file = fopen(path, "wb");
+	if (file == nullptr)
+		throw std::runtime_error(std::string("Cannot open peak file ") + path);
+
+	fwrite("LBPK", 1, 4, file);
+	writeint<uint32_t>(file, PEAK_VERSION);
+	writeint<uint32_t>(file, (uint32_t) channels);
+	writeint<uint32_t>(file, (uint32_t) samplerate);
+	writeint<uint32_t>(file, (uint32_t) baseFrames);
+	writeint<uint32_t>(file, (uint32_t) factor);
+	writeint<uint32_t>(file, (uint32_t) levelCount);
+	writeint<uint32_t>(file, 0);
+	writeint<uint64_t>(file, 0);
+	writeint<uint64_t>(file, 0);
+}
+
+builder::~builder()
+{
+	if (file)
+		fclose(file);
+}
+
+void builder::encode(const std::vector<summary> &s)
+{
+	unsigned char *out = record.data();
+
+	for (const summary &v: s)
+	{
+		float rms = v.frames > 0 ? (float) std::sqrt(v.sumsquares / v.frames) : 0.0f;
+		int16_t mn = (int16_t) lrintf(std::min(std::max(v.min, -1.0f), 1.0f) * 32767.0f);
+		int16_t mx = (int16_t) lrintf(std::min(std::max(v.max, -1.0f), 1.0f) * 32767.0f);
+		uint16_t r = (uint16_t) lrintf(std::min(rms, 1.0f) * 32767.0f);
+
+		out[0] = (unsigned char) mn;
+		out[1] = (unsigned char) ((uint16_t) mn >> 8);
+		out[2] = (unsigned char) mx;
+		out[3] = (unsigned char) ((uint16_t) mx >> 8);
+		out[4] = (unsigned char) r;
+		out[5] = (unsigned char) (r >> 8);
+		out += 6;
+	}
+}
+
+// Writes out the entry of "level" and folds it into the level above
+void builder::emit(size_t level)
+{
+	std::vector<summary> &s = pending[level];
+	encode(s);
+
+	if (level == 0)
+	{
+		if (fwrite(record.data(), 1, record.size(), file) != record.size())
+			failed = true;
+
+		baseEntries++;
+	}
+	else
+		levels[level].insert(levels[level].end(), record.begin(), record.end());
+
+	if (level + 1 < levelCount)
+	{
+		std::vector<summary> &up = pending[level + 1];
+		for (size_t c = 0; c < channels; c++)
+		{
+			up[c].min = std::min(up[c].min, s[c].min);
+			up[c].max = std::max(up[c].max, s[c].max);
+			up[c].sumsquares += s[c].sumsquares;
+			up[c].frames += s[c].frames;
+		}
+
+		pendingCount[level + 1]++;
+	}
+
+	reset(s);
+	pendingCount[level] = 0;
+}
+
+void builder::complete(size_t level)
+{
+	emit(level);
+
+	if (level + 1 < levelCount && pendingCount[level + 1] == factor)
+		complete(level + 1);
+}
+
+bool builder::add(const void *buf, size_t framecount, capture::pcm_type intype)
+{
+	TRACE_SCOPE("peaks");
+
+	const unsigned char *data = (const unsigned char *) buf;
+	size_t samplesize = intype == capture::pcm_type::pcm_f32 ? 4 : intype == capture::pcm_type::pcm_s16 ? 2 : 1;
+
+	while (framecount > 0)
+	{
+		size_t count = std::min(framecount, baseFrames - pendingCount[0]);
+
+		switch (intype)
+		{
+		case capture::pcm_type::pcm_u8:
+			summarize(data, count, channels, 127.0f, 1.0f / 127.0f, laneMin, laneMax, laneSquares, pending[0]);
+			break;
+		case capture::pcm_type::pcm_s16:
+			summarize((const short *) data, count, channels, 0.0f, 1.0f / 32767.0f, laneMin, laneMax, laneSquares, pending[0]);
+			break;
+		case capture::pcm_type::pcm_f32:
+			summarize((const float *) data, count, channels, 0.0f, 1.0f, laneMin, laneMax, laneSquares, pending[0]);
+			break;
+		default:
+			return false;
+		}
+
+		pendingCount[0] += count;
+		totalFrames += count;
+		data += count * channels * samplesize;
+		framecount -= count;
+
+		if (pendingCount[0] == baseFrames)
+			complete(0);
+	}
+
+	return !failed;
+}
+
+bool builder::finish()
+{
+	// Partial entries, from the bottom so each one still reaches the next level
+	for (size_t level = 0; level < levelCount; level++)
+	{
+		if (pendingCount[level] > 0)
+			emit(level);
+	}
+
+	size_t entrySize = channels * 6;
+	std::vector<uint64_t> offsets(levelCount);
+	std::vector<uint64_t> counts(levelCount);
+	uint64_t offset = HEADER_SIZE;
+
+	offsets[0] = offset;
+	counts[0] = baseEntries;
+	offset += baseEntries * entrySize;
+
+	for (size_t level = 1; level < levelCount; level++)
+	{
+		offsets[level] = offset;
+		counts[level] = levels[level].size() / entrySize;
+		offset += levels[level].size();
+		failed |= fwrite(levels[level].data(), 1, levels[level].size(), file) != levels[level].size();
+	}
+
+	uint64_t frames = baseFrames;
+	for (size_t level = 0; level < levelCount; level++)
+	{
+		writeint<uint32_t>(file, (uint32_t) std::min<uint64_t>(frames, UINT32_MAX));
+		writeint<uint32_t>(file, 0);
+		writeint<uint64_t>(file, offsets[level]);
+		writeint<uint64_t>(file, counts[level]);
+		frames *= factor;
+	}
+
+	// The index offset goes last, so a reader never sees a half written index
+	failed |= fflush(file) != 0;
+	fseek(file, (long) TOTAL_FRAMES_OFF, SEEK_SET);
+	writeint<uint64_t>(file, totalFrames);
+	writeint<uint64_t>(file, offset);
+
+	bool result = fclose(file) == 0 && !failed;
+	file = nullptr;
+	return result;
+}
+
+builder *newbuilder(const char *path, int nchannels, int samplerate, size_t baseframes, size_t factor, int levels)
+{
+	return new builder(path, nchannels, samplerate, baseframes, factor, levels);
+}
+
+bool add(builder *builder, const void *buf, size_t framecount, capture::pcm_type intype)
+{
+	return builder->add(buf, framecount, intype);
+}
+
+bool close(builder *builder)
+{
+	bool result = builder->finish();
+	delete builder;
+	return result;
+}
+
+}
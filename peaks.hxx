@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+
+#include "capture.hxx"
+
+namespace peaks
+{
+
+// Waveform overview sidecar. Level 0 holds per channel min, max and RMS for
+// every "baseframes" frames, each further level summarizes "factor" entries
+// of the one below. Level 0 is appended as the audio comes in, the other
+// levels and their index follow when the file is closed.
+//
+// Layout, little endian:
+//   header: "LBPK", u32 version, u32 channels, u32 sample rate,
+//           u32 base frames, u32 factor, u32 levels, u32 reserved,
+//           u64 total frames, u64 index offset (0 until closed)
+//   entry:  per channel s16 min, s16 max, u16 RMS, full scale 32767
+//   index:  per level u32 frames per entry, u32 reserved, u64 offset,
+//           u64 entry count
+typedef struct builder builder;
+
+builder *newbuilder(const char *path, int nchannels, int samplerate, size_t baseframes = 256, size_t factor = 16, int levels = 4);
+bool add(builder *builder, const void *buf, size_t framecount, capture::pcm_type intype);
+// Writes the partial last entries, the coarser levels and the index.
+bool close(builder *builder);
+
+}
@@ -0,0 +1,191 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "perf.hxx"
+
+static std::atomic<uint64_t> allocationCount(0);
+static std::atomic<bool> guardEnabled(false);
+static std::atomic<uint64_t> violationCount(0);
+
+static void count()
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	if (guardEnabled.load(std::memory_order_relaxed))
+		violationCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+#ifdef __GLIBC__
+// glibc lets a program replace malloc, and its own calls (stdio buffers,
+// strdup, ...) then come here too. The real allocator stays underneath.
+extern "C"
+{
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void *__libc_valloc(size_t size);
+void *__libc_pvalloc(size_t size);
+void __libc_free(void *p);
+
+void *malloc(size_t size)
+{
+	count();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	count();
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+	count();
+	return __libc_realloc(p, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	count();
+	return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+int posix_memalign(void **p, size_t alignment, size_t size)
+{
+	if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+
+	*p = memalign(alignment, size);
+	return *p != nullptr || size == 0 ? 0 : ENOMEM;
+}
+
+void *valloc(size_t size)
+{
+	count();
+	return __libc_valloc(size);
+}
+
+void *pvalloc(size_t size)
+{
+	count();
+	return __libc_pvalloc(size);
+}
+
+void free(void *p)
+{
+	__libc_free(p);
+}
+
+}
+
+// malloc() counts already
+static void *countedalloc(size_t size)
+{
+	return malloc(size == 0 ? 1 : size);
+}
+#else
+static void *countedalloc(size_t size)
+{
+	count();
+	return malloc(size == 0 ? 1 : size);
+}
+#endif
+
+void *operator new(size_t size)
+{
+	void *p = countedalloc(size);
+	if (p == nullptr)
+		throw std::bad_alloc();
+
+	return p;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+	return countedalloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+	return countedalloc(size);
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	free(p);
+}
+
+namespace perf
+{
+
+double cputime()
+{
+#ifdef _WIN32
+	FILETIME creation, exit, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+		return 0.0;
+
+	uint64_t k = ((uint64_t) kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+	uint64_t u = ((uint64_t) user.dwHighDateTime << 32) | user.dwLowDateTime;
+	return (k + u) / 1e7;
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0.0;
+
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#endif
+}
+
+uint64_t allocations()
+{
+	return allocationCount.load(std::memory_order_relaxed);
+}
+
+void guard(bool enable)
+{
+	guardEnabled.store(enable, std::memory_order_relaxed);
+}
+
+uint64_t violations()
+{
+	return violationCount.load(std::memory_order_relaxed);
+}
+
+}
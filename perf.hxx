@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+
+namespace perf
+{
+
+// CPU time used by the whole process so far, all threads, in seconds.
+double cputime();
+// Number of allocations so far. With glibc this counts every malloc,
+// calloc, realloc and aligned allocation, from C++ and C code alike. On other
+// C libraries only operator new is counted, so allocations made by the C
+// library itself (stdio buffers) and aligned buffers are missed there.
+uint64_t allocations();
+// While enabled, allocations are also counted as violations of an
+// allocation-free steady state.
+void guard(bool enable);
+uint64_t violations();
+
+}
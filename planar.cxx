@@ -0,0 +1,36 @@
+#include "planar.hxx"
+#include "wave.hxx"
+
+namespace planar
+{
+
+static constexpr size_t STRIDE_ALIGNMENT = 16;
+
+void reset(block &b, int nchannels, size_t capacity)
+{
+	b.channels = nchannels;
+	b.capacity = capacity;
+	b.frames = 0;
+	b.stride = (capacity + STRIDE_ALIGNMENT - 1) / STRIDE_ALIGNMENT * STRIDE_ALIGNMENT;
+	b.samples.assign(b.stride * nchannels, 0.0f);
+	b.planes.resize(nchannels);
+
+	for (int c = 0; c < nchannels; c++)
+		b.planes[c] = b.samples.data() + c * b.stride;
+}
+
+bool load(block &b, const void *src, capture::pcm_type intype, size_t framecount)
+{
+	if (framecount > b.capacity)
+		return false;
+
+	b.frames = framecount;
+	return wave::deinterleave((void *const *) b.planes.data(), capture::pcm_type::pcm_f32, src, intype, framecount, b.channels);
+}
+
+bool store(void *dest, capture::pcm_type outtype, const block &b)
+{
+	return wave::interleave(dest, outtype, (const void *const *) b.planes.data(), capture::pcm_type::pcm_f32, b.frames, b.channels);
+}
+
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "capture.hxx"
+
+namespace planar
+{
+
+// Float samples with every channel contiguous, for per channel processing.
+// Channel "c" starts at samples[c * stride]. The stride is a multiple of 16
+// floats, so every channel is aligned like the first one.
+typedef struct block
+{
+	int channels;
+	size_t capacity;
+	size_t frames;
+	size_t stride;
+	std::vector<float> samples;
+	// Start of every channel, as wave::interleave() and capture::getplanar()
+	// take them
+	std::vector<float *> planes;
+} block;
+
+// Sets the layout and allocates. Nothing else here allocates.
+void reset(block &b, int nchannels, size_t capacity);
+// Splits interleaved frames into "b" and sets "frames". Fails if there are
+// more than "capacity".
+bool load(block &b, const void *src, capture::pcm_type intype, size_t framecount);
+// Joins the "frames" of "b" into interleaved frames of "outtype".
+bool store(void *dest, capture::pcm_type outtype, const block &b);
+
+}
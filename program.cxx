@@ -1,11 +1,25 @@
+#include <algorithm>
+#include <chrono>
 #include <csignal>
 #include <cstdio>
+#include <ctime>
 
+#ifdef _WIN32
 #include <fcntl.h>
 #include <io.h>
+#endif
 
 #include "CLI11.hpp"
 #include "capture.hxx"
+#include "fileio.hxx"
+#include "gate.hxx"
+#include "loudness.hxx"
+#include "perf.hxx"
+#include "sink.hxx"
+#include "stats.hxx"
+#include "synth.hxx"
+#include "trace.hxx"
+#include "transcode.hxx"
 #include "wave.hxx"
 
 bool quitit = false;
@@ -15,6 +29,16 @@ void catchint(int i)
 	quitit = true;
 }
 
+#ifdef LOOPBACK_TRACE
+volatile sig_atomic_t dumptrace = 0;
+
+void catchdump(int i)
+{
+	dumptrace = 1;
+	signal(i, catchdump);
+}
+#endif
+
 const char *mappcmtype(capture::pcm_type t)
 {
 	switch (t)
@@ -43,6 +67,91 @@ void printdevinfo(FILE *dest, const capture::device_info &info)
 	);
 }
 
+typedef std::chrono::steady_clock loopclock;
+
+uint64_t nanoseconds(loopclock::duration d)
+{
+	return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+
+// sink::write, timed when collecting statistics
+bool writeblock(sink::sink *writer, stats::collector *col, const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info)
+{
+	TRACE_SCOPE("sink_write");
+
+	if (col == nullptr)
+		return sink::write(writer, buf, framecount, intype, info);
+
+	loopclock::time_point start = loopclock::now();
+	bool result = sink::write(writer, buf, framecount, intype, info);
+	stats::record(col, stats::metric::write, nanoseconds(loopclock::now() - start));
+	return result;
+}
+
+void setlevels(stats::collector *col, const std::vector<wave::channel_levels> &levels)
+{
+	for (size_t c = 0; c < levels.size(); c++)
+		stats::setlevels(col, c, levels[c].clipped, levels[c].peak);
+}
+
+// "info" moved "frames" into the buffer
+capture::buffer_info advanceinfo(const capture::buffer_info &info, int64_t frames, int samplerate)
+{
+	capture::buffer_info result = info;
+	result.position += frames;
+	result.discontinuity = info.discontinuity && frames == 0;
+	if (result.timestamp > 0)
+		result.timestamp += frames * 10000000LL / samplerate;
+
+	return result;
+}
+
+// Next occurrence of a local HH:MM[:SS] time
+bool parsestart(const std::string &text, std::chrono::system_clock::time_point &result)
+{
+	int hour = 0, minute = 0;
+	double second = 0;
+	char extra = 0;
+
+	int fields = sscanf(text.c_str(), "%d:%d:%lf%c", &hour, &minute, &second, &extra);
+	if (fields < 2 || fields > 3 || hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second >= 60)
+		return false;
+
+	std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
+	time_t today = std::chrono::system_clock::to_time_t(now);
+	struct tm *tm = localtime(&today);
+	if (tm == nullptr)
+		return false;
+
+	tm->tm_hour = hour;
+	tm->tm_min = minute;
+	tm->tm_sec = 0;
+	tm->tm_isdst = -1;
+
+	time_t when = mktime(tm);
+	if (when == (time_t) -1)
+		return false;
+
+	result = std::chrono::system_clock::from_time_t(when) + std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::duration<double>(second));
+	if (result <= now)
+		result += std::chrono::hours(24);
+
+	return true;
+}
+
+// Only one of them is open
+void closesource(capture::context *&ctx, synth::source *&src)
+{
+	if (ctx)
+		capture::close(ctx);
+
+	if (src)
+	{
+		synth::close(src);
+		src = nullptr;
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	CLI::App parser("Simple loopback capture", argv[0]);
@@ -54,6 +163,55 @@ int main(int argc, char *argv[])
 	bool infoOnly = false;
 	bool listOnly = false;
 	bool findMode = false;
+	double segmentSeconds = 0;
+	size_t segmentBytes = 0;
+	std::string codec = "pcm_s16";
+	int encoderThreads = 0;
+	double gateDb = 0;
+	double gateCloseDb = 0;
+	int gateHoldMs = 500;
+	std::string gateMode = "drop";
+	std::string gateLog;
+	std::string stdoutFormat;
+	int stdoutRate = 0;
+	int latencyMs = 20;
+	size_t chunkBytes = 0;
+	bool framed = false;
+	std::string shmName;
+	double shmSeconds = 2.0;
+	std::string serveAddress;
+	int clientQueueMs = 500;
+	std::string clientPolicy = "drop-oldest";
+	double queueMb = 8;
+	double spillMb = 0;
+	std::string spillDir;
+	double benchSeconds = 0;
+	int benchRate = 48000;
+	int benchChannels = 2;
+	std::string benchFormat = "pcm_f32";
+	bool showStats = false;
+	double statsInterval = 0;
+	std::string statsJson;
+	bool allocGuard = false;
+	double durationSeconds = 0;
+	uint64_t frameLimit = 0;
+	std::string startAt;
+	double triggerDb = 0;
+	int prerollMs = 500;
+	std::vector<std::string> transcodeInputs;
+	std::string transcodeDir = ".";
+	bool downmix = false;
+	int transcodeJobs = 0;
+	bool writePeaks = false;
+	bool splitChannels = false;
+	bool directIo = false;
+	loudness::options normalize;
+	int headerRefreshMs = 0;
+	int syncMs = 0;
+	std::vector<std::string> repairInputs;
+#ifdef LOOPBACK_TRACE
+	std::string tracePath;
+#endif
 
 	parser.add_flag("--info", infoOnly, "Print output device information.");
 	parser.add_flag("--list", listOnly, "Print device list.");
@@ -61,7 +219,57 @@ int main(int argc, char *argv[])
 	parser.add_option("--name", devName, "Exact device name to use.");
 	parser.add_option<std::vector<int>, int>("--include", includeProcesses, "List of PID to include audio.");
 	parser.add_option<std::vector<int>, int>("--exclude", excludeProcesses, "List of PID to exclude audio.");
-	parser.add_option("output", outputPath, "File output path.");
+	parser.add_option("--segment-seconds", segmentSeconds, "Start a new output file every this many seconds.");
+	parser.add_option("--segment-bytes", segmentBytes, "Start a new output file once it reaches this many bytes.");
+	parser.add_option("--codec", codec, "Output file codec.")->check(CLI::IsMember({"pcm_u8", "pcm_s16", "ima_adpcm", "flac"}));
+	parser.add_option("--threads", encoderThreads, "Number of encoder threads for FLAC (0 = automatic).");
+	CLI::Option *gateOpt = parser.add_option("--gate-db", gateDb, "Only record audio above this level (dBFS RMS).");
+	CLI::Option *gateCloseOpt = parser.add_option("--gate-close-db", gateCloseDb, "Level where the gate closes again (default: 6dB below --gate-db).");
+	parser.add_option("--gate-hold-ms", gateHoldMs, "Keep recording this long after the level drops.");
+	parser.add_option("--gate-mode", gateMode, "drop: leave out inactive audio and mark the joins with cue points. split: one file per activity burst.")->check(CLI::IsMember({"drop", "split"}));
+	parser.add_option("--gate-log", gateLog, "Write the position and time of every activity burst to this CSV file.");
+	parser.add_option("--stdout-format", stdoutFormat, "Sample format when writing to stdout (default: device format).")->check(CLI::IsMember({"pcm_u8", "pcm_s16", "pcm_f32"}));
+	parser.add_option("--stdout-rate", stdoutRate, "Sample rate when writing to stdout (default: device rate).");
+	parser.add_option("--latency-ms", latencyMs, "Longest time audio is held back before writing to stdout.");
+	parser.add_option("--chunk-bytes", chunkBytes, "Write to stdout in chunks of this size (default: derived from --latency-ms).");
+	parser.add_flag("--framed", framed, "Put a header with sequence number, position, timestamp and format before every chunk on stdout.");
+	parser.add_option("--shm", shmName, "Publish the capture in a shared memory ring with this name instead of writing a file.");
+	parser.add_option("--shm-seconds", shmSeconds, "Length of the shared memory ring.");
+	parser.add_option("--serve", serveAddress, "Serve the capture to local clients on this loopback TCP port or Unix socket path. The stdout options are the client defaults.");
+	parser.add_option("--client-queue-ms", clientQueueMs, "Audio queued per client before --client-policy applies.");
+	parser.add_option("--client-policy", clientPolicy, "Default action when a client falls behind.")->check(CLI::IsMember({"drop-oldest", "drop-newest", "disconnect"}));
+	CLI::Option *queueOpt = parser.add_option("--queue-mb", queueMb, "Decouple the output from capture with a queue of this much memory.");
+	CLI::Option *spillOpt = parser.add_option("--spill-mb", spillMb, "Let the queue spill up to this much to a temporary file when memory is full.");
+	parser.add_option("--spill-dir", spillDir, "Directory for the spill file (default: TEMP).");
+	CLI::Option *benchOpt = parser.add_option("--bench", benchSeconds, "Feed this many seconds of generated audio through the output as fast as possible and report the cost.");
+	parser.add_option("--bench-rate", benchRate, "Sample rate of the generated audio.");
+	parser.add_option("--bench-channels", benchChannels, "Channel count of the generated audio.")->check(CLI::Range(1, 32));
+	parser.add_option("--bench-format", benchFormat, "Sample format of the generated audio.")->check(CLI::IsMember({"pcm_u8", "pcm_s16", "pcm_f32"}));
+	parser.add_flag("--stats", showStats, "Print packet timing, loop and write latency, and clipping and peaks of the conversion to the file format, on exit.");
+	parser.add_option("--stats-interval", statsInterval, "Also print statistics every this many seconds.");
+	parser.add_option("--stats-json", statsJson, "Append every statistics report to this file as a JSON line.");
+	parser.add_flag("--alloc-guard", allocGuard, "Fail if anything allocates memory after the first second of audio.");
+	CLI::Option *durationOpt = parser.add_option("--duration", durationSeconds, "Stop after recording this many seconds, rounded to whole frames.");
+	CLI::Option *framesOpt = parser.add_option("--frames", frameLimit, "Stop after recording exactly this many frames.")->excludes(durationOpt);
+	CLI::Option *startAtOpt = parser.add_option("--start-at", startAt, "Start recording at this local time (HH:MM[:SS]), the next time it comes around.");
+	CLI::Option *triggerOpt = parser.add_option("--trigger-db", triggerDb, "Start recording once a sample peaks at this level (dBFS).");
+	parser.add_option("--preroll-ms", prerollMs, "Audio kept from before the trigger.");
+	parser.add_option("--transcode", transcodeInputs, "Convert these WAV files to --codec instead of capturing.");
+	parser.add_option("--transcode-dir", transcodeDir, "Directory for the converted files.");
+	parser.add_flag("--downmix", downmix, "Mix all channels down to mono when transcoding.");
+	parser.add_option("--jobs", transcodeJobs, "Files transcoded in parallel (0 = one per hardware thread).");
+	parser.add_option("--header-refresh-ms", headerRefreshMs, "Update the WAV header sizes at most this often (default: after every write). --repair fixes files cut short.");
+	parser.add_option("--sync-ms", syncMs, "Flush WAV data and header to disk this often, and when a file is finished.");
+	parser.add_option("--repair", repairInputs, "Fix the header sizes of WAV files left behind by a crash, then exit.");
+	parser.add_flag("--peaks", writePeaks, "Write a min/max/RMS waveform overview next to every WAV file (name.wav.peaks).");
+	parser.add_flag("--direct-io", directIo, "Write an uncompressed WAV file with direct I/O into space allocated ahead. For many channels.");
+	parser.add_flag("--split-channels", splitChannels, "Write one mono WAV file per channel (name.ch1.wav, name.ch2.wav, ...).");
+	CLI::Option *normalizeOpt = parser.add_option("--normalize", normalize.targetLufs, "Bring the WAV file to this integrated loudness (LUFS) when it is finished. It is written as float until then.");
+	parser.add_option("--normalize-ceiling", normalize.ceilingDb, "Lower the --normalize gain so sample peaks stay below this level (dBFS).");
+#ifdef LOOPBACK_TRACE
+	parser.add_option("--trace", tracePath, "Write a Chrome trace of the capture, convert and write phases to this file on exit, and on Ctrl+Break (SIGUSR1).");
+#endif
+	parser.add_option("output", outputPath, "File output path. When segmenting, {n} and strftime() specifiers are expanded.");
 
 	try
 	{
@@ -72,6 +280,44 @@ int main(int argc, char *argv[])
 		return parser.exit(e);
 	}
 
+	if (!repairInputs.empty())
+	{
+		int result = 0;
+
+		for (const std::string &path: repairInputs)
+		{
+			try
+			{
+				fileio::wav_info info;
+				bool repaired = fileio::repairwav(path.c_str(), info);
+				// The header cannot describe the rest, but it is still there
+				bool saturated = info.dataOffset + info.dataSize > 0xFFFFFFFFULL;
+				fprintf(stderr, "%s: %s, %llu frames%s\n", path.c_str(), repaired ? "repaired" : "intact", (unsigned long long) (info.frames * info.samplesPerBlock), saturated ? ", more than the header can hold" : "");
+			}
+			catch (const std::runtime_error &e)
+			{
+				fprintf(stderr, "Error: %s: %s\n", path.c_str(), e.what());
+				result = 1;
+			}
+		}
+
+		return result;
+	}
+
+	if (!transcodeInputs.empty())
+	{
+		transcode::options topts;
+		topts.directory = transcodeDir;
+		topts.outtype = codec == "pcm_u8" ? capture::pcm_type::pcm_u8 : capture::pcm_type::pcm_s16;
+		topts.format = codec == "ima_adpcm" ? wave::encoding::ima_adpcm : wave::encoding::pcm;
+		topts.flac = codec == "flac";
+		topts.downmix = downmix;
+		topts.peaks = writePeaks;
+		topts.jobs = transcodeJobs;
+
+		return transcode::run(transcodeInputs, topts) == 0 ? 0 : 1;
+	}
+
 	if (listOnly)
 	{
 		try
@@ -88,79 +334,518 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	std::chrono::system_clock::time_point startClock;
+	if (startAtOpt->count() > 0 && !parsestart(startAt, startClock))
+	{
+		fprintf(stderr, "Error: --start-at needs a time like 13:45 or 13:45:30.5\n");
+		return 1;
+	}
+
 	capture::context *ctx = nullptr;
+	synth::source *synthsrc = nullptr;
+	capture::device_info devinfo;
 
-	try
+	if (benchOpt->count() > 0)
 	{
-		ctx = capture::open(devName, findMode ? capture::name_match::partial : capture::name_match::exact);
+		capture::pcm_type type = benchFormat == "pcm_u8" ? capture::pcm_type::pcm_u8
+			: benchFormat == "pcm_s16" ? capture::pcm_type::pcm_s16
+			: capture::pcm_type::pcm_f32;
+
+		try
+		{
+			synthsrc = synth::newsource(benchChannels, benchRate, type, benchSeconds);
+		}
+		catch (const std::runtime_error &e)
+		{
+			fprintf(stderr, "Error: %s\n", e.what());
+			return 1;
+		}
+
+		devinfo = {"Synthetic", benchRate, benchChannels, (int) wave::pcmtype_size(type) * 8, type};
 	}
-	catch (const std::runtime_error &e)
+	else
 	{
-		fprintf(stderr, "Error: cannot open capture device: %s\n", e.what());
-		return 1;
+		try
+		{
+			ctx = capture::open(devName, findMode ? capture::name_match::partial : capture::name_match::exact);
+		}
+		catch (const std::runtime_error &e)
+		{
+			fprintf(stderr, "Error: cannot open capture device: %s\n", e.what());
+			return 1;
+		}
+
+		devinfo = capture::getinfo(ctx);
 	}
 
-	capture::device_info devinfo = capture::getinfo(ctx);
-	printdevinfo((outputPath.empty() && !infoOnly) ? stderr : stdout, devinfo);
+	bool toStdout = outputPath.empty() && shmName.empty() && serveAddress.empty();
+	printdevinfo((toStdout && !infoOnly) ? stderr : stdout, devinfo);
 	if (infoOnly)
 	{
-		capture::close(ctx);
+		closesource(ctx, synthsrc);
 		return 0;
 	}
 
-	wave::writer *writer = nullptr;
+	sink::sink *writer = nullptr;
+	gate::detector *gatedet = nullptr;
+	gate::trigger *trig = nullptr;
+	bool gateSplit = gateOpt->count() > 0 && gateMode == "split";
+
+	if (gateSplit && (outputPath.empty() || codec == "flac" || !shmName.empty() || !serveAddress.empty()))
+	{
+		closesource(ctx, synthsrc);
+		fprintf(stderr, "Error: --gate-mode split needs a WAV output file\n");
+		return 1;
+	}
 
-	if (outputPath.empty())
+	if (splitChannels && (outputPath.empty() || codec == "flac" || !shmName.empty() || !serveAddress.empty()))
 	{
-		fflush(stdout);
-		_setmode(fileno(stdout), _O_BINARY);
+		closesource(ctx, synthsrc);
+		fprintf(stderr, "Error: --split-channels needs a WAV output file\n");
+		return 1;
 	}
-	else
+
+	bool plainWave = !outputPath.empty() && shmName.empty() && serveAddress.empty() && (codec == "pcm_u8" || codec == "pcm_s16");
+	if (directIo && (!plainWave || segmentSeconds > 0 || segmentBytes > 0 || gateSplit || splitChannels || writePeaks))
+	{
+		closesource(ctx, synthsrc);
+		fprintf(stderr, "Error: --direct-io needs a single uncompressed WAV output file\n");
+		return 1;
+	}
+
+	if (normalizeOpt->count() > 0 && (!plainWave || segmentSeconds > 0 || segmentBytes > 0 || gateSplit || splitChannels || directIo || writePeaks))
+	{
+		closesource(ctx, synthsrc);
+		fprintf(stderr, "Error: --normalize needs a single uncompressed WAV output file\n");
+		return 1;
+	}
+
+	try
+	{
+		if (!shmName.empty())
+		{
+			size_t capacity = (size_t) (shmSeconds * devinfo.sampleRate);
+			writer = sink::newshm(shmName.c_str(), devinfo.channels, devinfo.sampleRate, devinfo.dataType, capacity);
+		}
+		else if (outputPath.empty())
+		{
+			stream::options opts;
+			opts.format = stdoutFormat == "pcm_u8" ? capture::pcm_type::pcm_u8
+				: stdoutFormat == "pcm_s16" ? capture::pcm_type::pcm_s16
+				: stdoutFormat == "pcm_f32" ? capture::pcm_type::pcm_f32
+				: capture::pcm_type::unknown;
+			opts.sampleRate = stdoutRate;
+			opts.latencyMs = latencyMs;
+			opts.chunkBytes = chunkBytes;
+			opts.framed = framed;
+
+			if (!serveAddress.empty())
+			{
+				server::options sopts;
+				sopts.stream = opts;
+				sopts.queueMs = clientQueueMs;
+				sopts.overflow = clientPolicy == "drop-newest" ? server::policy::drop_newest
+					: clientPolicy == "disconnect" ? server::policy::disconnect
+					: server::policy::drop_oldest;
+
+				writer = sink::newserver(serveAddress.c_str(), devinfo.channels, devinfo.sampleRate, devinfo.dataType, sopts);
+			}
+			else
+			{
+				fflush(stdout);
+#ifdef _WIN32
+				_setmode(fileno(stdout), _O_BINARY);
+#endif
+				writer = sink::newstream(stdout, devinfo.channels, devinfo.sampleRate, devinfo.dataType, opts);
+			}
+		}
+		else if (directIo)
+		{
+			capture::pcm_type outtype = codec == "pcm_u8" ? capture::pcm_type::pcm_u8 : capture::pcm_type::pcm_s16;
+			writer = sink::newdirect(outputPath.c_str(), devinfo.channels, devinfo.sampleRate, outtype);
+		}
+		else if (codec == "flac")
+			writer = sink::newflac(outputPath.c_str(), devinfo.channels, devinfo.sampleRate, encoderThreads);
+		else
+		{
+			wave::options opts;
+			opts.segmentFrames = (size_t) (segmentSeconds * devinfo.sampleRate);
+			opts.segmentBytes = segmentBytes;
+			opts.splitOnRequest = gateSplit;
+			opts.peaks = writePeaks;
+			opts.headerRefreshMs = headerRefreshMs;
+			opts.syncMs = syncMs;
+			if (codec == "ima_adpcm")
+				opts.format = wave::encoding::ima_adpcm;
+
+			capture::pcm_type outtype = codec == "pcm_u8" ? capture::pcm_type::pcm_u8 : capture::pcm_type::pcm_s16;
+			if (normalizeOpt->count() > 0)
+				writer = sink::newnormalized(outputPath.c_str(), devinfo.channels, devinfo.sampleRate, outtype, normalize, opts);
+			else if (splitChannels)
+				writer = sink::newsplit(outputPath.c_str(), devinfo.channels, devinfo.sampleRate, outtype, opts);
+			else
+				writer = sink::newwave(outputPath.c_str(), devinfo.channels, devinfo.sampleRate, outtype, opts);
+		}
+
+		if (writer == nullptr)
+			throw std::runtime_error("Cannot create output writer");
+
+		if (queueOpt->count() > 0 || spillOpt->count() > 0)
+		{
+			spool::options qopts;
+			qopts.memoryBytes = (size_t) (queueMb * 1048576.0);
+			qopts.diskBytes = (uint64_t) (spillMb * 1048576.0);
+			qopts.directory = spillDir;
+
+			writer = sink::newqueued(writer, devinfo.channels, qopts);
+		}
+	}
+	catch (const std::runtime_error &e)
+	{
+		// TODO
+		closesource(ctx, synthsrc);
+		fprintf(stderr, "Error when making output writer: %s\n", e.what());
+		return 1;
+	}
+
+	if (gateOpt->count() > 0)
 	{
 		try
 		{
-			writer = wave::newwriter(outputPath.c_str(), devinfo.channels, devinfo.sampleRate, capture::pcm_type::pcm_s16);
-			if (writer == nullptr)
-				throw std::runtime_error("Cannot create WAV writer");
+			double closeDb = gateCloseOpt->count() > 0 ? gateCloseDb : gateDb - 6.0;
+			gatedet = gate::newdetector(devinfo.channels, devinfo.sampleRate, gateDb, closeDb, gateHoldMs, gateLog.empty() ? nullptr : gateLog.c_str());
 		}
 		catch (const std::runtime_error &e)
 		{
-			// TODO
-			capture::close(ctx);
-			fprintf(stderr, "Error when making WAV writer: %s\n", e.what());
+			closesource(ctx, synthsrc);
+			sink::close(writer);
+
+			fprintf(stderr, "Error: %s\n", e.what());
 			return 1;
 		}
 	}
 
-	if (!capture::start(ctx, 16384))
+	if (triggerOpt->count() > 0)
 	{
-		capture::close(ctx);
+		try
+		{
+			trig = gate::newtrigger(devinfo.channels, devinfo.sampleRate, devinfo.dataType, triggerDb, prerollMs);
+		}
+		catch (const std::runtime_error &e)
+		{
+			closesource(ctx, synthsrc);
+			sink::close(writer);
+
+			if (gatedet)
+				gate::close(gatedet);
+
+			fprintf(stderr, "Error: %s\n", e.what());
+			return 1;
+		}
+	}
+
+	stats::collector *statcol = nullptr;
+	// Clipping and peaks, for sinks that measure them
+	std::vector<wave::channel_levels> levels(devinfo.channels);
+	bool measured = false;
+
+	if (showStats || statsInterval > 0 || !statsJson.empty())
+	{
+		try
+		{
+			// Only measured on the way to the integer file format, a device
+			// already delivering it cannot clip
+			capture::pcm_type outtype = codec == "pcm_u8" ? capture::pcm_type::pcm_u8 : capture::pcm_type::pcm_s16;
+			measured = devinfo.dataType != outtype && sink::levels(writer, levels.data());
+			statcol = stats::newcollector(statsJson.empty() ? nullptr : statsJson.c_str(), measured ? devinfo.channels : 0);
+		}
+		catch (const std::runtime_error &e)
+		{
+			closesource(ctx, synthsrc);
+			sink::close(writer);
+
+			if (gatedet)
+				gate::close(gatedet);
+
+			if (trig)
+				gate::close(trig);
+
+			fprintf(stderr, "Error: %s\n", e.what());
+			return 1;
+		}
+	}
+
+	if (ctx && !capture::start(ctx, 16384))
+	{
+		closesource(ctx, synthsrc);
+		sink::close(writer);
+
+		if (gatedet)
+			gate::close(gatedet);
+
+		if (trig)
+			gate::close(trig);
+
+		if (statcol)
+			stats::close(statcol);
+
 		fprintf(stderr, "Error: cannot start capture\n");
 		return 1;
 	}
 
 	signal(SIGINT, catchint);
 
-	while (!quitit)
+#ifdef LOOPBACK_TRACE
+	TRACE_THREAD("main");
+
+#ifdef SIGBREAK
+	signal(SIGBREAK, catchdump);
+#endif
+#ifdef SIGUSR1
+	signal(SIGUSR1, catchdump);
+#endif
+#endif
+
+	size_t framesize = devinfo.channels * (devinfo.bitsPerSample / 8);
+	// Allocated once, holds everything the device buffer can
+	std::vector<unsigned char> buffers((ctx ? capture::buffersize(ctx) : 16384) * framesize);
+	std::vector<gate::span> spans;
+	bool gateActive = false;
+	size_t bursts = 0;
+	// Right after the last frames the gate was given
+	capture::buffer_info gateEnd = {};
+
+	double startCpu = perf::cputime();
+	uint64_t startAllocations = perf::allocations();
+	loopclock::time_point startTime = loopclock::now();
+	loopclock::time_point lastArrival = startTime;
+	loopclock::time_point lastReport = startTime;
+	bool arrived = false;
+	uint64_t framesSeen = 0;
+
+	// Recording window in device positions. Buffers crossing either end are
+	// cut at the exact frame.
+	bool windowKnown = false;
+	uint64_t windowStart = 0;
+	bool limited = durationOpt->count() > 0 || framesOpt->count() > 0;
+	uint64_t framesLeft = durationOpt->count() > 0 ? (uint64_t) (durationSeconds * devinfo.sampleRate + 0.5) : frameLimit;
+	bool limitReached = limited && framesLeft == 0;
+
+	// Spans are positioned relative to "base"
+	auto writespans = [&](const capture::buffer_info &base)
 	{
-		std::vector<unsigned char> buffers = capture::getbuf(ctx);
-		if (buffers.size() > 0)
+		for (const gate::span &span: spans)
 		{
-			if (writer)
-				wave::write(writer, buffers.data(), buffers.size() / devinfo.channels / (devinfo.bitsPerSample / 8), devinfo.dataType);
-			else
+			if (span.active)
 			{
-				fwrite(buffers.data(), 1, buffers.size(), stdout);
-				fflush(stdout);
+				if (!gateActive)
+				{
+					if (!gateSplit)
+						sink::mark(writer);
+					else if (bursts > 0)
+						sink::split(writer);
+
+					bursts++;
+				}
+
+				capture::buffer_info spaninfo = advanceinfo(base, span.offset, devinfo.sampleRate);
+				writeblock(writer, statcol, span.data, span.count, devinfo.dataType, &spaninfo);
+			}
+
+			gateActive = span.active;
+		}
+	};
+
+	// Everything past the start and the trigger goes through here
+	auto record = [&](const unsigned char *data, size_t framecount, const capture::buffer_info &info)
+	{
+		if (limited)
+		{
+			framecount = (size_t) std::min<uint64_t>(framecount, framesLeft);
+			framesLeft -= framecount;
+			limitReached = framesLeft == 0;
+		}
+
+		if (framecount == 0)
+			return;
+
+		if (gatedet)
+		{
+			gate::process(gatedet, data, framecount, devinfo.dataType, spans);
+			writespans(info);
+			gateEnd = advanceinfo(info, framecount, devinfo.sampleRate);
+		}
+		else
+			writeblock(writer, statcol, data, framecount, devinfo.dataType, &info);
+	};
+
+	while (!quitit && !limitReached && !(synthsrc && synth::finished(synthsrc)))
+	{
+		TRACE_SCOPE("loop");
+		loopclock::time_point loopStart = statcol ? loopclock::now() : loopclock::time_point();
+		capture::buffer_info info;
+		size_t bytes = synthsrc ? synth::getbuf(synthsrc, buffers.data(), buffers.size(), info) : capture::getbuf(ctx, buffers.data(), buffers.size(), info);
+		if (bytes > 0)
+		{
+			size_t framecount = bytes / framesize;
+
+			// Startup is over once every stage has seen real audio
+			framesSeen += framecount;
+			if (allocGuard && framesSeen >= (uint64_t) devinfo.sampleRate)
+				perf::guard(true);
+
+			if (statcol)
+			{
+				loopclock::time_point now = loopclock::now();
+				if (arrived)
+					stats::record(statcol, stats::metric::interarrival, nanoseconds(now - lastArrival));
+
+				lastArrival = now;
+				arrived = true;
+
+				stats::add(statcol, stats::counter::bytes, bytes);
+				stats::add(statcol, stats::counter::frames, framecount);
+				stats::add(statcol, stats::counter::packets, info.packets);
+				stats::add(statcol, stats::counter::silentPackets, info.silentPackets);
+				stats::add(statcol, stats::counter::overruns, info.discontinuity ? 1 : 0);
+			}
+
+			if (!windowKnown)
+			{
+				// The first buffer ties the wall clock to the device position
+				windowStart = info.position;
+				if (startAtOpt->count() > 0)
+				{
+					double wait = std::chrono::duration<double>(startClock - std::chrono::system_clock::now()).count();
+					windowStart += (uint64_t) std::max(0.0, wait * devinfo.sampleRate + 0.5);
+				}
+
+				windowKnown = true;
+			}
+
+			size_t skip = windowStart > info.position ? (size_t) std::min<uint64_t>(windowStart - info.position, framecount) : 0;
+			const unsigned char *data = buffers.data() + skip * framesize;
+			framecount -= skip;
+			info = advanceinfo(info, skip, devinfo.sampleRate);
+
+			if (trig && framecount > 0 && !gate::triggered(trig))
+			{
+				size_t at = gate::detect(trig, data, framecount);
+				if (at < framecount)
+				{
+					// The pre-roll ends right where the trigger fired
+					gate::region parts[2];
+					size_t prerolled = gate::preroll(trig, parts);
+					capture::buffer_info preinfo = advanceinfo(info, (int64_t) at - (int64_t) prerolled, devinfo.sampleRate);
+					preinfo.discontinuity = false;
+
+					record((const unsigned char *) parts[0].data, parts[0].count, preinfo);
+					record((const unsigned char *) parts[1].data, parts[1].count, advanceinfo(preinfo, parts[0].count, devinfo.sampleRate));
+				}
+
+				data += at * framesize;
+				framecount -= at;
+				info = advanceinfo(info, at, devinfo.sampleRate);
+			}
+
+			if (!trig || gate::triggered(trig))
+				record(data, framecount, info);
+		}
+		else if (statcol)
+			stats::add(statcol, stats::counter::emptyPolls);
+
+		sink::poll(writer);
+
+		if (statcol)
+		{
+			loopclock::time_point now = loopclock::now();
+			stats::record(statcol, stats::metric::loop, nanoseconds(now - loopStart));
+
+			if (statsInterval > 0 && now - lastReport >= std::chrono::duration<double>(statsInterval))
+			{
+				if (measured)
+				{
+					sink::levels(writer, levels.data());
+					setlevels(statcol, levels);
+				}
+
+				stats::report(statcol, stderr);
+				lastReport = now;
 			}
 		}
+
+#ifdef LOOPBACK_TRACE
+		if (dumptrace && !tracePath.empty())
+		{
+			trace::dump(tracePath.c_str());
+			dumptrace = 0;
+		}
+#endif
+	}
+
+	perf::guard(false);
+
+	// The gate holds back the block it has not decided yet
+	if (gatedet)
+	{
+		gate::flush(gatedet, spans);
+		writespans(gateEnd);
+	}
+
+	if (ctx)
+		capture::stop(ctx);
+
+	closesource(ctx, synthsrc);
+
+	if (gatedet)
+		gate::close(gatedet);
+
+	if (trig)
+		gate::close(trig);
+
+	sink::close(writer, measured ? levels.data() : nullptr);
+
+	if (statcol)
+	{
+		if (measured)
+			setlevels(statcol, levels);
+
+		stats::report(statcol, stderr);
+		stats::close(statcol);
 	}
 
-	capture::stop(ctx);
-	capture::close(ctx);
+#ifdef LOOPBACK_TRACE
+	if (!tracePath.empty() && !trace::dump(tracePath.c_str()))
+		fprintf(stderr, "Error: cannot write %s\n", tracePath.c_str());
+#endif
+
+	if (benchOpt->count() > 0)
+	{
+		double wall = std::chrono::duration<double>(loopclock::now() - startTime).count();
+		double cpu = perf::cputime() - startCpu;
+		uint64_t allocations = perf::allocations() - startAllocations;
+
+		fprintf(
+			stderr,
+			"BENCHMARK\nAudio: %.1f s, %d channels, %d Hz, %s\nWall time: %.3f s (%.1fx real time)\nCPU time: %.3f s (%.1f s per audio hour)\nAllocations: %llu (%.1f per audio second)\n",
+			benchSeconds,
+			devinfo.channels,
+			devinfo.sampleRate,
+			mappcmtype(devinfo.dataType),
+			wall,
+			wall > 0 ? benchSeconds / wall : 0.0,
+			cpu,
+			benchSeconds > 0 ? cpu / benchSeconds * 3600.0 : 0.0,
+			(unsigned long long) allocations,
+			benchSeconds > 0 ? allocations / benchSeconds : 0.0
+		);
+	}
+
+	if (allocGuard && perf::violations() > 0)
+	{
+		fprintf(stderr, "Error: %llu allocations after startup\n", (unsigned long long) perf::violations());
+		return 3;
+	}
 
-	if (writer)
-		wave::close(writer);
-	
 	return 0;
 }
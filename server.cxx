@@ -0,0 +1,591 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+
+typedef SOCKET socket_t;
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+typedef int socket_t;
+
+static constexpr socket_t INVALID_SOCKET = -1;
+#endif
+
+#include "server.hxx"
+#include "wave.hxx"
+
+namespace server
+{
+
+#ifdef _WIN32
+static bool wouldblock()
+{
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+static bool setnonblocking(socket_t sock)
+{
+	u_long on = 1;
+	return ioctlsocket(sock, FIONBIO, &on) == 0;
+}
+
+static void closesock(socket_t sock)
+{
+	closesocket(sock);
+}
+#else
+static bool wouldblock()
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+static bool setnonblocking(socket_t sock)
+{
+	int flags = fcntl(sock, F_GETFL, 0);
+	return flags >= 0 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static void closesock(socket_t sock)
+{
+	::close(sock);
+}
+#endif
+
+#ifdef MSG_NOSIGNAL
+static constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static constexpr int SEND_FLAGS = 0;
+#endif
+
+static constexpr size_t MAX_REQUEST = 1024;
+
+struct client
+{
+	socket_t sock;
+	unsigned int id;
+	std::chrono::steady_clock::time_point connected;
+	std::string request;
+	bool streaming;
+	bool failed;
+	stream::writer *writer;
+	policy overflow;
+	size_t queueLimit;
+
+	// Ring of whole chunks, so dropping one never breaks framing. Slots keep
+	// their buffers, so a steady stream stops allocating.
+	std::vector<std::vector<unsigned char>> chunks;
+	size_t head;
+	size_t count;
+	size_t queued;
+	size_t sentOffset;
+	uint64_t dropped;
+};
+
+struct server
+{
+	server(const char *address, int nchannels, int samplerate, capture::pcm_type intype, const options &opts);
+	~server();
+
+	bool write(const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info);
+	bool poll();
+	bool writeend();
+private:
+	socket_t listener;
+	std::string unixPath;
+	int channels;
+	int inRate;
+	capture::pcm_type inType;
+	options defaults;
+	unsigned int nextId;
+	std::vector<std::unique_ptr<client>> clients;
+	std::vector<unsigned char> scratch;
+
+	void accept();
+	void receive(client &c);
+	bool startstream(client &c);
+	bool parserequest(const std::string &line, stream::options &sopts, policy &overflow, int &queueMs);
+	void flush(client &c);
+	void drop(size_t i);
+
+	static std::vector<unsigned char> &chunk(client &c, size_t i);
+	static void dropchunk(client &c, size_t i);
+	static bool enqueue(void *userdata, const void *header, size_t headersize, const void *data, size_t size);
+};
+
+server::server(const char *address, int nchannels, int samplerate, capture::pcm_type intype, const options &opts)
+: listener(INVALID_SOCKET)
+, unixPath()
+, channels(nchannels)
+, inRate(samplerate)
+, inType(intype)
+, defaults(opts)
+, nextId(1)
+, clients()
+, scratch(4096)
+{
+#ifdef _WIN32
+	WSADATA wsadata;
+	if (WSAStartup(MAKEWORD(2, 2), &wsadata) != 0)
+		throw std::runtime_error("Cannot initialize Winsock");
+#endif
+
+	std::string addr = address;
+	bool tcp = !addr.empty() && addr.find_first_not_of("0123456789") == std::string::npos;
+	int result = -1;
+
+	if (tcp)
+	{
+		listener = socket(AF_INET, SOCK_STREAM, 0);
+		if (listener != INVALID_SOCKET)
+		{
+			int on = 1;
+			setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof(on));
+
+			sockaddr_in sin;
+			memset(&sin, 0, sizeof(sin));
+			sin.sin_family = AF_INET;
+			sin.sin_port = htons((unsigned short) atoi(addr.c_str()));
+			sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			result = bind(listener, (const sockaddr *) &sin, sizeof(sin));
+		}
+	}
+	else
+	{
+		sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		if (addr.empty() || addr.size() >= sizeof(sun.sun_path))
+			throw std::runtime_error("Invalid socket path");
+
+		sun.sun_family = AF_UNIX;
+		memcpy(sun.sun_path, addr.c_str(), addr.size());
+
+#ifndef _WIN32
+		// Leftover from a previous run
+		struct stat st;
+		if (stat(addr.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(addr.c_str());
+#endif
+
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener != INVALID_SOCKET)
+		{
+			result = bind(listener, (const sockaddr *) &sun, sizeof(sun));
+			if (result == 0)
+				unixPath = addr;
+		}
+	}
+
+	if (result != 0 || listen(listener, 8) != 0 || !setnonblocking(listener))
+	{
+		if (listener != INVALID_SOCKET)
+			closesock(listener);
+#ifdef _WIN32
+		WSACleanup();
+#endif
+		throw std::runtime_error("Cannot listen on " + addr);
+	}
+}
+
+server::~server()
+{
+	for (std::unique_ptr<client> &c: clients)
+	{
+		if (c->writer)
+			stream::close(c->writer);
+
+		closesock(c->sock);
+	}
+
+	closesock(listener);
+
+	if (!unixPath.empty())
+		remove(unixPath.c_str());
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+bool server::write(const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info)
+{
+	for (std::unique_ptr<client> &c: clients)
+	{
+		if (c->streaming && !c->failed && !stream::write(c->writer, buf, framecount, intype, info))
+			c->failed = true;
+	}
+
+	return poll();
+}
+
+bool server::poll()
+{
+	fd_set readable;
+	FD_ZERO(&readable);
+	FD_SET(listener, &readable);
+	socket_t highest = listener;
+
+	for (std::unique_ptr<client> &c: clients)
+	{
+		FD_SET(c->sock, &readable);
+		highest = std::max(highest, c->sock);
+	}
+
+	timeval timeout = {0, 0};
+	if (select((int) highest + 1, &readable, nullptr, nullptr, &timeout) > 0)
+	{
+		for (std::unique_ptr<client> &c: clients)
+		{
+			if (FD_ISSET(c->sock, &readable))
+				receive(*c);
+		}
+
+		if (FD_ISSET(listener, &readable))
+			accept();
+	}
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	for (size_t i = clients.size(); i > 0; i--)
+	{
+		client &c = *clients[i - 1];
+
+		if (c.streaming && !c.failed)
+		{
+			if (!stream::poll(c.writer))
+				c.failed = true;
+
+			flush(c);
+		}
+		else if (!c.streaming && !c.failed && now - c.connected >= std::chrono::milliseconds(defaults.handshakeMs))
+		{
+			fprintf(stderr, "Client %u: no request within %d ms\n", c.id, defaults.handshakeMs);
+			c.failed = true;
+		}
+
+		if (c.failed)
+			drop(i - 1);
+	}
+
+	return true;
+}
+
+void server::accept()
+{
+	socket_t sock = ::accept(listener, nullptr, nullptr);
+	if (sock == INVALID_SOCKET)
+		return;
+
+	if (clients.size() >= (size_t) defaults.maxClients || !setnonblocking(sock))
+	{
+		closesock(sock);
+		return;
+	}
+
+	std::unique_ptr<client> c(new client());
+	c->sock = sock;
+	c->id = nextId++;
+	c->connected = std::chrono::steady_clock::now();
+	c->streaming = false;
+	c->failed = false;
+	c->writer = nullptr;
+	c->head = 0;
+	c->count = 0;
+	c->queued = 0;
+	c->sentOffset = 0;
+	c->dropped = 0;
+
+	fprintf(stderr, "Client %u: connected\n", c->id);
+	clients.push_back(std::move(c));
+}
+
+void server::receive(client &c)
+{
+	int n = recv(c.sock, (char *) scratch.data(), (int) scratch.size(), 0);
+
+	if (n == 0 || (n < 0 && !wouldblock()))
+	{
+		c.failed = true;
+		return;
+	}
+
+	// Anything sent after the request is ignored
+	if (n < 0 || c.streaming)
+		return;
+
+	c.request.append((const char *) scratch.data(), n);
+
+	size_t eol = c.request.find('\n');
+	if (eol == std::string::npos)
+	{
+		if (c.request.size() > MAX_REQUEST)
+			c.failed = true;
+
+		return;
+	}
+
+	c.request.resize(eol);
+	if (!startstream(c))
+	{
+		fprintf(stderr, "Client %u: invalid request \"%s\"\n", c.id, c.request.c_str());
+		c.failed = true;
+	}
+}
+
+bool server::parserequest(const std::string &line, stream::options &sopts, policy &overflow, int &queueMs)
+{
+	std::istringstream words(line);
+	std::string word;
+
+	while (words >> word)
+	{
+		size_t eq = word.find('=');
+		if (eq == std::string::npos)
+			return false;
+
+		std::string key = word.substr(0, eq);
+		std::string value = word.substr(eq + 1);
+		char *end = nullptr;
+		long number = strtol(value.c_str(), &end, 10);
+		bool isnumber = !value.empty() && *end == 0 && number >= 0;
+
+		if (key == "format")
+		{
+			if (value == "pcm_u8")
+				sopts.format = capture::pcm_type::pcm_u8;
+			else if (value == "pcm_s16")
+				sopts.format = capture::pcm_type::pcm_s16;
+			else if (value == "pcm_f32")
+				sopts.format = capture::pcm_type::pcm_f32;
+			else
+				return false;
+		}
+		else if (key == "policy")
+		{
+			if (value == "drop-oldest")
+				overflow = policy::drop_oldest;
+			else if (value == "drop-newest")
+				overflow = policy::drop_newest;
+			else if (value == "disconnect")
+				overflow = policy::disconnect;
+			else
+				return false;
+		}
+		else if (!isnumber)
+			return false;
+		else if (key == "rate")
+			sopts.sampleRate = (int) number;
+		else if (key == "framed")
+			sopts.framed = number != 0;
+		else if (key == "latency-ms")
+			sopts.latencyMs = (int) number;
+		else if (key == "queue-ms")
+			queueMs = (int) number;
+		else
+			return false;
+	}
+
+	return true;
+}
+
+bool server::startstream(client &c)
+{
+	stream::options sopts = defaults.stream;
+	int queueMs = defaults.queueMs;
+	c.overflow = defaults.overflow;
+
+	if (!c.request.empty() && c.request.back() == '\r')
+		c.request.pop_back();
+
+	if (!parserequest(c.request, sopts, c.overflow, queueMs))
+		return false;
+
+	// Each client has its own chunking, so a fixed chunk size makes no sense
+	sopts.chunkBytes = 0;
+
+	int outRate = sopts.sampleRate > 0 ? sopts.sampleRate : inRate;
+	capture::pcm_type outType = sopts.format != capture::pcm_type::unknown ? sopts.format : inType;
+	size_t frameSize = wave::pcmtype_size(outType) * channels;
+	c.queueLimit = (size_t) std::max(outRate * (int64_t) queueMs / 1000, (int64_t) 1) * frameSize;
+
+	try
+	{
+		c.writer = stream::newwriter(enqueue, &c, channels, inRate, inType, sopts);
+	}
+	catch (const std::runtime_error &)
+	{
+		return false;
+	}
+
+	c.streaming = true;
+	return true;
+}
+
+std::vector<unsigned char> &server::chunk(client &c, size_t i)
+{
+	return c.chunks[(c.head + i) % c.chunks.size()];
+}
+
+// Only the first two chunks are ever dropped
+void server::dropchunk(client &c, size_t i)
+{
+	c.queued -= chunk(c, i).size();
+
+	if (i == 1)
+		chunk(c, 0).swap(chunk(c, 1));
+
+	c.head = (c.head + 1) % c.chunks.size();
+	c.count--;
+}
+
+bool server::enqueue(void *userdata, const void *header, size_t headersize, const void *data, size_t size)
+{
+	client &c = *(client *) userdata;
+	size_t bytes = headersize + size;
+
+	// A chunk always fits into an empty queue
+	if (c.queued + bytes > c.queueLimit && c.count > 0)
+	{
+		switch (c.overflow)
+		{
+		case policy::disconnect:
+			c.failed = true;
+			return false;
+		case policy::drop_newest:
+			c.dropped++;
+			return true;
+		default:
+		{
+			// The chunk being sent has to go out whole
+			size_t keep = c.sentOffset > 0 ? 1 : 0;
+			while (c.queued + bytes > c.queueLimit && c.count > keep)
+			{
+				dropchunk(c, keep);
+				c.dropped++;
+			}
+
+			break;
+		}
+		}
+	}
+
+	if (c.count == c.chunks.size())
+	{
+		// Unroll into a ring twice the size
+		std::vector<std::vector<unsigned char>> grown(std::max<size_t>(c.chunks.size() * 2, 16));
+		for (size_t i = 0; i < c.count; i++)
+			grown[i].swap(chunk(c, i));
+
+		c.chunks.swap(grown);
+		c.head = 0;
+	}
+
+	c.count++;
+	std::vector<unsigned char> &dest = chunk(c, c.count - 1);
+	dest.resize(bytes);
+	if (header)
+		memcpy(dest.data(), header, headersize);
+
+	memcpy(dest.data() + headersize, data, size);
+	c.queued += bytes;
+	return true;
+}
+
+void server::flush(client &c)
+{
+	while (c.count > 0)
+	{
+		const std::vector<unsigned char> &front = chunk(c, 0);
+		int n = send(c.sock, (const char *) front.data() + c.sentOffset, (int) (front.size() - c.sentOffset), SEND_FLAGS);
+
+		if (n < 0)
+		{
+			if (!wouldblock())
+				c.failed = true;
+
+			return;
+		}
+
+		c.sentOffset += n;
+		if (c.sentOffset == front.size())
+		{
+			dropchunk(c, 0);
+			c.sentOffset = 0;
+		}
+	}
+}
+
+void server::drop(size_t i)
+{
+	client &c = *clients[i];
+
+	if (c.dropped > 0)
+		fprintf(stderr, "Client %u: disconnected, %llu chunks dropped\n", c.id, (unsigned long long) c.dropped);
+	else
+		fprintf(stderr, "Client %u: disconnected\n", c.id);
+
+	if (c.writer)
+		stream::close(c.writer);
+
+	closesock(c.sock);
+	clients.erase(clients.begin() + i);
+}
+
+bool server::writeend()
+{
+	// Last chance for what is still buffered, without waiting
+	for (std::unique_ptr<client> &c: clients)
+	{
+		if (c->streaming && !c->failed)
+		{
+			stream::close(c->writer);
+			c->writer = nullptr;
+			flush(*c);
+		}
+	}
+
+	return true;
+}
+
+server *newserver(const char *address, int nchannels, int samplerate, capture::pcm_type intype, const options &opts)
+{
+	return new server(address, nchannels, samplerate, intype, opts);
+}
+
+bool write(server *server, const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info)
+{
+	return server->write(buf, framecount, intype, info);
+}
+
+bool poll(server *server)
+{
+	return server->poll();
+}
+
+bool close(server *server)
+{
+	bool result = server->writeend();
+	delete server;
+	return result;
+}
+
+}
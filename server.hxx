@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdio>
+
+#include "capture.hxx"
+#include "stream.hxx"
+
+namespace server
+{
+
+// Serves the capture to local clients over a socket. Everything runs from
+// write() and poll() on the caller's thread with non-blocking sockets.
+//
+// After connecting, a client sends one line of space separated settings,
+// e.g. "format=pcm_s16 rate=48000 framed=1 policy=drop-oldest queue-ms=500",
+// and then receives the stream. An empty line takes the server defaults.
+// Keys: format (pcm_u8, pcm_s16, pcm_f32), rate, framed (0/1), latency-ms,
+// policy (drop-oldest, drop-newest, disconnect), queue-ms.
+typedef struct server server;
+
+// What happens when a client's queue is full
+typedef enum class policy
+{
+	drop_oldest,
+	drop_newest,
+	disconnect,
+	max_enum
+} policy;
+
+typedef struct options
+{
+	// Defaults for clients that don't ask for anything else
+	stream::options stream;
+	policy overflow = policy::drop_oldest;
+	// Audio a client may have queued before "overflow" applies
+	int queueMs = 500;
+	int maxClients = 16;
+	// Clients that have not sent their request line by then are closed, so
+	// they cannot hold on to a slot
+	int handshakeMs = 5000;
+} options;
+
+// "address" is a port number on the loopback interface or a Unix socket path.
+server *newserver(const char *address, int nchannels, int samplerate, capture::pcm_type intype, const options &opts = options());
+bool write(server *server, const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info = nullptr);
+// Accepts clients, reads their requests and sends queued audio. Never blocks.
+bool poll(server *server);
+bool close(server *server);
+
+}
@@ -0,0 +1,494 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include "conv.hxx"
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "shmring.hxx"
+#include "wave.hxx"
+
+namespace shmring
+{
+
+static constexpr uint32_t RING_MAGIC = 0x474E5253; // "SRNG"
+static constexpr uint32_t RING_VERSION = 1;
+static constexpr size_t MAX_READERS = 16;
+
+typedef struct shared_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t headerSize;
+	uint32_t sampleRate;
+	uint32_t channels;
+	uint32_t format;
+	uint64_t frameSize;
+	uint64_t capacity;
+	// Total bytes written. "writeLimit" is raised before new data is copied
+	// in and "writeCursor" after, so a reader can tell which part of what it
+	// just copied may have been overwritten meanwhile.
+	std::atomic<uint64_t> writeCursor;
+	std::atomic<uint64_t> writeLimit;
+	std::atomic<uint32_t> closed;
+	// Process of the writer, so that a ring left behind by a crash can be
+	// told apart from a live one
+	uint32_t writerPid;
+	// Read position of each attached reader plus one. 0 marks a free slot.
+	std::atomic<uint64_t> readers[MAX_READERS];
+} shared_header;
+
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "atomics must be plain words in shared memory");
+static_assert(offsetof(shared_header, readers) == 64, "writerPid must stay in the padding before readers");
+
+static constexpr size_t DATA_OFF = (sizeof(shared_header) + 63) / 64 * 64;
+
+typedef struct mapping
+{
+	void *base;
+	size_t size;
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	int fd;
+#endif
+} mapping;
+
+#ifdef _WIN32
+static std::wstring mappingname(const std::string &name)
+{
+	return conv::fromstring("Local\\" + name);
+}
+
+static bool createmapping(const std::string &name, size_t size, mapping &m)
+{
+	m.size = size;
+	m.handle = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD) ((uint64_t) size >> 32), (DWORD) size, mappingname(name).c_str());
+	if (m.handle == nullptr)
+		return false;
+
+	// Another writer owns this name
+	if (GetLastError() == ERROR_ALREADY_EXISTS)
+	{
+		CloseHandle(m.handle);
+		return false;
+	}
+
+	m.base = MapViewOfFile(m.handle, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (m.base == nullptr)
+	{
+		CloseHandle(m.handle);
+		return false;
+	}
+
+	return true;
+}
+
+static bool openmapping(const std::string &name, mapping &m)
+{
+	m.handle = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, mappingname(name).c_str());
+	if (m.handle == nullptr)
+		return false;
+
+	m.base = MapViewOfFile(m.handle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (m.base == nullptr)
+	{
+		CloseHandle(m.handle);
+		return false;
+	}
+
+	MEMORY_BASIC_INFORMATION meminfo;
+	VirtualQuery(m.base, &meminfo, sizeof(meminfo));
+	m.size = meminfo.RegionSize;
+	return true;
+}
+
+static void closemapping(mapping &m, const std::string &name, bool owner)
+{
+	UnmapViewOfFile(m.base);
+	CloseHandle(m.handle);
+}
+
+static uint32_t currentpid()
+{
+	return (uint32_t) GetCurrentProcessId();
+}
+#else
+static std::string mappingname(const std::string &name)
+{
+	return name[0] == '/' ? name : "/" + name;
+}
+
+// The ring's writer is gone without unlinking it, after a crash. A ring
+// whose header is not filled in yet belongs to a writer that is starting.
+static bool isstale(const std::string &name)
+{
+	int fd = shm_open(mappingname(name).c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	bool stale = false;
+
+	if (fstat(fd, &st) == 0 && (size_t) st.st_size >= DATA_OFF)
+	{
+		void *base = mmap(nullptr, DATA_OFF, PROT_READ, MAP_SHARED, fd, 0);
+		if (base != MAP_FAILED)
+		{
+			const shared_header *h = (const shared_header *) base;
+			stale = h->magic == RING_MAGIC && h->writerPid != 0 && kill((pid_t) h->writerPid, 0) != 0 && errno == ESRCH;
+			munmap(base, DATA_OFF);
+		}
+	}
+
+	::close(fd);
+	return stale;
+}
+
+static bool createmapping(const std::string &name, size_t size, mapping &m)
+{
+	m.size = size;
+	// Another writer owns this name. Truncating its ring would fault the
+	// readers still mapping it.
+	m.fd = shm_open(mappingname(name).c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+
+	// Readers still attached to a stale ring keep their mapping
+	if (m.fd < 0 && errno == EEXIST && isstale(name))
+	{
+		shm_unlink(mappingname(name).c_str());
+		m.fd = shm_open(mappingname(name).c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	}
+
+	if (m.fd < 0)
+		return false;
+
+	if (ftruncate(m.fd, (off_t) size) != 0)
+	{
+		::close(m.fd);
+		shm_unlink(mappingname(name).c_str());
+		return false;
+	}
+
+	m.base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m.fd, 0);
+	if (m.base == MAP_FAILED)
+	{
+		::close(m.fd);
+		shm_unlink(mappingname(name).c_str());
+		return false;
+	}
+
+	return true;
+}
+
+static bool openmapping(const std::string &name, mapping &m)
+{
+	m.fd = shm_open(mappingname(name).c_str(), O_RDWR, 0);
+	if (m.fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(m.fd, &st) != 0 || (size_t) st.st_size < DATA_OFF)
+	{
+		::close(m.fd);
+		return false;
+	}
+
+	m.size = (size_t) st.st_size;
+	m.base = mmap(nullptr, m.size, PROT_READ | PROT_WRITE, MAP_SHARED, m.fd, 0);
+	if (m.base == MAP_FAILED)
+	{
+		::close(m.fd);
+		return false;
+	}
+
+	return true;
+}
+
+static void closemapping(mapping &m, const std::string &name, bool owner)
+{
+	munmap(m.base, m.size);
+	::close(m.fd);
+
+	// Attached readers keep their mapping
+	if (owner)
+		shm_unlink(mappingname(name).c_str());
+}
+
+static uint32_t currentpid()
+{
+	return (uint32_t) getpid();
+}
+#endif
+
+struct writer
+{
+	writer(const char *name, int nchannels, int samplerate, capture::pcm_type format, size_t capacityframes);
+	~writer();
+
+	bool write(const void *buf, size_t framecount);
+	bool writeend();
+private:
+	std::string ringName;
+	mapping map;
+	shared_header *header;
+	unsigned char *data;
+	uint64_t frameSize;
+	uint64_t capacity;
+	uint64_t cursor;
+};
+
+writer::writer(const char *name, int nchannels, int samplerate, capture::pcm_type format, size_t capacityframes)
+: ringName(name)
+, map()
+, header(nullptr)
+, data(nullptr)
+, frameSize(wave::pcmtype_size(format) * nchannels)
+, capacity(0)
+, cursor(0)
+{
+	if (ringName.empty())
+		throw std::runtime_error("Shared memory name is empty");
+
+	capacity = std::max<size_t>(capacityframes, 1) * frameSize;
+	if (!createmapping(ringName, DATA_OFF + capacity, map))
+		throw std::runtime_error("Cannot create shared memory " + ringName + ", is another writer using the name?");
+
+	header = new (map.base) shared_header();
+	header->magic = RING_MAGIC;
+	header->version = RING_VERSION;
+	header->headerSize = DATA_OFF;
+	header->sampleRate = samplerate;
+	header->channels = nchannels;
+	header->format = (uint32_t) format;
+	header->frameSize = frameSize;
+	header->capacity = capacity;
+	header->writeCursor.store(0);
+	header->writeLimit.store(0);
+	header->closed.store(0);
+	header->writerPid = currentpid();
+
+	for (size_t i = 0; i < MAX_READERS; i++)
+		header->readers[i].store(0);
+
+	data = (unsigned char *) map.base + DATA_OFF;
+}
+
+writer::~writer()
+{
+	closemapping(map, ringName, true);
+}
+
+bool writer::write(const void *buf, size_t framecount)
+{
+	const unsigned char *src = (const unsigned char *) buf;
+	uint64_t bytes = framecount * frameSize;
+
+	// Only the newest "capacity" bytes can be kept
+	if (bytes > capacity)
+	{
+		src += bytes - capacity;
+		cursor += bytes - capacity;
+		bytes = capacity;
+	}
+
+	header->writeLimit.store(cursor + bytes, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	size_t offset = (size_t) (cursor % capacity);
+	size_t first = (size_t) std::min<uint64_t>(bytes, capacity - offset);
+	memcpy(data + offset, src, first);
+	memcpy(data, src + first, (size_t) bytes - first);
+
+	cursor += bytes;
+	header->writeCursor.store(cursor, std::memory_order_release);
+	return true;
+}
+
+bool writer::writeend()
+{
+	header->closed.store(1, std::memory_order_release);
+	return true;
+}
+
+struct reader
+{
+	reader(const char *name);
+	~reader();
+
+	ring_info getInfo() const noexcept;
+	size_t read(void *buf, size_t maxframes, uint64_t *lost);
+	bool finished() const noexcept;
+private:
+	std::string ringName;
+	mapping map;
+	shared_header *header;
+	const unsigned char *data;
+	uint64_t frameSize;
+	uint64_t capacity;
+	uint64_t cursor;
+	uint64_t lostBytes;
+	size_t slot;
+};
+
+reader::reader(const char *name)
+: ringName(name)
+, map()
+, header(nullptr)
+, data(nullptr)
+, frameSize(0)
+, capacity(0)
+, cursor(0)
+, lostBytes(0)
+, slot(MAX_READERS)
+{
+	if (!openmapping(ringName, map))
+		throw std::runtime_error("Cannot open shared memory");
+
+	header = (shared_header *) map.base;
+	if (header->magic != RING_MAGIC || header->version != RING_VERSION || map.size < header->headerSize + header->capacity)
+	{
+		closemapping(map, ringName, false);
+		throw std::runtime_error("Not a compatible capture ring");
+	}
+
+	data = (const unsigned char *) map.base + header->headerSize;
+	frameSize = header->frameSize;
+	capacity = header->capacity;
+	cursor = header->writeCursor.load(std::memory_order_acquire);
+
+	for (size_t i = 0; i < MAX_READERS; i++)
+	{
+		uint64_t expected = 0;
+		if (header->readers[i].compare_exchange_strong(expected, cursor + 1))
+		{
+			slot = i;
+			break;
+		}
+	}
+}
+
+reader::~reader()
+{
+	if (slot < MAX_READERS)
+		header->readers[slot].store(0);
+
+	closemapping(map, ringName, false);
+}
+
+ring_info reader::getInfo() const noexcept
+{
+	return {(int) header->sampleRate, (int) header->channels, (capture::pcm_type) header->format, (size_t) (capacity / frameSize)};
+}
+
+size_t reader::read(void *buf, size_t maxframes, uint64_t *lost)
+{
+	unsigned char *dest = (unsigned char *) buf;
+	uint64_t bytes = 0;
+
+	while (true)
+	{
+		uint64_t written = header->writeCursor.load(std::memory_order_acquire);
+
+		if (written - cursor > capacity)
+		{
+			lostBytes += written - capacity - cursor;
+			cursor = written - capacity;
+		}
+
+		bytes = std::min<uint64_t>(written - cursor, maxframes * frameSize);
+
+		size_t offset = (size_t) (cursor % capacity);
+		size_t first = (size_t) std::min<uint64_t>(bytes, capacity - offset);
+		memcpy(dest, data + offset, first);
+		memcpy(dest + first, data, (size_t) bytes - first);
+
+		// Anything the writer may have touched while copying is invalid
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t limit = header->writeLimit.load(std::memory_order_relaxed);
+		if (limit > capacity && cursor < limit - capacity)
+		{
+			lostBytes += limit - capacity - cursor;
+			cursor = limit - capacity;
+			continue;
+		}
+
+		break;
+	}
+
+	cursor += bytes;
+
+	if (slot < MAX_READERS)
+		header->readers[slot].store(cursor + 1, std::memory_order_relaxed);
+
+	if (lost)
+	{
+		*lost = lostBytes / frameSize;
+		lostBytes = 0;
+	}
+
+	return (size_t) (bytes / frameSize);
+}
+
+bool reader::finished() const noexcept
+{
+	return header->closed.load(std::memory_order_acquire) && cursor == header->writeCursor.load(std::memory_order_acquire);
+}
+
+writer *newwriter(const char *name, int nchannels, int samplerate, capture::pcm_type format, size_t capacityframes)
+{
+	return new writer(name, nchannels, samplerate, format, capacityframes);
+}
+
+bool write(writer *writer, const void *buf, size_t framecount)
+{
+	return writer->write(buf, framecount);
+}
+
+bool close(writer *writer)
+{
+	bool result = writer->writeend();
+	delete writer;
+	return result;
+}
+
+reader *newreader(const char *name)
+{
+	return new reader(name);
+}
+
+ring_info getinfo(reader *reader) noexcept
+{
+	return reader->getInfo();
+}
+
+size_t read(reader *reader, void *buf, size_t maxframes, uint64_t *lost)
+{
+	return reader->read(buf, maxframes, lost);
+}
+
+bool finished(reader *reader)
+{
+	return reader->finished();
+}
+
+void close(reader *reader)
+{
+	delete reader;
+}
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+#include "capture.hxx"
+
+namespace shmring
+{
+
+// Single writer, many readers ring in named shared memory. The writer never
+// waits for readers; a reader that falls more than the ring size behind
+// skips ahead and is told how much it lost.
+typedef struct writer writer;
+typedef struct reader reader;
+
+typedef struct ring_info
+{
+	int sampleRate;
+	int channels;
+	capture::pcm_type format;
+	size_t capacityFrames;
+} ring_info;
+
+writer *newwriter(const char *name, int nchannels, int samplerate, capture::pcm_type format, size_t capacityframes);
+bool write(writer *writer, const void *buf, size_t framecount);
+bool close(writer *writer);
+
+// Starts reading at the current write position.
+reader *newreader(const char *name);
+ring_info getinfo(reader *reader) noexcept;
+// Copies up to "maxframes" frames. "lost" receives the frames skipped since
+// the last call because the reader fell behind.
+size_t read(reader *reader, void *buf, size_t maxframes, uint64_t *lost = nullptr);
+// The writer has finished and everything was read.
+bool finished(reader *reader);
+void close(reader *reader);
+
+}
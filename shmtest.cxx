@@ -0,0 +1,343 @@
+// Test harness for the shared memory ring. One writer publishes a synthetic
+// source and forked readers check every frame they get against it, so this
+// runs on Linux without a capture device:
+//   clang++ -O2 -std=c++14 shmtest.cxx shmring.cxx synth.cxx wave.cxx peaks.cxx -o shmtest -lrt
+// The last reader is slow on purpose when there is more than one, so the
+// overrun path is covered too. A writer that is killed must not keep its
+// name from the next one.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "CLI11.hpp"
+#include "shmring.hxx"
+#include "synth.hxx"
+#include "wave.hxx"
+
+typedef struct test_options
+{
+	int channels = 2;
+	int sampleRate = 48000;
+	capture::pcm_type format = capture::pcm_type::pcm_s16;
+	double seconds = 5.0;
+	double ringSeconds = 1.0;
+	// Audio is written this many times faster than real time
+	double speed = 4.0;
+	int readers = 3;
+} test_options;
+
+// What the source produces is 100 ms repeated, see synth::source. One
+// period of it is enough to check any frame.
+static std::vector<unsigned char> maketable(const test_options &opts, size_t &periodframes)
+{
+	periodframes = (size_t) std::max(opts.sampleRate / 10, 1);
+
+	synth::source *src = synth::newsource(opts.channels, opts.sampleRate, opts.format, 0.1, 100);
+	capture::buffer_info info;
+	std::vector<unsigned char> table = synth::getbuf(src, info);
+	synth::close(src);
+
+	return table;
+}
+
+// Returns the exit code of the reader process
+static int runreader(const std::string &name, const test_options &opts, int index, bool slow, int readyfd)
+{
+	shmring::reader *reader;
+
+	try
+	{
+		reader = shmring::newreader(name.c_str());
+	}
+	catch (const std::runtime_error &e)
+	{
+		fprintf(stderr, "Reader %d: %s\n", index, e.what());
+		return 1;
+	}
+
+	// The parent starts writing once every reader is attached
+	char ready = 1;
+	if (::write(readyfd, &ready, 1) != 1)
+		return 1;
+
+	::close(readyfd);
+
+	shmring::ring_info info = shmring::getinfo(reader);
+	if (info.channels != opts.channels || info.sampleRate != opts.sampleRate || info.format != opts.format)
+	{
+		fprintf(stderr, "Reader %d: the ring reports a different format\n", index);
+		shmring::close(reader);
+		return 1;
+	}
+
+	size_t periodFrames;
+	std::vector<unsigned char> table = maketable(opts, periodFrames);
+	size_t frameSize = wave::pcmtype_size(opts.format) * opts.channels;
+	// A slow reader takes 10 ms of audio per call and then sleeps 20 ms
+	size_t maxFrames = slow ? (size_t) std::max(opts.sampleRate / 100, 1) : periodFrames;
+	std::vector<unsigned char> buf(maxFrames * frameSize);
+	uint64_t position = 0;
+	uint64_t totalLost = 0;
+	uint64_t mismatched = 0;
+
+	while (!shmring::finished(reader))
+	{
+		uint64_t lost = 0;
+		size_t count = shmring::read(reader, buf.data(), maxFrames, &lost);
+
+		position += lost;
+		totalLost += lost;
+
+		for (size_t done = 0; done < count;)
+		{
+			size_t offset = (size_t) ((position + done) % periodFrames);
+			size_t n = std::min(count - done, periodFrames - offset);
+
+			if (memcmp(buf.data() + done * frameSize, table.data() + offset * frameSize, n * frameSize) != 0)
+				mismatched++;
+
+			done += n;
+		}
+
+		position += count;
+
+		if (slow)
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		else if (count == 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	shmring::close(reader);
+
+	uint64_t expected = (uint64_t) (opts.seconds * opts.sampleRate);
+	printf("Reader %d%s: %llu frames, %llu lost, %llu mismatched runs\n", index, slow ? " (slow)" : "",
+		(unsigned long long) (position - totalLost), (unsigned long long) totalLost, (unsigned long long) mismatched);
+
+	if (mismatched > 0 || position != expected)
+	{
+		fprintf(stderr, "Reader %d: expected %llu frames read or lost\n", index, (unsigned long long) expected);
+		return 1;
+	}
+
+	// A slow reader must have been lapped, the others must keep up
+	if (slow != (totalLost > 0))
+	{
+		fprintf(stderr, "Reader %d: %s\n", index, slow ? "never fell behind" : "fell behind");
+		return 1;
+	}
+
+	return 0;
+}
+
+static bool runwriter(shmring::writer *writer, const test_options &opts)
+{
+	synth::source *src = synth::newsource(opts.channels, opts.sampleRate, opts.format, opts.seconds);
+	std::vector<unsigned char> buf(opts.sampleRate * wave::pcmtype_size(opts.format) * opts.channels);
+	size_t frameSize = wave::pcmtype_size(opts.format) * opts.channels;
+	auto start = std::chrono::steady_clock::now();
+	bool result = true;
+
+	while (result && !synth::finished(src))
+	{
+		capture::buffer_info info;
+		size_t bytes = synth::getbuf(src, buf.data(), buf.size(), info);
+		result = shmring::write(writer, buf.data(), bytes / frameSize);
+
+		// Paced like a device, only faster
+		uint64_t end = info.position + bytes / frameSize;
+		std::this_thread::sleep_until(start + std::chrono::microseconds((uint64_t) (end * 1e6 / opts.sampleRate / opts.speed)));
+	}
+
+	synth::close(src);
+	return result;
+}
+
+// A writer killed without closing leaves its ring behind, the next writer
+// has to be able to take over the name
+static bool runcrash(const test_options &opts)
+{
+	std::string name = "shmtest-crash-" + std::to_string(getpid());
+	int readyPipe[2];
+
+	if (pipe(readyPipe) != 0)
+		return false;
+
+	fflush(stdout);
+	pid_t pid = fork();
+
+	if (pid == 0)
+	{
+		::close(readyPipe[0]);
+
+		try
+		{
+			shmring::newwriter(name.c_str(), opts.channels, opts.sampleRate, opts.format, 1);
+		}
+		catch (const std::runtime_error &)
+		{
+			_exit(1);
+		}
+
+		char ready = 1;
+		if (::write(readyPipe[1], &ready, 1) != 1)
+			_exit(1);
+
+		for (;;)
+			pause();
+	}
+
+	::close(readyPipe[1]);
+
+	char ready;
+	bool started = pid > 0 && read(readyPipe[0], &ready, 1) == 1;
+	::close(readyPipe[0]);
+
+	if (pid > 0)
+	{
+		kill(pid, SIGKILL);
+		waitpid(pid, nullptr, 0);
+	}
+
+	if (!started)
+	{
+		fprintf(stderr, "The writer to kill did not start\n");
+		return false;
+	}
+
+	try
+	{
+		shmring::close(shmring::newwriter(name.c_str(), opts.channels, opts.sampleRate, opts.format, 1));
+	}
+	catch (const std::runtime_error &e)
+	{
+		fprintf(stderr, "After a killed writer: %s\n", e.what());
+		return false;
+	}
+
+	printf("A killed writer's name was taken over\n");
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	CLI::App parser("Shared memory ring test against a synthetic source", argv[0]);
+
+	test_options opts;
+	std::string format = "pcm_s16";
+
+	parser.add_option("--channels", opts.channels, "Channels of the synthetic source.")->check(CLI::Range(1, 32));
+	parser.add_option("--rate", opts.sampleRate, "Sample rate of the synthetic source.")->check(CLI::PositiveNumber);
+	parser.add_option("--format", format, "Sample format of the ring.")->check(CLI::IsMember({"pcm_u8", "pcm_s16", "pcm_f32"}));
+	parser.add_option("--seconds", opts.seconds, "Length of the audio written.")->check(CLI::PositiveNumber);
+	parser.add_option("--ring-seconds", opts.ringSeconds, "Length of the ring.")->check(CLI::PositiveNumber);
+	parser.add_option("--speed", opts.speed, "Write this many times faster than real time.")->check(CLI::PositiveNumber);
+	parser.add_option("--readers", opts.readers, "Reader processes. With more than one, the last is slow.")->check(CLI::Range(1, 15));
+
+	try
+	{
+		parser.parse(argc, argv);
+	}
+	catch (const CLI::ParseError &e)
+	{
+		return parser.exit(e);
+	}
+
+	if (format == "pcm_u8")
+		opts.format = capture::pcm_type::pcm_u8;
+	else if (format == "pcm_f32")
+		opts.format = capture::pcm_type::pcm_f32;
+
+	std::string name = "shmtest-" + std::to_string(getpid());
+	shmring::writer *writer;
+
+	try
+	{
+		writer = shmring::newwriter(name.c_str(), opts.channels, opts.sampleRate, opts.format, (size_t) (opts.ringSeconds * opts.sampleRate));
+	}
+	catch (const std::runtime_error &e)
+	{
+		fprintf(stderr, "Error: %s\n", e.what());
+		return 1;
+	}
+
+	int failures = 0;
+
+	// A second writer must not take over a live ring
+	try
+	{
+		shmring::close(shmring::newwriter(name.c_str(), opts.channels, opts.sampleRate, opts.format, 1));
+		fprintf(stderr, "A second writer opened the same name\n");
+		failures++;
+	}
+	catch (const std::runtime_error &)
+	{
+	}
+
+	if (!runcrash(opts))
+		failures++;
+
+	int readyPipe[2];
+	if (pipe(readyPipe) != 0)
+	{
+		shmring::close(writer);
+		return 1;
+	}
+
+	std::vector<pid_t> children;
+	for (int i = 0; i < opts.readers; i++)
+	{
+		fflush(stdout);
+		pid_t pid = fork();
+
+		if (pid == 0)
+		{
+			::close(readyPipe[0]);
+			int result = runreader(name, opts, i, opts.readers > 1 && i == opts.readers - 1, readyPipe[1]);
+			fflush(stdout);
+			_exit(result);
+		}
+		else if (pid > 0)
+			children.push_back(pid);
+		else
+			failures++;
+	}
+
+	::close(readyPipe[1]);
+
+	// Readers that fail to attach close their end without writing
+	for (size_t i = 0; i < children.size(); i++)
+	{
+		char ready;
+		if (read(readyPipe[0], &ready, 1) != 1)
+			break;
+	}
+
+	::close(readyPipe[0]);
+
+	if (!runwriter(writer, opts))
+	{
+		fprintf(stderr, "Writing to the ring failed\n");
+		failures++;
+	}
+
+	shmring::close(writer);
+
+	for (pid_t pid: children)
+	{
+		int status;
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failures++;
+	}
+
+	printf("%s\n", failures == 0 ? "OK" : "FAILED");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,878 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fileio.hxx"
+#include "flac.hxx"
+#include "server.hxx"
+#include "shmring.hxx"
+#include "sink.hxx"
+#include "spool.hxx"
+#include "stream.hxx"
+#include "trace.hxx"
+
+namespace sink
+{
+
+struct sink
+{
+	virtual ~sink()
+	{
+	}
+
+	virtual bool write(const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info) = 0;
+	virtual bool close() = 0;
+
+	virtual bool poll()
+	{
+		return true;
+	}
+
+	virtual bool mark()
+	{
+		return false;
+	}
+
+	virtual bool split()
+	{
+		return false;
+	}
+
+	// Also called after close()
+	virtual bool levels(wave::channel_levels *dest)
+	{
+		return false;
+	}
+};
+
+struct wavesink: public sink
+{
+	wavesink(wave::writer *w, int nchannels)
+	: writer(w)
+	, last(nchannels, wave::channel_levels {0, 0.0f})
+	{
+	}
+
+	bool write(const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info) override
+	{
+		return wave::write(writer, buf, framecount, intype);
+	}
+
+	bool mark() override
+	{
+		return wave::addcue(writer);
+	}
+
+	bool split() override
+	{
+		return wave::nextsegment(writer);
+	}
+
+	bool levels(wave::channel_levels *dest) override
+	{
+		if (writer)
+			wave::getlevels(writer, last.data());
+
+		std::copy(last.begin(), last.end(), dest);
+		return true;
+	}
+
+	bool close() override
+	{
+		wave::getlevels(writer, last.data());
+		bool result = wave::close(writer);
+		writer = nullptr;
+		return result;
+	}
+
+private:
+	wave::writer *writer;
+	std::vector<wave::channel_levels> last;
+};
+
+// One mono WAV file per channel. Each block is split and converted in a
+// single pass into a staging buffer per channel, measuring the levels on the
+// way, then handed to the writers unconverted.
+struct splitsink: public sink
+{
+	splitsink(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype, const wave::options &opts);
+	~splitsink();
+
+	bool write(const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info) override
+	{
+		const unsigned char *data = (const unsigned char *) buf;
+		size_t framesize = wave::pcmtype_size(intype) * writers.size();
+		// Only what is converted to an integer type, like wave::writer
+		wave::channel_levels *measured = intype != format && format != capture::pcm_type::pcm_f32 ? channelLevels.data() : nullptr;
+
+		while (framecount > 0)
+		{
+			size_t count = std::min(framecount, STAGING_FRAMES);
+			if (!wave::deinterleave(planes.data(), format, data, intype, count, (int) writers.size(), measured))
+				return false;
+
+			for (size_t c = 0; c < writers.size(); c++)
+			{
+				if (!wave::write(writers[c], planes[c], count, format))
+					return false;
+			}
+
+			data += count * framesize;
+			framecount -= count;
+		}
+
+		return true;
+	}
+
+	bool mark() override
+	{
+		bool result = true;
+		for (wave::writer *w: writers)
+			result = wave::addcue(w) && result;
+
+		return result;
+	}
+
+	bool split() override
+	{
+		bool result = true;
+		for (wave::writer *w: writers)
+			result = wave::nextsegment(w) && result;
+
+		return result;
+	}
+
+	bool levels(wave::channel_levels *dest) override
+	{
+		std::copy(channelLevels.begin(), channelLevels.end(), dest);
+		return true;
+	}
+
+	bool close() override
+	{
+		bool result = true;
+		for (wave::writer *w: writers)
+			result = wave::close(w) && result;
+
+		writers.clear();
+		return result;
+	}
+
+private:
+	static constexpr size_t STAGING_FRAMES = 4096;
+
+	capture::pcm_type format;
+	std::vector<wave::writer *> writers;
+	std::vector<std::vector<unsigned char>> staging;
+	std::vector<void *> planes;
+	std::vector<wave::channel_levels> channelLevels;
+};
+
+// "rec.wav" becomes "rec.ch1.wav", a name without extension gets ".ch1.wav"
+static std::string channelname(const std::string &dest, int channel)
+{
+	std::string suffix = ".ch" + std::to_string(channel + 1);
+	size_t slash = dest.find_last_of("/\\");
+	size_t dot = dest.find_last_of('.');
+
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return dest + suffix + ".wav";
+
+	return dest.substr(0, dot) + suffix + dest.substr(dot);
+}
+
+splitsink::splitsink(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype, const wave::options &opts)
+: format(outtype)
+, writers()
+, staging(nchannels, std::vector<unsigned char>(STAGING_FRAMES * wave::pcmtype_size(outtype)))
+, planes(nchannels)
+, channelLevels(nchannels, wave::channel_levels {0, 0.0f})
+{
+	for (int c = 0; c < nchannels; c++)
+	{
+		planes[c] = staging[c].data();
+
+		try
+		{
+			writers.push_back(wave::newwriter(channelname(dest, c).c_str(), 1, samplerate, outtype, opts));
+		}
+		catch (...)
+		{
+			close();
+			throw;
+		}
+	}
+}
+
+splitsink::~splitsink()
+{
+	close();
+}
+
+// PCM WAV through fileio::output. Samples are converted into a pool of
+// aligned buffers which a worker thread writes out whole, so the capture
+// loop only waits on the disk once every buffer is in flight. The sizes in
+// the header are written at close.
+struct directsink: public sink
+{
+	directsink(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype);
+	~directsink();
+
+	bool write(const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info) override
+	{
+		const unsigned char *data = (const unsigned char *) buf;
+		size_t insize = wave::pcmtype_size(intype);
+		size_t outsize = wave::pcmtype_size(format);
+		size_t samplecount = framecount * channels;
+		// Levels are measured a whole frame at a time
+		bool measured = intype != format && format != capture::pcm_type::pcm_f32;
+
+		while (samplecount > 0)
+		{
+			if (failed)
+				return false;
+
+			// Buffers hold whole samples, the header size is a multiple of 4
+			size_t room = (BUFFER_BYTES - fill) / outsize;
+			if (measured && room < (size_t) channels)
+			{
+				// The frame straddles two buffers and goes through "frame"
+				if (!wave::convert(frame.data(), format, data, intype, 1, channels, channelLevels.data()))
+					return false;
+
+				size_t head = room * outsize;
+				memcpy(buffers[current] + fill, frame.data(), head);
+				fill += head;
+				submit();
+
+				memcpy(buffers[current], frame.data() + head, frame.size() - head);
+				fill = frame.size() - head;
+				dataBytes += frame.size();
+				data += channels * insize;
+				samplecount -= channels;
+				continue;
+			}
+
+			size_t count = std::min(samplecount, room);
+			if (measured)
+				count -= count % channels;
+
+			bool result = measured
+				? wave::convert(buffers[current] + fill, format, data, intype, count / channels, channels, channelLevels.data())
+				: wave::convert(buffers[current] + fill, format, data, intype, count);
+
+			if (!result)
+				return false;
+
+			fill += count * outsize;
+			dataBytes += count * outsize;
+			data += count * insize;
+			samplecount -= count;
+
+			if (fill == BUFFER_BYTES)
+				submit();
+		}
+
+		return !failed;
+	}
+
+	bool close() override
+	{
+		if (file == nullptr)
+			return false;
+
+		// The tail is padded to the alignment and cut off again below
+		size_t padded = (fill + fileio::OUTPUT_ALIGNMENT - 1) / fileio::OUTPUT_ALIGNMENT * fileio::OUTPUT_ALIGNMENT;
+		memset(buffers[current] + fill, 0, padded - fill);
+		fill = padded;
+		submit();
+		stop();
+
+		uint64_t length = wave::PCM_HEADER_SIZE + dataBytes;
+		wave::pcmheader(headerBlock, channels, sampleRate, format, (uint32_t) std::min<uint64_t>(dataBytes, UINT32_MAX - wave::PCM_HEADER_SIZE));
+
+		bool result = !failed && fileio::writeat(file, 0, headerBlock, fileio::OUTPUT_ALIGNMENT);
+		if (!fileio::direct(file))
+			fprintf(stderr, "Direct I/O is not available for this file, it was written through the cache\n");
+
+		result = fileio::close(file, length) && result;
+		file = nullptr;
+		return result;
+	}
+
+	bool levels(wave::channel_levels *dest) override
+	{
+		std::copy(channelLevels.begin(), channelLevels.end(), dest);
+		return true;
+	}
+
+private:
+	static constexpr size_t BUFFER_BYTES = 1 << 20;
+	static constexpr size_t BUFFER_COUNT = 8;
+
+	fileio::output *file;
+	int channels;
+	int sampleRate;
+	capture::pcm_type format;
+	uint64_t dataBytes;
+	std::vector<wave::channel_levels> channelLevels;
+	std::vector<unsigned char> frame;
+
+	// "current" is being filled by the caller, the "inflight" before it
+	// belong to the worker. Buffer "n" of the file goes to offset
+	// n * BUFFER_BYTES.
+	std::vector<unsigned char *> buffers;
+	std::vector<size_t> sizes;
+	unsigned char *headerBlock;
+	size_t current;
+	size_t fill;
+	size_t inflight;
+	uint64_t written;
+	bool finishing;
+	std::atomic<bool> failed;
+	std::mutex lock;
+	std::condition_variable changed;
+	std::thread worker;
+
+	void submit()
+	{
+		sizes[current] = fill;
+
+		std::unique_lock<std::mutex> guard(lock);
+		inflight++;
+		changed.notify_all();
+
+		// The next buffer must be back from the worker
+		changed.wait(guard, [this]() { return inflight < BUFFER_COUNT; });
+		current = (current + 1) % BUFFER_COUNT;
+		fill = 0;
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			finishing = true;
+		}
+
+		changed.notify_all();
+		worker.join();
+	}
+
+	void drain()
+	{
+		TRACE_THREAD("direct");
+		std::unique_lock<std::mutex> guard(lock);
+
+		while (true)
+		{
+			changed.wait(guard, [this]() { return inflight > 0 || finishing; });
+			if (inflight == 0)
+				break;
+
+			size_t index = (size_t) (written % BUFFER_COUNT);
+			guard.unlock();
+
+			{
+				TRACE_SCOPE("direct_write");
+
+				// Kept for rewriting the header at close
+				if (written == 0)
+					memcpy(headerBlock, buffers[index], fileio::OUTPUT_ALIGNMENT);
+
+				if (!failed && !fileio::writeat(file, written * BUFFER_BYTES, buffers[index], sizes[index]))
+					failed = true;
+			}
+
+			guard.lock();
+			written++;
+			inflight--;
+			changed.notify_all();
+		}
+	}
+};
+
+directsink::directsink(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype)
+: file(nullptr)
+, channels(nchannels)
+, sampleRate(samplerate)
+, format(outtype)
+, dataBytes(0)
+, channelLevels(nchannels, wave::channel_levels {0, 0.0f})
+, frame(nchannels * wave::pcmtype_size(outtype))
+, buffers(BUFFER_COUNT, nullptr)
+, sizes(BUFFER_COUNT, 0)
+, headerBlock(nullptr)
+, current(0)
+, fill(wave::PCM_HEADER_SIZE)
+, inflight(0)
+, written(0)
+, finishing(false)
+, failed(false)
+, lock()
+, changed()
+, worker()
+{
+	try
+	{
+		for (unsigned char *&b: buffers)
+			b = (unsigned char *) fileio::allocaligned(BUFFER_BYTES);
+
+		headerBlock = (unsigned char *) fileio::allocaligned(fileio::OUTPUT_ALIGNMENT);
+		file = fileio::create(dest);
+	}
+	catch (...)
+	{
+		for (unsigned char *b: buffers)
+			fileio::freealigned(b);
+
+		fileio::freealigned(headerBlock);
+		throw;
+	}
+
+	wave::pcmheader(buffers[0], channels, sampleRate, format, 0);
+	worker = std::thread(&directsink::drain, this);
+}
+
+directsink::~directsink()
+{
+	if (file)
+	{
+		stop();
+		fileio::close(file, wave::PCM_HEADER_SIZE + dataBytes);
+	}
+
+	for (unsigned char *b: buffers)
+		fileio::freealigned(b);
+
+	fileio::freealigned(headerBlock);
+}
+
+// Frames the loudness meter takes at a time
+static constexpr size_t NORMALIZE_BLOCK_FRAMES = 4096;
+
+// Float WAV with a loudness meter on the way in. The gain is applied at
+// close, in the same pass that converts to the file format.
+struct normalizedsink: public sink
+{
+	normalizedsink(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype, const loudness::options &norm, const wave::options &opts);
+
+	~normalizedsink()
+	{
+		if (writer)
+			wave::close(writer);
+
+		loudness::close(meter);
+	}
+
+	bool write(const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info) override
+	{
+		const unsigned char *data = (const unsigned char *) buf;
+		size_t frameSize = wave::pcmtype_size(intype) * channels;
+
+		// The meter works on planes, the file gets the frames as they came
+		for (size_t done = 0; done < framecount; done += planes.frames)
+		{
+			if (!planar::load(planes, data + done * frameSize, intype, std::min(framecount - done, planes.capacity)))
+				return false;
+
+			loudness::add(meter, planes);
+		}
+
+		return wave::write(writer, buf, framecount, intype);
+	}
+
+	bool mark() override
+	{
+		return wave::addcue(writer);
+	}
+
+	bool close() override
+	{
+		bool result = wave::close(writer);
+		writer = nullptr;
+
+		if (!result)
+			return false;
+
+		double lufs = loudness::integrated(meter);
+		double gain = loudness::gain(meter, norm);
+
+		try
+		{
+			uint64_t clipped = loudness::applygain(path.c_str(), (float) std::pow(10.0, gain / 20.0), format);
+			fprintf(
+				stderr,
+				"Normalized %s: %.1f LUFS, peak %.1f dBFS, gain %+.1f dB%s, %llu samples clipped\n",
+				path.c_str(),
+				lufs,
+				20.0 * std::log10((double) loudness::peak(meter)),
+				gain,
+				lufs != -HUGE_VAL && gain < norm.targetLufs - lufs ? " (held back by the ceiling)" : "",
+				(unsigned long long) clipped
+			);
+		}
+		catch (const std::runtime_error &e)
+		{
+			fprintf(stderr, "Error: %s\n", e.what());
+			return false;
+		}
+
+		return true;
+	}
+
+private:
+	wave::writer *writer;
+	loudness::meter *meter;
+	std::string path;
+	capture::pcm_type format;
+	loudness::options norm;
+	size_t channels;
+	planar::block planes;
+};
+
+normalizedsink::normalizedsink(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype, const loudness::options &n, const wave::options &opts)
+: writer(nullptr)
+, meter(nullptr)
+, path(dest)
+, format(outtype)
+, norm(n)
+, channels(nchannels)
+, planes()
+{
+	if (opts.format != wave::encoding::pcm || opts.segmentFrames > 0 || opts.segmentBytes > 0 || opts.splitOnRequest || opts.peaks)
+		throw std::runtime_error("Normalizing needs a single uncompressed WAV file without peaks");
+
+	planar::reset(planes, nchannels, NORMALIZE_BLOCK_FRAMES);
+	meter = loudness::newmeter(nchannels, samplerate);
+
+	try
+	{
+		writer = wave::newwriter(dest, nchannels, samplerate, capture::pcm_type::pcm_f32, opts);
+	}
+	catch (...)
+	{
+		loudness::close(meter);
+		throw;
+	}
+}
+
+struct flacsink: public sink
+{
+	flacsink(flac::writer *w)
+	: writer(w)
+	{
+	}
+
+	bool write(const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info) override
+	{
+		return flac::write(writer, buf, framecount, intype);
+	}
+
+	bool close() override
+	{
+		return flac::close(writer);
+	}
+
+private:
+	flac::writer *writer;
+};
+
+struct streamsink: public sink
+{
+	streamsink(stream::writer *w)
+	: writer(w)
+	{
+	}
+
+	bool write(const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info) override
+	{
+		return stream::write(writer, buf, framecount, intype, info);
+	}
+
+	bool poll() override
+	{
+		return stream::poll(writer);
+	}
+
+	bool close() override
+	{
+		return stream::close(writer);
+	}
+
+private:
+	stream::writer *writer;
+};
+
+struct shmsink: public sink
+{
+	shmsink(shmring::writer *w, capture::pcm_type format)
+	: writer(w)
+	, ringFormat(format)
+	{
+	}
+
+	bool write(const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info) override
+	{
+		// The ring holds the format it was created with
+		if (intype != ringFormat)
+			return false;
+
+		return shmring::write(writer, buf, framecount);
+	}
+
+	bool close() override
+	{
+		return shmring::close(writer);
+	}
+
+private:
+	shmring::writer *writer;
+	capture::pcm_type ringFormat;
+};
+
+struct serversink: public sink
+{
+	serversink(server::server *s)
+	: srv(s)
+	{
+	}
+
+	bool write(const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info) override
+	{
+		return server::write(srv, buf, framecount, intype, info);
+	}
+
+	bool poll() override
+	{
+		return server::poll(srv);
+	}
+
+	bool close() override
+	{
+		return server::close(srv);
+	}
+
+private:
+	server::server *srv;
+};
+
+// Hands everything to a spool and writes to "inner" from its own thread,
+// so a stalled output never holds up the capture loop
+struct queuedsink: public sink
+{
+	queuedsink(sink *s, spool::spool *q, int nchannels)
+	: inner(s)
+	, queue(q)
+	, snapshot(nchannels, wave::channel_levels {0, 0.0f})
+	, measured(s->levels(snapshot.data()))
+	, snapshotLock()
+	, failed(false)
+	, worker(&queuedsink::drain, this)
+	{
+	}
+
+	// A failure of "inner" shows up on the calls after it
+	bool write(const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info) override
+	{
+		return spool::push(queue, spool::kind::data, buf, framecount, intype, info) && !failed;
+	}
+
+	bool poll() override
+	{
+		return !failed;
+	}
+
+	bool mark() override
+	{
+		return spool::push(queue, spool::kind::mark) && !failed;
+	}
+
+	bool split() override
+	{
+		return spool::push(queue, spool::kind::split) && !failed;
+	}
+
+	bool levels(wave::channel_levels *dest) override
+	{
+		std::lock_guard<std::mutex> guard(snapshotLock);
+		std::copy(snapshot.begin(), snapshot.end(), dest);
+		return measured;
+	}
+
+	bool close() override
+	{
+		spool::finish(queue);
+		worker.join();
+
+		spool::stats stats = spool::getstats(queue);
+		if (stats.bytesSpilled > 0 || stats.framesLost > 0)
+			fprintf(stderr, "Queue: %llu bytes spilled to disk, %llu frames lost\n", (unsigned long long) stats.bytesSpilled, (unsigned long long) stats.framesLost);
+
+		spool::close(queue);
+		return inner->close() && !failed;
+	}
+
+	~queuedsink()
+	{
+		delete inner;
+	}
+
+private:
+	sink *inner;
+	spool::spool *queue;
+	// Levels of "inner" as of the last block written
+	std::vector<wave::channel_levels> snapshot;
+	bool measured;
+	std::mutex snapshotLock;
+	// Set by the worker when "inner" fails
+	std::atomic<bool> failed;
+	std::thread worker;
+
+	void check(bool result)
+	{
+		if (!result && !failed.exchange(true))
+			fprintf(stderr, "Error: the queued output failed\n");
+	}
+
+	void drain()
+	{
+		TRACE_THREAD("queue");
+		spool::block blk = {};
+
+		while (!spool::drained(queue))
+		{
+			if (spool::pop(queue, blk, 5))
+			{
+				switch (blk.type)
+				{
+				case spool::kind::data:
+					if (blk.framecount > 0)
+					{
+						TRACE_SCOPE("queue_write");
+						check(inner->write(blk.data.data(), blk.framecount, blk.intype, blk.hasInfo ? &blk.info : nullptr));
+
+						if (measured)
+						{
+							std::lock_guard<std::mutex> guard(snapshotLock);
+							inner->levels(snapshot.data());
+						}
+					}
+					break;
+				case spool::kind::mark:
+					check(inner->mark());
+					break;
+				case spool::kind::split:
+					check(inner->split());
+					break;
+				default:
+					break;
+				}
+			}
+
+			check(inner->poll());
+		}
+	}
+};
+
+sink *newwave(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype, const wave::options &opts)
+{
+	return new wavesink(wave::newwriter(dest, nchannels, samplerate, outtype, opts), nchannels);
+}
+
+sink *newsplit(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype, const wave::options &opts)
+{
+	return new splitsink(dest, nchannels, samplerate, outtype, opts);
+}
+
+sink *newdirect(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype)
+{
+	return new directsink(dest, nchannels, samplerate, outtype);
+}
+
+sink *newnormalized(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype, const loudness::options &norm, const wave::options &opts)
+{
+	return new normalizedsink(dest, nchannels, samplerate, outtype, norm, opts);
+}
+
+sink *newflac(const char *dest, int nchannels, int samplerate, int threads)
+{
+	return new flacsink(flac::newwriter(dest, nchannels, samplerate, threads));
+}
+
+sink *newstream(FILE *dest, int nchannels, int samplerate, capture::pcm_type intype, const stream::options &opts)
+{
+	return new streamsink(stream::newwriter(dest, nchannels, samplerate, intype, opts));
+}
+
+sink *newshm(const char *name, int nchannels, int samplerate, capture::pcm_type format, size_t capacityframes)
+{
+	return new shmsink(shmring::newwriter(name, nchannels, samplerate, format, capacityframes), format);
+}
+
+sink *newserver(const char *address, int nchannels, int samplerate, capture::pcm_type intype, const server::options &opts)
+{
+	return new serversink(server::newserver(address, nchannels, samplerate, intype, opts));
+}
+
+sink *newqueued(sink *inner, int nchannels, const spool::options &opts)
+{
+	spool::spool *queue = nullptr;
+
+	try
+	{
+		queue = spool::newspool(nchannels, opts);
+	}
+	catch (...)
+	{
+		close(inner);
+		throw;
+	}
+
+	return new queuedsink(inner, queue, nchannels);
+}
+
+bool write(sink *sink, const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info)
+{
+	return sink->write(buf, framecount, intype, info);
+}
+
+bool poll(sink *sink)
+{
+	return sink->poll();
+}
+
+bool mark(sink *sink)
+{
+	return sink->mark();
+}
+
+bool split(sink *sink)
+{
+	return sink->split();
+}
+
+bool levels(sink *sink, wave::channel_levels *dest)
+{
+	return sink->levels(dest);
+}
+
+bool close(sink *sink, wave::channel_levels *levels)
+{
+	bool result = sink->close();
+	if (levels)
+		sink->levels(levels);
+
+	delete sink;
+	return result;
+}
+
+}
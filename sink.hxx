@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdio>
+
+#include "capture.hxx"
+#include "loudness.hxx"
+#include "server.hxx"
+#include "spool.hxx"
+#include "stream.hxx"
+#include "wave.hxx"
+
+namespace sink
+{
+
+// Common front for everything the capture loop can write to
+typedef struct sink sink;
+
+sink *newwave(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype, const wave::options &opts = wave::options());
+// One mono WAV file per channel, named after "dest" with ".ch1", ".ch2"...
+// before the extension.
+sink *newsplit(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype, const wave::options &opts = wave::options());
+// Uncompressed WAV written with direct I/O from a pool of aligned buffers
+// on its own thread, into space allocated ahead in large extents. Falls back
+// to cached writes where direct I/O is not supported. The header sizes are
+// only written at close, see fileio::repairwav().
+sink *newdirect(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype);
+// WAV written as float while its loudness is measured, then brought to
+// "norm" and converted to "outtype" in place when closed, see
+// loudness::applygain(). Until then the file is a valid float WAV.
+sink *newnormalized(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype, const loudness::options &norm, const wave::options &opts = wave::options());
+sink *newflac(const char *dest, int nchannels, int samplerate, int threads = 0);
+sink *newstream(FILE *dest, int nchannels, int samplerate, capture::pcm_type intype, const stream::options &opts = stream::options());
+// Publishes frames unconverted in a shared memory ring, see shmring.hxx.
+sink *newshm(const char *name, int nchannels, int samplerate, capture::pcm_type format, size_t capacityframes);
+sink *newserver(const char *address, int nchannels, int samplerate, capture::pcm_type intype, const server::options &opts = server::options());
+// Writes to "inner" from a separate thread through a spool, so the caller
+// never waits for the output. Takes ownership of "inner", also on failure.
+sink *newqueued(sink *inner, int nchannels, const spool::options &opts = spool::options());
+
+// "info" describes the first frame of "buf" and is optional.
+bool write(sink *sink, const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info = nullptr);
+// Gives time based sinks a chance to flush. Call regularly.
+bool poll(sink *sink);
+// Marks the current position (a cue point for WAV). Returns false if unsupported.
+bool mark(sink *sink);
+// Continues in a new file. Returns false if unsupported.
+bool split(sink *sink);
+// Clipping and peak of every channel so far, see wave::getlevels(). Returns
+// false if the sink does not measure them.
+bool levels(sink *sink, wave::channel_levels *dest);
+// "levels", if given, receives the final levels of a sink that measures them.
+bool close(sink *sink, wave::channel_levels *levels = nullptr);
+
+}
@@ -0,0 +1,404 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "spool.hxx"
+#include "wave.hxx"
+
+namespace spool
+{
+
+typedef struct entry
+{
+	kind type;
+	capture::pcm_type intype;
+	size_t framecount;
+	bool hasInfo;
+	capture::buffer_info info;
+	bool onDisk;
+	// Into the memory ring or the spill file
+	uint64_t offset;
+	size_t size;
+} entry;
+
+static bool seek(FILE *f, uint64_t offset)
+{
+#ifdef _WIN32
+	return _fseeki64(f, (long long) offset, SEEK_SET) == 0;
+#else
+	return fseeko(f, (off_t) offset, SEEK_SET) == 0;
+#endif
+}
+
+static std::string tempname(const std::string &directory)
+{
+	static std::atomic<unsigned int> counter(0);
+	std::string dir = directory;
+
+	if (dir.empty())
+	{
+		const char *env = getenv("TEMP");
+		if (env == nullptr)
+			env = getenv("TMPDIR");
+
+		dir = env ? env : ".";
+	}
+
+	if (dir.back() != '/' && dir.back() != '\\')
+		dir += '/';
+
+#ifdef _WIN32
+	int pid = _getpid();
+#else
+	int pid = getpid();
+#endif
+
+	char name[64];
+	sprintf(name, "loopback-spool-%d-%u.tmp", pid, counter++);
+	return dir + name;
+}
+
+// Enough for the whole budget in 10 ms blocks of stereo float, so the ring
+// normally never has to grow
+static size_t initialentries(const options &opts)
+{
+	return (size_t) std::min<uint64_t>((opts.memoryBytes + opts.diskBytes) / 3840 + 256, 1 << 20);
+}
+
+struct spool
+{
+	spool(int nchannels, const options &opts);
+	~spool();
+
+	bool push(kind type, const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info);
+	bool pop(block &out, int timeoutms);
+	void finish();
+	bool drained();
+	stats getStats();
+private:
+	int channels;
+	size_t memoryLimit;
+	uint64_t diskLimit;
+
+	std::mutex lock;
+	std::condition_variable ready;
+	bool finished;
+	bool dropping;
+
+	// Ring of pending entries. Only grows when full, so once it has seen the
+	// longest backlog nothing is allocated anymore.
+	std::vector<entry> entries;
+	size_t entryHead;
+	size_t entryCount;
+
+	// Blocks leave in the order they came in, so the memory budget is a ring
+	// too, allocated once.
+	std::vector<unsigned char> memory;
+	size_t memoryHead;
+	size_t memoryUsed;
+
+	// The spill file is a ring of "diskLimit" bytes. Only the producer writes
+	// and only the consumer reads, each with its own handle.
+	std::string spillPath;
+	FILE *spillWrite;
+	FILE *spillRead;
+	uint64_t diskHead;
+	uint64_t diskUsed;
+
+	stats counters;
+
+	bool writedisk(uint64_t offset, const void *buf, size_t size);
+	bool readdisk(uint64_t offset, void *buf, size_t size);
+	void append(const entry &e);
+};
+
+spool::spool(int nchannels, const options &opts)
+: channels(nchannels)
+, memoryLimit(opts.memoryBytes)
+, diskLimit(opts.diskBytes)
+, lock()
+, ready()
+, finished(false)
+, dropping(false)
+, entries(initialentries(opts))
+, entryHead(0)
+, entryCount(0)
+, memory(memoryLimit)
+, memoryHead(0)
+, memoryUsed(0)
+, spillPath()
+, spillWrite(nullptr)
+, spillRead(nullptr)
+, diskHead(0)
+, diskUsed(0)
+, counters()
+{
+	if (diskLimit > 0)
+	{
+		spillPath = tempname(opts.directory);
+		spillWrite = fopen(spillPath.c_str(), "w+b");
+		spillRead = spillWrite ? fopen(spillPath.c_str(), "rb") : nullptr;
+
+		if (spillRead == nullptr)
+		{
+			if (spillWrite)
+			{
+				fclose(spillWrite);
+				remove(spillPath.c_str());
+			}
+
+			throw std::runtime_error("Cannot create spill file " + spillPath);
+		}
+
+		// Whole blocks go in and out and are flushed right away, so a stdio
+		// buffer would only be allocated on first use and copied through
+		setvbuf(spillWrite, nullptr, _IONBF, 0);
+		setvbuf(spillRead, nullptr, _IONBF, 0);
+	}
+}
+
+spool::~spool()
+{
+	if (spillWrite)
+	{
+		fclose(spillRead);
+		fclose(spillWrite);
+		remove(spillPath.c_str());
+	}
+}
+
+bool spool::writedisk(uint64_t offset, const void *buf, size_t size)
+{
+	size_t first = (size_t) std::min<uint64_t>(size, diskLimit - offset);
+
+	bool result = seek(spillWrite, offset) && fwrite(buf, 1, first, spillWrite) == first;
+	if (result && first < size)
+		result = seek(spillWrite, 0) && fwrite((const unsigned char *) buf + first, 1, size - first, spillWrite) == size - first;
+
+	// The reader has its own handle
+	return fflush(spillWrite) == 0 && result;
+}
+
+bool spool::readdisk(uint64_t offset, void *buf, size_t size)
+{
+	size_t first = (size_t) std::min<uint64_t>(size, diskLimit - offset);
+
+	bool result = seek(spillRead, offset) && fread(buf, 1, first, spillRead) == first;
+	if (result && first < size)
+		result = seek(spillRead, 0) && fread((unsigned char *) buf + first, 1, size - first, spillRead) == size - first;
+
+	return result;
+}
+
+void spool::append(const entry &e)
+{
+	if (entryCount == entries.size())
+	{
+		// Unroll into a ring twice the size
+		std::vector<entry> grown(entries.size() * 2);
+		for (size_t i = 0; i < entryCount; i++)
+			grown[i] = entries[(entryHead + i) % entries.size()];
+
+		entries.swap(grown);
+		entryHead = 0;
+	}
+
+	entries[(entryHead + entryCount) % entries.size()] = e;
+	entryCount++;
+	ready.notify_one();
+}
+
+bool spool::push(kind type, const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info)
+{
+	size_t size = type == kind::data ? framecount * channels * wave::pcmtype_size(intype) : 0;
+
+	entry e;
+	e.type = type;
+	e.intype = intype;
+	e.framecount = framecount;
+	e.hasInfo = info != nullptr;
+	e.info = info ? *info : capture::buffer_info();
+	e.onDisk = false;
+	e.offset = 0;
+	e.size = size;
+
+	{
+		std::unique_lock<std::mutex> lk(lock);
+
+		if (size == 0 || memoryUsed + size <= memoryLimit)
+		{
+			if (size > 0)
+			{
+				size_t first = std::min(size, memoryLimit - memoryHead);
+				memcpy(memory.data() + memoryHead, buf, first);
+				memcpy(memory.data(), (const unsigned char *) buf + first, size - first);
+
+				e.offset = memoryHead;
+				memoryHead = (memoryHead + size) % memoryLimit;
+				memoryUsed += size;
+				counters.peakMemory = std::max(counters.peakMemory, memoryUsed);
+			}
+		}
+		else if (diskUsed + size <= diskLimit)
+		{
+			// Reserve the space now, fill it outside the lock
+			e.onDisk = true;
+			e.offset = diskHead;
+			diskHead = (diskHead + size) % diskLimit;
+			diskUsed += size;
+			counters.bytesSpilled += size;
+			counters.peakDisk = std::max(counters.peakDisk, diskUsed);
+		}
+		else
+		{
+			counters.framesLost += framecount;
+			dropping = true;
+			return false;
+		}
+
+		if (type == kind::data && dropping)
+		{
+			e.info.discontinuity = true;
+			dropping = false;
+		}
+
+		if (!e.onDisk)
+		{
+			append(e);
+			return true;
+		}
+	}
+
+	bool result = writedisk(e.offset, buf, size);
+
+	std::unique_lock<std::mutex> lk(lock);
+	if (!result)
+	{
+		// Nothing after this entry was reserved yet, so give the space back
+		diskHead = e.offset;
+		diskUsed -= size;
+		counters.framesLost += framecount;
+		dropping = true;
+		return false;
+	}
+
+	append(e);
+	return true;
+}
+
+bool spool::pop(block &out, int timeoutms)
+{
+	std::unique_lock<std::mutex> lk(lock);
+
+	if (!ready.wait_for(lk, std::chrono::milliseconds(timeoutms), [this]() { return entryCount > 0 || finished; }) || entryCount == 0)
+		return false;
+
+	entry e = entries[entryHead];
+	entryHead = (entryHead + 1) % entries.size();
+	entryCount--;
+
+	out.type = e.type;
+	out.intype = e.intype;
+	out.framecount = e.framecount;
+	out.hasInfo = e.hasInfo;
+	out.info = e.info;
+	// Keeps its capacity, so this stops allocating after the largest block
+	out.data.resize(e.size);
+
+	if (!e.onDisk)
+	{
+		if (e.size > 0)
+		{
+			size_t first = std::min(e.size, memoryLimit - (size_t) e.offset);
+			memcpy(out.data.data(), memory.data() + e.offset, first);
+			memcpy(out.data.data() + first, memory.data(), e.size - first);
+			memoryUsed -= e.size;
+		}
+
+		return true;
+	}
+
+	// The producer never touches reserved space, so read without the lock
+	lk.unlock();
+	bool result = readdisk(e.offset, out.data.data(), e.size);
+
+	lk.lock();
+	diskUsed -= e.size;
+
+	if (!result)
+	{
+		counters.framesLost += out.framecount;
+		out.framecount = 0;
+		out.data.clear();
+	}
+
+	return true;
+}
+
+void spool::finish()
+{
+	std::unique_lock<std::mutex> lk(lock);
+	finished = true;
+	ready.notify_all();
+}
+
+bool spool::drained()
+{
+	std::unique_lock<std::mutex> lk(lock);
+	return finished && entryCount == 0;
+}
+
+stats spool::getStats()
+{
+	std::unique_lock<std::mutex> lk(lock);
+	return counters;
+}
+
+spool *newspool(int nchannels, const options &opts)
+{
+	return new spool(nchannels, opts);
+}
+
+bool push(spool *spool, kind type, const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info)
+{
+	return spool->push(type, buf, framecount, intype, info);
+}
+
+bool pop(spool *spool, block &out, int timeoutms)
+{
+	return spool->pop(out, timeoutms);
+}
+
+void finish(spool *spool)
+{
+	spool->finish();
+}
+
+bool drained(spool *spool)
+{
+	return spool->drained();
+}
+
+stats getstats(spool *spool)
+{
+	return spool->getStats();
+}
+
+void close(spool *spool)
+{
+	delete spool;
+}
+
+}
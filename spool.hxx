@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "capture.hxx"
+
+namespace spool
+{
+
+// FIFO between the capture loop (one producer) and a slower consumer. Blocks
+// stay in memory up to a budget, the rest goes to a temporary file that is
+// used as a ring of "diskBytes". Only when both are full is audio dropped.
+typedef struct spool spool;
+
+typedef struct options
+{
+	size_t memoryBytes = 8 << 20;
+	// 0 disables spilling to disk
+	uint64_t diskBytes = 0;
+	// Where the spill file goes. Empty uses TEMP/TMPDIR.
+	std::string directory;
+} options;
+
+typedef enum class kind
+{
+	data,
+	mark,
+	split,
+	max_enum
+} kind;
+
+typedef struct block
+{
+	kind type;
+	capture::pcm_type intype;
+	size_t framecount;
+	bool hasInfo;
+	capture::buffer_info info;
+	// Storage is recycled between pop() calls
+	std::vector<unsigned char> data;
+} block;
+
+typedef struct stats
+{
+	uint64_t framesLost;
+	uint64_t bytesSpilled;
+	size_t peakMemory;
+	uint64_t peakDisk;
+} stats;
+
+spool *newspool(int nchannels, const options &opts = options());
+// Returns false if the block was dropped. The next block is then flagged as
+// a discontinuity.
+bool push(spool *spool, kind type, const void *buf = nullptr, size_t framecount = 0, capture::pcm_type intype = capture::pcm_type::unknown, const capture::buffer_info *info = nullptr);
+// Waits up to "timeoutms" for the oldest block.
+bool pop(spool *spool, block &out, int timeoutms);
+// No more push() calls will follow.
+void finish(spool *spool);
+// finish() was called and everything was popped.
+bool drained(spool *spool);
+stats getstats(spool *spool);
+void close(spool *spool);
+
+}
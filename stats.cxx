@@ -0,0 +1,338 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "stats.hxx"
+
+namespace stats
+{
+
+// Log-linear buckets with 5 significant bits (about 3% resolution) over the
+// whole uint64_t range, like HdrHistogram. Values below 64 are exact.
+static constexpr int SUB_BITS = 5;
+static constexpr uint64_t SUB_COUNT = 1 << SUB_BITS;
+static constexpr size_t BUCKETS = 2 * SUB_COUNT + (63 - SUB_BITS) * SUB_COUNT;
+
+static int msb(uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return 63 - __builtin_clzll(v);
+#else
+	int r = 0;
+	while (v >>= 1)
+		r++;
+
+	return r;
+#endif
+}
+
+static size_t bucketindex(uint64_t v)
+{
+	if (v < 2 * SUB_COUNT)
+		return (size_t) v;
+
+	int e = msb(v);
+	uint64_t m = v >> (e - SUB_BITS);
+	return (size_t) (2 * SUB_COUNT + (e - SUB_BITS - 1) * SUB_COUNT + (m - SUB_COUNT));
+}
+
+// Largest value that lands in the bucket
+static uint64_t bucketvalue(size_t i)
+{
+	if (i < 2 * SUB_COUNT)
+		return i;
+
+	int e = (int) ((i - 2 * SUB_COUNT) / SUB_COUNT) + SUB_BITS + 1;
+	uint64_t m = (i - 2 * SUB_COUNT) % SUB_COUNT + SUB_COUNT;
+	return ((m + 1) << (e - SUB_BITS)) - 1;
+}
+
+typedef struct histogram
+{
+	std::atomic<uint64_t> counts[BUCKETS];
+	std::atomic<uint64_t> total;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> min;
+	std::atomic<uint64_t> max;
+} histogram;
+
+typedef struct summary
+{
+	uint64_t count;
+	double mean;
+	uint64_t min;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+} summary;
+
+static const char *metricnames[] = {"interarrival", "loop", "write"};
+static const char *metrictitles[] = {"Packet interval", "Loop time", "Write time"};
+static const char *counternames[] = {"bytes", "frames", "packets", "silent_packets", "empty_polls", "overruns"};
+
+static_assert(sizeof(metricnames) / sizeof(metricnames[0]) == (size_t) metric::max_enum, "metric names");
+static_assert(sizeof(counternames) / sizeof(counternames[0]) == (size_t) counter::max_enum, "counter names");
+
+struct collector
+{
+	collector(const char *jsonpath, int nchannels);
+	~collector();
+
+	void record(metric m, uint64_t value);
+	void add(counter c, uint64_t n);
+	void setlevels(size_t channel, uint64_t clipped, float peak);
+	bool report(FILE *dest);
+private:
+	histogram histograms[(size_t) metric::max_enum];
+	std::atomic<uint64_t> counters[(size_t) counter::max_enum];
+	std::vector<std::atomic<uint64_t>> clipped;
+	std::vector<std::atomic<float>> peaks;
+	std::chrono::steady_clock::time_point start;
+	FILE *jsonFile;
+
+	summary summarize(const histogram &h) const;
+};
+
+collector::collector(const char *jsonpath, int nchannels)
+: clipped(std::max(nchannels, 0))
+, peaks(std::max(nchannels, 0))
+, start(std::chrono::steady_clock::now())
+, jsonFile(nullptr)
+{
+	for (histogram &h: histograms)
+	{
+		for (std::atomic<uint64_t> &c: h.counts)
+			c.store(0);
+
+		h.total.store(0);
+		h.sum.store(0);
+		h.min.store(UINT64_MAX);
+		h.max.store(0);
+	}
+
+	for (std::atomic<uint64_t> &c: counters)
+		c.store(0);
+
+	for (std::atomic<uint64_t> &c: clipped)
+		c.store(0);
+
+	for (std::atomic<float> &p: peaks)
+		p.store(0.0f);
+
+	if (jsonpath)
+	{
+		jsonFile = fopen(jsonpath, "a");
+		if (jsonFile == nullptr)
+			throw std::runtime_error(std::string("Cannot open ") + jsonpath);
+	}
+}
+
+collector::~collector()
+{
+	if (jsonFile)
+		fclose(jsonFile);
+}
+
+void collector::record(metric m, uint64_t value)
+{
+	histogram &h = histograms[(size_t) m];
+	h.counts[bucketindex(value)].fetch_add(1, std::memory_order_relaxed);
+	h.total.fetch_add(1, std::memory_order_relaxed);
+	h.sum.fetch_add(value, std::memory_order_relaxed);
+
+	uint64_t old = h.min.load(std::memory_order_relaxed);
+	while (value < old && !h.min.compare_exchange_weak(old, value, std::memory_order_relaxed));
+
+	old = h.max.load(std::memory_order_relaxed);
+	while (value > old && !h.max.compare_exchange_weak(old, value, std::memory_order_relaxed));
+}
+
+void collector::add(counter c, uint64_t n)
+{
+	counters[(size_t) c].fetch_add(n, std::memory_order_relaxed);
+}
+
+void collector::setlevels(size_t channel, uint64_t count, float peak)
+{
+	if (channel >= clipped.size())
+		return;
+
+	clipped[channel].store(count, std::memory_order_relaxed);
+	peaks[channel].store(peak, std::memory_order_relaxed);
+}
+
+summary collector::summarize(const histogram &h) const
+{
+	summary s = {};
+	uint64_t counts[BUCKETS];
+
+	for (size_t i = 0; i < BUCKETS; i++)
+	{
+		counts[i] = h.counts[i].load(std::memory_order_relaxed);
+		s.count += counts[i];
+	}
+
+	if (s.count == 0)
+		return s;
+
+	s.mean = (double) h.sum.load(std::memory_order_relaxed) / s.count;
+	s.min = h.min.load(std::memory_order_relaxed);
+	s.max = h.max.load(std::memory_order_relaxed);
+
+	const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+	uint64_t *targets[] = {&s.p50, &s.p90, &s.p99, &s.p999};
+	uint64_t seen = 0;
+	size_t q = 0;
+
+	for (size_t i = 0; i < BUCKETS && q < 4; i++)
+	{
+		seen += counts[i];
+		while (q < 4 && seen >= (uint64_t) (quantiles[q] * s.count + 0.5))
+			*targets[q++] = std::min(bucketvalue(i), s.max);
+	}
+
+	return s;
+}
+
+bool collector::report(FILE *dest)
+{
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	uint64_t values[(size_t) counter::max_enum];
+	summary summaries[(size_t) metric::max_enum];
+
+	for (size_t i = 0; i < (size_t) counter::max_enum; i++)
+		values[i] = counters[i].load(std::memory_order_relaxed);
+
+	for (size_t i = 0; i < (size_t) metric::max_enum; i++)
+		summaries[i] = summarize(histograms[i]);
+
+	fprintf(
+		dest,
+		"STATISTICS (%.1f s)\nFrames: %llu, bytes: %llu, packets: %llu (%llu silent), empty polls: %llu, overruns: %llu\n",
+		elapsed,
+		(unsigned long long) values[(size_t) counter::frames],
+		(unsigned long long) values[(size_t) counter::bytes],
+		(unsigned long long) values[(size_t) counter::packets],
+		(unsigned long long) values[(size_t) counter::silentPackets],
+		(unsigned long long) values[(size_t) counter::emptyPolls],
+		(unsigned long long) values[(size_t) counter::overruns]
+	);
+
+	for (size_t i = 0; i < (size_t) metric::max_enum; i++)
+	{
+		const summary &s = summaries[i];
+		fprintf(
+			dest,
+			"%s (us): n=%llu mean=%.1f min=%.1f p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+			metrictitles[i],
+			(unsigned long long) s.count,
+			s.mean / 1000.0,
+			s.min / 1000.0,
+			s.p50 / 1000.0,
+			s.p90 / 1000.0,
+			s.p99 / 1000.0,
+			s.p999 / 1000.0,
+			s.max / 1000.0
+		);
+	}
+
+	if (!clipped.empty())
+	{
+		fprintf(dest, "Peak (dBFS):");
+		for (const std::atomic<float> &p: peaks)
+			fprintf(dest, " %.1f", 20.0 * std::log10((double) p.load(std::memory_order_relaxed)));
+
+		fprintf(dest, "\nClipped samples:");
+		for (const std::atomic<uint64_t> &c: clipped)
+			fprintf(dest, " %llu", (unsigned long long) c.load(std::memory_order_relaxed));
+
+		fprintf(dest, "\n");
+	}
+
+	if (jsonFile == nullptr)
+		return true;
+
+	fprintf(jsonFile, "{\"time\":%.3f", elapsed);
+	for (size_t i = 0; i < (size_t) counter::max_enum; i++)
+		fprintf(jsonFile, ",\"%s\":%llu", counternames[i], (unsigned long long) values[i]);
+
+	for (size_t i = 0; i < (size_t) metric::max_enum; i++)
+	{
+		const summary &s = summaries[i];
+		fprintf(
+			jsonFile,
+			",\"%s_ns\":{\"count\":%llu,\"mean\":%.1f,\"min\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+			metricnames[i],
+			(unsigned long long) s.count,
+			s.mean,
+			(unsigned long long) s.min,
+			(unsigned long long) s.p50,
+			(unsigned long long) s.p90,
+			(unsigned long long) s.p99,
+			(unsigned long long) s.p999,
+			(unsigned long long) s.max
+		);
+	}
+
+	if (!clipped.empty())
+	{
+		const char *sep = "";
+		fprintf(jsonFile, ",\"peak\":[");
+		for (const std::atomic<float> &p: peaks)
+		{
+			fprintf(jsonFile, "%s%.6g", sep, p.load(std::memory_order_relaxed));
+			sep = ",";
+		}
+
+		sep = "";
+		fprintf(jsonFile, "],\"clipped\":[");
+		for (const std::atomic<uint64_t> &c: clipped)
+		{
+			fprintf(jsonFile, "%s%llu", sep, (unsigned long long) c.load(std::memory_order_relaxed));
+			sep = ",";
+		}
+
+		fprintf(jsonFile, "]");
+	}
+
+	fprintf(jsonFile, "}\n");
+	return fflush(jsonFile) == 0;
+}
+
+collector *newcollector(const char *jsonpath, int nchannels)
+{
+	return new collector(jsonpath, nchannels);
+}
+
+void record(collector *col, metric m, uint64_t nanoseconds)
+{
+	col->record(m, nanoseconds);
+}
+
+void add(collector *col, counter c, uint64_t n)
+{
+	col->add(c, n);
+}
+
+void setlevels(collector *col, size_t channel, uint64_t clipped, float peak)
+{
+	col->setlevels(channel, clipped, peak);
+}
+
+bool report(collector *col, FILE *dest)
+{
+	return col->report(dest);
+}
+
+void close(collector *col)
+{
+	delete col;
+}
+
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+namespace stats
+{
+
+// Capture health counters and latency histograms. record() and add() are
+// lock-free and may be called from any thread.
+typedef struct collector collector;
+
+typedef enum class metric
+{
+	// Time between buffers that carried audio
+	interarrival,
+	// One iteration of the capture loop
+	loop,
+	// One sink::write call
+	write,
+	max_enum
+} metric;
+
+typedef enum class counter
+{
+	bytes,
+	frames,
+	packets,
+	silentPackets,
+	emptyPolls,
+	overruns,
+	max_enum
+} counter;
+
+// Every report() also appends one JSON line to "jsonpath" if given. Reports
+// include the levels of "nchannels" channels, if not 0.
+collector *newcollector(const char *jsonpath = nullptr, int nchannels = 0);
+void record(collector *col, metric m, uint64_t nanoseconds);
+void add(collector *col, counter c, uint64_t n = 1);
+// Clipped samples and peak magnitude of a channel so far, replacing the
+// previous values. 1.0 is full scale.
+void setlevels(collector *col, size_t channel, uint64_t clipped, float peak);
+// Prints totals since the collector was made.
+bool report(collector *col, FILE *dest);
+void close(collector *col);
+
+}
@@ -0,0 +1,516 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "planar.hxx"
+#include "stream.hxx"
+#include "trace.hxx"
+#include "wave.hxx"
+
+namespace stream
+{
+
+static_assert(sizeof(frame_header) == FRAME_HEADER_SIZE, "frame_header must not be padded");
+
+// Input frames the resampler takes at a time
+static constexpr size_t RESAMPLE_BLOCK_FRAMES = 4096;
+// The resampling filter: a sinc with this many zero crossings on either
+// side, under a Kaiser window, tabulated at this many fractional phases.
+// The cutoff is this fraction of the lower Nyquist frequency, which leaves
+// room for the transition band, so that nothing above it aliases.
+static constexpr double RESAMPLE_ZEROS = 24.0;
+static constexpr double RESAMPLE_BETA = 8.0;
+static constexpr double RESAMPLE_PASSBAND = 0.9;
+static constexpr size_t RESAMPLE_PHASES = 256;
+// Writes whose arrival times are kept apart. More are merged into the
+// newest, which only makes them go out sooner.
+static constexpr size_t ARRIVAL_SLOTS = 64;
+
+struct writer
+{
+	writer(output_fn fn, void *ud, int nchannels, int samplerate, capture::pcm_type intype, const options &opts);
+
+	bool write(const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info);
+	bool poll();
+	bool writeend();
+private:
+	typedef std::chrono::steady_clock clock;
+
+	output_fn output;
+	void *userdata;
+	size_t channels;
+	int inRate;
+	int outRate;
+	capture::pcm_type outType;
+	size_t frameSize;
+	size_t chunkBytes;
+	clock::duration latency;
+
+	std::vector<unsigned char> pending;
+	// Arrival time of the oldest byte still pending
+	clock::time_point oldest;
+
+	// When the pending bytes came in, oldest first. Every entry covers the
+	// bytes up to "end", counted over the life of the stream.
+	typedef struct arrival
+	{
+		uint64_t end;
+		clock::time_point time;
+	} arrival;
+
+	std::vector<arrival> arrivals;
+	size_t firstArrival;
+	size_t arrivalCount;
+	uint64_t sentBytes;
+
+	// Framing
+	bool framed;
+	bool started;
+	uint32_t sequence;
+	uint64_t nextInput;
+	uint64_t pendingPosition;
+	uint64_t pendingTimestamp;
+	uint16_t pendingFlags;
+
+	// Resampling state, one float plane per channel. "input" starts with
+	// the last "taps" frames of the previous block, new frames go behind
+	// them at "inputTail".
+	planar::block input;
+	planar::block resampled;
+	std::vector<void *> inputTail;
+	// RESAMPLE_PHASES + 1 rows of "taps" coefficients
+	std::vector<float> kernel;
+	size_t taps;
+	// Counted from the first input frame. Output frame k falls on input
+	// frame k * inRate / outRate, exactly.
+	uint64_t inputStart;
+	uint64_t outputFrames;
+	double step;
+
+	void makekernel();
+	double resample();
+	bool queueresampled(size_t framecount, uint64_t position, uint64_t timestamp, bool discontinuity, bool silent);
+	unsigned char *extend(size_t framecount, uint64_t position, uint64_t timestamp, bool discontinuity, bool silent);
+	void arrived();
+	bool sendfull();
+	bool send(size_t bytes);
+	void makeheader(unsigned char *header, size_t framecount);
+};
+
+writer::writer(output_fn fn, void *ud, int nchannels, int samplerate, capture::pcm_type intype, const options &opts)
+: output(fn)
+, userdata(ud)
+, channels(nchannels)
+, inRate(samplerate)
+, outRate(opts.sampleRate > 0 ? opts.sampleRate : samplerate)
+, outType(opts.format != capture::pcm_type::unknown ? opts.format : intype)
+, frameSize(0)
+, chunkBytes(opts.chunkBytes)
+, latency(std::chrono::milliseconds(opts.latencyMs))
+, pending()
+, oldest()
+, arrivals(ARRIVAL_SLOTS)
+, firstArrival(0)
+, arrivalCount(0)
+, sentBytes(0)
+, framed(opts.framed)
+, started(false)
+, sequence(0)
+, nextInput(0)
+, pendingPosition(0)
+, pendingTimestamp(0)
+, pendingFlags(0)
+, input()
+, resampled()
+, inputTail()
+, kernel()
+, taps(0)
+, inputStart(0)
+, outputFrames(0)
+, step((double) samplerate / outRate)
+{
+	if (outType == capture::pcm_type::unknown)
+		throw std::runtime_error("Unknown output format");
+
+	frameSize = wave::pcmtype_size(outType) * channels;
+
+	if (chunkBytes == 0)
+		chunkBytes = (size_t) std::max(outRate * opts.latencyMs / 1000, 1) * frameSize;
+
+	// Whole frames only
+	chunkBytes = std::max(chunkBytes / frameSize, (size_t) 1) * frameSize;
+	pending.reserve(chunkBytes * 2);
+
+	if (outRate != inRate)
+	{
+		makekernel();
+
+		// Flushing at the end adds half the filter in one go
+		size_t most = std::max(RESAMPLE_BLOCK_FRAMES, taps / 2);
+		planar::reset(input, nchannels, taps + most);
+		planar::reset(resampled, nchannels, (size_t) std::ceil(most / step) + 2);
+
+		for (int c = 0; c < nchannels; c++)
+			inputTail.push_back(input.planes[c] + taps);
+
+		// Silence before the first frame
+		input.frames = taps;
+	}
+}
+
+// Zeroth order modified Bessel function of the first kind, for the window
+static double bessel0(double x)
+{
+	double sum = 1.0;
+	double term = 1.0;
+
+	for (int k = 1; k < 32; k++)
+	{
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+	}
+
+	return sum;
+}
+
+void writer::makekernel()
+{
+	const double pi = 3.14159265358979323846;
+
+	// In cycles per input frame
+	double cutoff = 0.5 * std::min(1.0, 1.0 / step) * RESAMPLE_PASSBAND;
+	double halfwidth = RESAMPLE_ZEROS / (2.0 * cutoff);
+
+	taps = 2 * (size_t) std::ceil(halfwidth);
+	kernel.resize((RESAMPLE_PHASES + 1) * taps);
+
+	// Row "p" weighs the frames around an output frame that falls p /
+	// RESAMPLE_PHASES past an input frame. Every row sums to 1.
+	for (size_t p = 0; p <= RESAMPLE_PHASES; p++)
+	{
+		float *row = &kernel[p * taps];
+		double sum = 0.0;
+
+		for (size_t k = 0; k < taps; k++)
+		{
+			double t = (double) k - (double) (taps / 2 - 1) - (double) p / RESAMPLE_PHASES;
+			double x = 2.0 * cutoff * t;
+			double r = t / halfwidth;
+			double v = 0.0;
+
+			if (std::fabs(r) < 1.0)
+				v = (x == 0.0 ? 1.0 : std::sin(pi * x) / (pi * x)) * bessel0(RESAMPLE_BETA * std::sqrt(1.0 - r * r));
+
+			row[k] = (float) v;
+			sum += v;
+		}
+
+		for (size_t k = 0; k < taps; k++)
+			row[k] = (float) (row[k] / sum);
+	}
+}
+
+double writer::resample()
+{
+	// One channel at a time. Input frame "inputStart" sits at "taps" in
+	// "input", and every output frame needs taps / 2 frames on either side.
+	uint64_t end = inputStart + input.frames - taps;
+	size_t count = 0;
+
+	for (size_t c = 0; c < channels; c++)
+	{
+		float *x = input.planes[c];
+		float *y = resampled.planes[c];
+		count = 0;
+
+		for (uint64_t k = outputFrames;; k++)
+		{
+			uint64_t at = k * inRate;
+			uint64_t i = at / outRate;
+			if (i + taps / 2 >= end)
+				break;
+
+			uint64_t phase = at % outRate * RESAMPLE_PHASES;
+			const float *a = &kernel[phase / outRate * taps];
+			const float *b = a + taps;
+			const float *s = x + (size_t) (i - inputStart) + taps / 2 + 1;
+			float frac = (float) (phase % outRate) / outRate;
+			float sa = 0.0f;
+			float sb = 0.0f;
+
+			for (size_t j = 0; j < taps; j++)
+			{
+				sa += s[j] * a[j];
+				sb += s[j] * b[j];
+			}
+
+			y[count++] = sa + (sb - sa) * frac;
+		}
+
+		// The last frames are the history of the next block
+		memmove(x, x + input.frames - taps, taps * sizeof(float));
+	}
+
+	// Where the first output frame falls, from the first new input frame
+	double lead = (double) (outputFrames * inRate) / outRate - (double) inputStart;
+
+	outputFrames += count;
+	inputStart = end;
+	input.frames = taps;
+	resampled.frames = count;
+	return lead;
+}
+
+bool writer::write(const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info)
+{
+	uint64_t position = nextInput;
+	uint64_t timestamp = 0;
+	bool discontinuity = false;
+	bool silent = false;
+
+	if (info)
+	{
+		position = info->position;
+		timestamp = info->timestamp;
+		discontinuity = info->discontinuity || (started && position != nextInput);
+		silent = info->packets > 0 && info->silentPackets == info->packets;
+	}
+
+	nextInput = position + framecount;
+	started = true;
+
+	// A chunk covers one continuous stretch of audio
+	if (framed && discontinuity && !pending.empty() && !send(pending.size()))
+		return false;
+
+	if (outRate == inRate)
+	{
+		if (framecount > 0)
+		{
+			unsigned char *dest = extend(framecount, position, timestamp, discontinuity, silent);
+			if (!wave::convert(dest, outType, buf, intype, framecount * channels))
+			{
+				pending.resize(dest - pending.data());
+				return false;
+			}
+
+			arrived();
+		}
+
+		return sendfull() && poll();
+	}
+
+	const unsigned char *data = (const unsigned char *) buf;
+	size_t inSize = wave::pcmtype_size(intype) * channels;
+
+	for (size_t done = 0; done < framecount;)
+	{
+		size_t count = std::min(framecount - done, RESAMPLE_BLOCK_FRAMES);
+		if (!wave::deinterleave(inputTail.data(), capture::pcm_type::pcm_f32, data + done * inSize, intype, count, channels))
+			return false;
+
+		uint64_t start = timestamp > 0 ? timestamp + done * 10000000ULL / inRate : 0;
+		if (!queueresampled(count, position + done, start, discontinuity && done == 0, silent))
+			return false;
+
+		done += count;
+	}
+
+	return poll();
+}
+
+bool writer::queueresampled(size_t framecount, uint64_t position, uint64_t timestamp, bool discontinuity, bool silent)
+{
+	input.frames = taps + framecount;
+
+	// The output trails the input by half the filter
+	double lead = resample();
+	if (resampled.frames == 0)
+		return true;
+
+	if (timestamp > 0)
+		timestamp = (uint64_t) std::max((double) timestamp + lead * 10000000.0 / inRate, 0.0);
+
+	uint64_t first = (uint64_t) (std::max((double) position + lead, 0.0) / step + 0.5);
+	unsigned char *dest = extend(resampled.frames, first, timestamp, discontinuity, silent);
+	if (!planar::store(dest, outType, resampled))
+	{
+		pending.resize(dest - pending.data());
+		return false;
+	}
+
+	arrived();
+	return sendfull();
+}
+
+unsigned char *writer::extend(size_t framecount, uint64_t position, uint64_t timestamp, bool discontinuity, bool silent)
+{
+	if (pending.empty())
+	{
+		pendingPosition = position;
+		pendingTimestamp = timestamp;
+		pendingFlags = FRAME_SILENT;
+	}
+
+	if (discontinuity)
+		pendingFlags |= FRAME_DISCONTINUITY;
+	if (!silent)
+		pendingFlags &= ~FRAME_SILENT;
+
+	size_t used = pending.size();
+	pending.resize(used + framecount * frameSize);
+	return pending.data() + used;
+}
+
+void writer::arrived()
+{
+	uint64_t end = sentBytes + pending.size();
+
+	if (arrivalCount < ARRIVAL_SLOTS)
+	{
+		arrivals[(firstArrival + arrivalCount++) % ARRIVAL_SLOTS] = {end, clock::now()};
+		oldest = arrivals[firstArrival].time;
+	}
+	else
+		arrivals[(firstArrival + arrivalCount - 1) % ARRIVAL_SLOTS].end = end;
+}
+
+bool writer::sendfull()
+{
+	// Send full chunks, keep the remainder
+	size_t full = pending.size() / chunkBytes * chunkBytes;
+	return full == 0 || send(full);
+}
+
+bool writer::poll()
+{
+	if (!pending.empty() && clock::now() - oldest >= latency)
+		return send(pending.size());
+
+	return true;
+}
+
+bool writer::send(size_t bytes)
+{
+	TRACE_SCOPE("stream_send");
+
+	bool result = true;
+
+	// One frame per chunk, only the last one may be short
+	for (size_t done = 0; result && done < bytes;)
+	{
+		size_t size = std::min(bytes - done, chunkBytes);
+		size_t framecount = size / frameSize;
+		unsigned char header[FRAME_HEADER_SIZE];
+
+		if (framed)
+			makeheader(header, framecount);
+
+		result = output(userdata, framed ? header : nullptr, framed ? sizeof(header) : 0, pending.data() + done, size);
+		done += size;
+
+		// The rest continues right after this chunk
+		pendingPosition += framecount;
+		if (pendingTimestamp > 0)
+			pendingTimestamp += framecount * 10000000ULL / outRate;
+		pendingFlags &= ~FRAME_DISCONTINUITY;
+	}
+
+	pending.erase(pending.begin(), pending.begin() + bytes);
+	sentBytes += bytes;
+
+	// What is left is as old as the write it came with
+	while (arrivalCount > 0 && arrivals[firstArrival].end <= sentBytes)
+	{
+		firstArrival = (firstArrival + 1) % ARRIVAL_SLOTS;
+		arrivalCount--;
+	}
+
+	if (arrivalCount > 0)
+		oldest = arrivals[firstArrival].time;
+
+	return result;
+}
+
+template<typename T>
+static unsigned char *putint(unsigned char *dest, T v)
+{
+	for (size_t i = 0; i < sizeof(T); i++)
+		*dest++ = (unsigned char) ((uint64_t) v >> (i * 8));
+
+	return dest;
+}
+
+void writer::makeheader(unsigned char *header, size_t framecount)
+{
+	unsigned char *p = header;
+
+	p = putint<uint32_t>(p, FRAME_MAGIC);
+	p = putint<uint16_t>(p, FRAME_HEADER_SIZE);
+	p = putint<uint16_t>(p, pendingFlags);
+	p = putint<uint32_t>(p, sequence++);
+	p = putint<uint32_t>(p, (uint32_t) framecount);
+	p = putint<uint64_t>(p, pendingPosition);
+	p = putint<uint64_t>(p, pendingTimestamp);
+	p = putint<uint32_t>(p, outRate);
+	p = putint<uint16_t>(p, (uint16_t) channels);
+	p = putint<uint8_t>(p, (uint8_t) outType);
+	p = putint<uint8_t>(p, 0);
+}
+
+bool writer::writeend()
+{
+	bool result = true;
+
+	// The last half filter of input is still held back, silence after it
+	// lets it out
+	if (outRate != inRate && started)
+	{
+		for (void *tail: inputTail)
+			std::fill((float *) tail, (float *) tail + taps / 2, 0.0f);
+
+		result = queueresampled(taps / 2, nextInput, 0, false, false);
+	}
+
+	return (pending.empty() || send(pending.size())) && result;
+}
+
+static bool writefile(void *userdata, const void *header, size_t headersize, const void *data, size_t size)
+{
+	FILE *dest = (FILE *) userdata;
+	bool result = (header == nullptr || fwrite(header, 1, headersize, dest) == headersize) && fwrite(data, 1, size, dest) == size;
+	fflush(dest);
+	return result;
+}
+
+writer *newwriter(output_fn output, void *userdata, int nchannels, int samplerate, capture::pcm_type intype, const options &opts)
+{
+	return new writer(output, userdata, nchannels, samplerate, intype, opts);
+}
+
+writer *newwriter(FILE *dest, int nchannels, int samplerate, capture::pcm_type intype, const options &opts)
+{
+	return new writer(writefile, dest, nchannels, samplerate, intype, opts);
+}
+
+bool write(writer *writer, const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info)
+{
+	return writer->write(buf, framecount, intype, info);
+}
+
+bool poll(writer *writer)
+{
+	return writer->poll();
+}
+
+bool close(writer *writer)
+{
+	bool result = writer->writeend();
+	delete writer;
+	return result;
+}
+
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdio>
+
+#include "capture.hxx"
+
+namespace stream
+{
+
+// Raw PCM output to a pipe, sent in chunks instead of one write per packet
+typedef struct writer writer;
+
+typedef struct options
+{
+	// Output sample format. unknown keeps the input format.
+	capture::pcm_type format = capture::pcm_type::unknown;
+	// Output sample rate. 0 keeps the input rate. The resampler is a windowed
+	// sinc low pass just below the lower of the two Nyquist frequencies, so
+	// downsampling does not alias. It holds back about 27 frames at the lower
+	// rate.
+	int sampleRate = 0;
+	// Longest time audio may wait in the buffer.
+	int latencyMs = 20;
+	// Chunk size. 0 derives it from the latency.
+	size_t chunkBytes = 0;
+	// Put a frame_header before every chunk.
+	bool framed = false;
+} options;
+
+// Framed output. All fields are little endian.
+enum
+{
+	FRAME_MAGIC = 0x464C5753, // "SWLF"
+	FRAME_HEADER_SIZE = 40,
+
+	// Audio was lost right before this chunk
+	FRAME_DISCONTINUITY = 1,
+	// Every packet in this chunk was flagged silent by the device
+	FRAME_SILENT = 2
+};
+
+typedef struct frame_header
+{
+	uint32_t magic;
+	uint16_t headerSize;
+	uint16_t flags;
+	uint32_t sequence;
+	uint32_t frames;
+	// Device position of the first frame, in output frames
+	uint64_t position;
+	// Performance counter time of the first frame, in 100ns units. 0 if unknown.
+	uint64_t timestamp;
+	uint32_t sampleRate;
+	uint16_t channels;
+	// capture::pcm_type of the payload
+	uint8_t format;
+	uint8_t reserved;
+} frame_header;
+
+// Receives every finished chunk. "header" is null unless framed.
+typedef bool (*output_fn)(void *userdata, const void *header, size_t headersize, const void *data, size_t size);
+
+writer *newwriter(output_fn output, void *userdata, int nchannels, int samplerate, capture::pcm_type intype, const options &opts = options());
+writer *newwriter(FILE *dest, int nchannels, int samplerate, capture::pcm_type intype, const options &opts = options());
+// "info" is optional and only used for framed output.
+bool write(writer *writer, const void *buf, size_t framecount, capture::pcm_type intype, const capture::buffer_info *info = nullptr);
+// Sends buffered audio once it is older than the latency budget.
+bool poll(writer *writer);
+bool close(writer *writer);
+
+}
@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "synth.hxx"
+#include "wave.hxx"
+
+namespace synth
+{
+
+static constexpr double PI = 3.14159265358979323846;
+
+struct source
+{
+	source(int nchannels, int samplerate, capture::pcm_type format, double seconds, int blockms);
+
+	size_t getBuffer(unsigned char *dest, size_t capacity, capture::buffer_info &info);
+	size_t getBlockBytes() const noexcept;
+	bool finished() const noexcept;
+private:
+	int sampleRate;
+	size_t frameSize;
+	uint64_t totalFrames;
+	uint64_t position;
+	size_t blockFrames;
+
+	// 100ms of audio, repeated. Every tone is a multiple of 10Hz so the
+	// loop point is seamless.
+	std::vector<unsigned char> table;
+	size_t tableFrames;
+	size_t tableOffset;
+};
+
+source::source(int nchannels, int samplerate, capture::pcm_type format, double seconds, int blockms)
+: sampleRate(samplerate)
+, frameSize(wave::pcmtype_size(format) * nchannels)
+, totalFrames((uint64_t) (seconds * samplerate))
+, position(0)
+, blockFrames((size_t) std::max(samplerate * blockms / 1000, 1))
+, table()
+, tableFrames((size_t) std::max(samplerate / 10, 1))
+, tableOffset(0)
+{
+	if (nchannels <= 0 || samplerate <= 0 || format == capture::pcm_type::unknown)
+		throw std::runtime_error("Invalid synthetic format");
+
+	std::vector<float> tone(tableFrames * nchannels);
+	for (size_t i = 0; i < tableFrames; i++)
+	{
+		for (int c = 0; c < nchannels; c++)
+		{
+			double freq = 220.0 + 110.0 * c;
+			tone[i * nchannels + c] = (float) (0.5 * std::sin(2.0 * PI * freq * i / samplerate));
+		}
+	}
+
+	table.resize(tableFrames * frameSize);
+	wave::convert(table.data(), format, tone.data(), capture::pcm_type::pcm_f32, tone.size());
+}
+
+size_t source::getBuffer(unsigned char *dest, size_t capacity, capture::buffer_info &info)
+{
+	size_t framecount = (size_t) std::min<uint64_t>(std::min(blockFrames, capacity / frameSize), totalFrames - position);
+
+	info = {position, position * 10000000ULL / sampleRate, framecount > 0 ? 1u : 0u, 0, false};
+
+	for (size_t done = 0; done < framecount;)
+	{
+		size_t n = std::min(framecount - done, tableFrames - tableOffset);
+		std::copy(table.begin() + tableOffset * frameSize, table.begin() + (tableOffset + n) * frameSize, dest + done * frameSize);
+		done += n;
+		tableOffset = (tableOffset + n) % tableFrames;
+	}
+
+	position += framecount;
+	return framecount * frameSize;
+}
+
+size_t source::getBlockBytes() const noexcept
+{
+	return blockFrames * frameSize;
+}
+
+bool source::finished() const noexcept
+{
+	return position >= totalFrames;
+}
+
+source *newsource(int nchannels, int samplerate, capture::pcm_type format, double seconds, int blockms)
+{
+	return new source(nchannels, samplerate, format, seconds, blockms);
+}
+
+std::vector<unsigned char> getbuf(source *src, capture::buffer_info &info)
+{
+	std::vector<unsigned char> result(src->getBlockBytes());
+	result.resize(src->getBuffer(result.data(), result.size(), info));
+	return result;
+}
+
+size_t getbuf(source *src, void *dest, size_t capacity, capture::buffer_info &info)
+{
+	return src->getBuffer((unsigned char *) dest, capacity, info);
+}
+
+bool finished(source *src)
+{
+	return src->finished();
+}
+
+void close(source *src)
+{
+	delete src;
+}
+
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "capture.hxx"
+
+namespace synth
+{
+
+// Stands in for a capture device. Produces a tone per channel without
+// waiting, so the output pipeline can be run faster than real time.
+typedef struct source source;
+
+source *newsource(int nchannels, int samplerate, capture::pcm_type format, double seconds, int blockms = 10);
+// Same contract as capture::getbuf. Empty once "seconds" were produced.
+std::vector<unsigned char> getbuf(source *src, capture::buffer_info &info);
+size_t getbuf(source *src, void *dest, size_t capacity, capture::buffer_info &info);
+bool finished(source *src);
+void close(source *src);
+
+}
@@ -0,0 +1,122 @@
+#include "trace.hxx"
+
+#ifdef LOOPBACK_TRACE
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace trace
+{
+
+// Per thread, the newest events win once full
+static constexpr uint64_t RING_SIZE = 1 << 16;
+
+typedef struct event
+{
+	const char *name;
+	uint64_t start;
+	uint64_t duration;
+} event;
+
+typedef struct ring
+{
+	event events[RING_SIZE];
+	std::atomic<uint64_t> head;
+	const char *threadName;
+	unsigned int tid;
+} ring;
+
+static const clock::time_point epoch = clock::now();
+static std::mutex registryLock;
+static std::vector<std::unique_ptr<ring>> registry;
+static thread_local ring *current = nullptr;
+
+// Rings outlive their thread so a late dump still has its events
+static ring *threadring()
+{
+	if (current == nullptr)
+	{
+		std::unique_ptr<ring> r(new ring());
+		r->head.store(0);
+		r->threadName = nullptr;
+
+		std::lock_guard<std::mutex> lk(registryLock);
+		r->tid = (unsigned int) registry.size() + 1;
+		current = r.get();
+		registry.push_back(std::move(r));
+	}
+
+	return current;
+}
+
+static uint64_t sinceepoch(clock::time_point t)
+{
+	return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(t - epoch).count();
+}
+
+void record(const char *name, clock::time_point start, clock::time_point end)
+{
+	ring *r = threadring();
+	uint64_t head = r->head.load(std::memory_order_relaxed);
+	event &e = r->events[head % RING_SIZE];
+
+	e.name = name;
+	e.start = sinceepoch(start);
+	e.duration = sinceepoch(end) - e.start;
+	r->head.store(head + 1, std::memory_order_release);
+}
+
+void threadname(const char *name)
+{
+	threadring()->threadName = name;
+}
+
+bool dump(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (f == nullptr)
+		return false;
+
+	std::lock_guard<std::mutex> lk(registryLock);
+	bool first = true;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+	for (const std::unique_ptr<ring> &r: registry)
+	{
+		if (r->threadName)
+		{
+			fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", r->tid, r->threadName);
+			first = false;
+		}
+
+		// The oldest slots may be overwritten while copying, leave a margin
+		uint64_t head = r->head.load(std::memory_order_acquire);
+		uint64_t begin = head > RING_SIZE - 256 ? head - (RING_SIZE - 256) : 0;
+
+		for (uint64_t i = begin; i < head; i++)
+		{
+			const event &e = r->events[i % RING_SIZE];
+			fprintf(
+				f,
+				"%s{\"name\":\"%s\",\"cat\":\"loopback\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+				first ? "" : ",\n",
+				e.name,
+				r->tid,
+				e.start / 1000.0,
+				e.duration / 1000.0
+			);
+			first = false;
+		}
+	}
+
+	fprintf(f, "\n]}\n");
+	return fclose(f) == 0;
+}
+
+}
+
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+// Scoped tracing in Chrome trace format, for chrome://tracing or Perfetto.
+// Only compiled in with -DLOOPBACK_TRACE; otherwise the macros expand to
+// nothing and there is no cost at all.
+#ifdef LOOPBACK_TRACE
+
+#include <chrono>
+#include <cstdint>
+
+namespace trace
+{
+
+typedef std::chrono::steady_clock clock;
+
+// "name" must be a string literal, only the pointer is kept.
+void record(const char *name, clock::time_point start, clock::time_point end);
+// Names the calling thread in the trace.
+void threadname(const char *name);
+// Writes the events of every thread. Safe to call while others keep tracing.
+bool dump(const char *path);
+
+struct scope
+{
+	scope(const char *n)
+	: name(n)
+	, start(clock::now())
+	{
+	}
+
+	~scope()
+	{
+		record(name, start, clock::now());
+	}
+
+private:
+	const char *name;
+	clock::time_point start;
+};
+
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) trace::scope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_THREAD(name) trace::threadname(name)
+
+#else
+
+#define TRACE_SCOPE(name) ((void) 0)
+#define TRACE_THREAD(name) ((void) 0)
+
+#endif
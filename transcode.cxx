@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <stdexcept>
+#include <thread>
+
+#include "fileio.hxx"
+#include "flac.hxx"
+#include "trace.hxx"
+#include "transcode.hxx"
+
+namespace transcode
+{
+
+static constexpr size_t BLOCK_FRAMES = 65536;
+
+static std::string outputname(const std::string &input, const options &opts)
+{
+	size_t slash = input.find_last_of("/\\");
+	std::string name = slash == std::string::npos ? input : input.substr(slash + 1);
+
+	size_t dot = name.find_last_of('.');
+	if (dot != std::string::npos && dot > 0)
+		name.resize(dot);
+
+	std::string dir = opts.directory.empty() ? "." : opts.directory;
+	if (dir.back() != '/' && dir.back() != '\\')
+		dir += '/';
+
+	return dir + name + (opts.flac ? ".flac" : ".wav");
+}
+
+// Names are compared the way the file system does
+static std::string namekey(std::string name)
+{
+#ifdef _WIN32
+	std::transform(name.begin(), name.end(), name.begin(), [](char c) {
+		return c >= 'A' && c <= 'Z' ? (char) (c - 'A' + 'a') : c;
+	});
+#endif
+	return name;
+}
+
+// Keeps the scratch buffers of one worker between files
+struct worker
+{
+	worker(const options &opts);
+
+	uint64_t convert(const std::string &input, const std::string &output);
+private:
+	const options &opts;
+	std::vector<float> samples;
+	std::vector<float> mono;
+};
+
+worker::worker(const options &o)
+: opts(o)
+, samples()
+, mono()
+{
+}
+
+uint64_t worker::convert(const std::string &input, const std::string &output)
+{
+	TRACE_SCOPE("transcode_file");
+
+	fileio::mapping *m = fileio::map(input.c_str());
+	wave::writer *wav = nullptr;
+	flac::writer *fl = nullptr;
+
+	try
+	{
+		fileio::wav_info info;
+		if (!fileio::parsewav(fileio::data(m), fileio::size(m), info))
+			throw std::runtime_error("not a WAV file");
+
+		if (info.format == capture::pcm_type::unknown || info.channels <= 0 || info.blockAlign != info.channels * wave::pcmtype_size(info.format))
+			throw std::runtime_error("unsupported sample format");
+
+		int channels = opts.downmix ? 1 : info.channels;
+		if (opts.flac)
+			fl = flac::newwriter(output.c_str(), channels, info.sampleRate, 1);
+		else
+		{
+			wave::options wopts;
+			wopts.format = opts.format;
+			wopts.peaks = opts.peaks;
+			wav = wave::newwriter(output.c_str(), channels, info.sampleRate, opts.outtype, wopts);
+		}
+
+		const unsigned char *data = fileio::data(m) + info.dataOffset;
+		size_t blockBytes = BLOCK_FRAMES * info.blockAlign;
+		fileio::prefetch(m, info.dataOffset, blockBytes);
+
+		for (uint64_t frame = 0; frame < info.frames; frame += BLOCK_FRAMES)
+		{
+			size_t count = (size_t) std::min<uint64_t>(BLOCK_FRAMES, info.frames - frame);
+			const unsigned char *block = data + frame * info.blockAlign;
+
+			// The OS reads the next block while this one is converted
+			fileio::prefetch(m, info.dataOffset + (frame + count) * info.blockAlign, blockBytes);
+
+			const void *src = block;
+			capture::pcm_type srctype = info.format;
+
+			if (opts.downmix && info.channels > 1)
+			{
+				TRACE_SCOPE("downmix");
+
+				size_t samplecount = count * info.channels;
+				samples.resize(samplecount);
+				mono.resize(count);
+				wave::convert(samples.data(), capture::pcm_type::pcm_f32, block, info.format, samplecount);
+
+				float scale = 1.0f / info.channels;
+				for (size_t i = 0; i < count; i++)
+				{
+					float sum = 0.0f;
+					for (int c = 0; c < info.channels; c++)
+						sum += samples[i * info.channels + c];
+
+					mono[i] = sum * scale;
+				}
+
+				src = mono.data();
+				srctype = capture::pcm_type::pcm_f32;
+			}
+
+			bool result = fl ? flac::write(fl, src, count, srctype) : wave::write(wav, src, count, srctype);
+			if (!result)
+				throw std::runtime_error("cannot write " + output);
+		}
+
+		bool result = fl ? flac::close(fl) : wave::close(wav);
+		fl = nullptr;
+		wav = nullptr;
+
+		if (!result)
+			throw std::runtime_error("cannot finish " + output);
+
+		fileio::unmap(m);
+		return info.frames;
+	}
+	catch (const std::runtime_error &)
+	{
+		if (fl)
+			flac::close(fl);
+
+		if (wav)
+			wave::close(wav);
+
+		fileio::unmap(m);
+		throw;
+	}
+}
+
+size_t run(const std::vector<std::string> &inputs, const options &opts)
+{
+	// Only the base name makes it into the output directory, so two inputs
+	// of the same name would overwrite each other, at the same time with
+	// several jobs
+	std::vector<std::string> outputs;
+	std::map<std::string, size_t> owners;
+	size_t clashes = 0;
+
+	for (size_t i = 0; i < inputs.size(); i++)
+	{
+		outputs.push_back(outputname(inputs[i], opts));
+
+		auto owner = owners.emplace(namekey(outputs[i]), i);
+		if (!owner.second)
+		{
+			clashes++;
+			fprintf(stderr, "Error: %s and %s would both be written to %s\n", inputs[owner.first->second].c_str(), inputs[i].c_str(), outputs[i].c_str());
+		}
+	}
+
+	if (clashes > 0)
+		return inputs.size();
+
+	int jobs = opts.jobs > 0 ? opts.jobs : std::max<int>(std::thread::hardware_concurrency(), 1);
+	jobs = std::min<int>(jobs, (int) inputs.size());
+
+	std::atomic<size_t> next(0);
+	std::atomic<size_t> failures(0);
+	std::atomic<uint64_t> totalFrames(0);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	auto work = [&]()
+	{
+		TRACE_THREAD("transcode");
+		worker w(opts);
+
+		for (size_t i = next++; i < inputs.size(); i = next++)
+		{
+			const std::string &output = outputs[i];
+
+			try
+			{
+				if (fileio::samefile(output.c_str(), inputs[i].c_str()))
+					throw std::runtime_error("output would overwrite the input");
+
+				uint64_t frames = w.convert(inputs[i], output);
+				totalFrames += frames;
+				fprintf(stderr, "%s -> %s (%llu frames)\n", inputs[i].c_str(), output.c_str(), (unsigned long long) frames);
+			}
+			catch (const std::runtime_error &e)
+			{
+				failures++;
+				fprintf(stderr, "Error: %s: %s\n", inputs[i].c_str(), e.what());
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 1; i < jobs; i++)
+		threads.emplace_back(work);
+
+	work();
+
+	for (std::thread &t: threads)
+		t.join();
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	fprintf(
+		stderr,
+		"Transcoded %zu of %zu files, %llu frames in %.3f s, %d in parallel\n",
+		inputs.size() - failures,
+		inputs.size(),
+		(unsigned long long) totalFrames,
+		elapsed,
+		std::max(jobs, 1)
+	);
+
+	return failures;
+}
+
+}
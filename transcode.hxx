@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "capture.hxx"
+#include "wave.hxx"
+
+namespace transcode
+{
+
+typedef struct options
+{
+	// Where the outputs go, named after the inputs
+	std::string directory = ".";
+	capture::pcm_type outtype = capture::pcm_type::pcm_s16;
+	wave::encoding format = wave::encoding::pcm;
+	// Write FLAC instead of WAV. "outtype" and "format" are ignored then.
+	bool flac = false;
+	// Average all channels into one
+	bool downmix = false;
+	// Also write a waveform overview of every WAV output
+	bool peaks = false;
+	// Files converted at the same time, 0 picks one per hardware thread
+	int jobs = 0;
+} options;
+
+// Converts every input WAV file with the same conversion code the capture
+// uses. Inputs are memory mapped and read ahead while the previous block
+// is being converted. Returns the number of files that failed. Outputs are
+// named after the base name of their input, and nothing is converted when
+// two inputs would share an output.
+size_t run(const std::vector<std::string> &inputs, const options &opts);
+
+}
@@ -1,5 +1,22 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <future>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "peaks.hxx"
+#include "trace.hxx"
 #include "wave.hxx"
 
 namespace wave
@@ -11,7 +28,48 @@ inline bool writeint(FILE *f, T v)
 	return fwrite(&v, 1, sizeof(v), f) == sizeof(v);
 }
 
-static size_t pcmtype_size(capture::pcm_type t)
+static bool syncfile(FILE *f)
+{
+	if (fflush(f) != 0)
+		return false;
+
+#ifdef _WIN32
+	return _commit(_fileno(f)) == 0;
+#else
+	return fsync(fileno(f)) == 0;
+#endif
+}
+
+template<typename T>
+static unsigned char *putint(unsigned char *p, T v)
+{
+	for (size_t i = 0; i < sizeof(T); i++)
+		*p++ = (unsigned char) (v >> (i * 8));
+
+	return p;
+}
+
+size_t pcmheader(unsigned char *buf, int nchannels, int samplerate, capture::pcm_type type, uint32_t datasize)
+{
+	size_t bps = pcmtype_size(type);
+	unsigned char *p = buf;
+
+	memcpy(p, "RIFF", 4);
+	p = putint<uint32_t>(p + 4, datasize + PCM_HEADER_SIZE - 8);
+	memcpy(p, "WAVEfmt ", 8);
+	p = putint<uint32_t>(p + 8, 16);
+	p = putint<uint16_t>(p, type == capture::pcm_type::pcm_f32 ? 3 : 1);
+	p = putint<uint16_t>(p, nchannels);
+	p = putint<uint32_t>(p, samplerate);
+	p = putint<uint32_t>(p, 1ULL * samplerate * nchannels * bps);
+	p = putint<uint16_t>(p, nchannels * bps);
+	p = putint<uint16_t>(p, bps * 8);
+	memcpy(p, "data", 4);
+	putint<uint32_t>(p + 4, datasize);
+	return PCM_HEADER_SIZE;
+}
+
+size_t pcmtype_size(capture::pcm_type t)
 {
 	switch (t)
 	{
@@ -25,77 +83,116 @@ static size_t pcmtype_size(capture::pcm_type t)
 	}
 }
 
-struct writer
+// One sample at a time, shared by convert() and deinterleave() so both give
+// the same result
+static inline short sample_8_16(unsigned char v)
 {
-	writer(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype);
-	~writer();
+	// Range: 0...255, zero is 127
+	double data = (v - 127) / 127.0;
+	return std::min(std::max(data, -1.0), 1.0) * 32767;
+}
 
-	bool write(const void *buf, size_t framecount, capture::pcm_type intype);
-	bool writeend();
-private:
-	static constexpr size_t FMT_HEADER_SIZE = 16;
-	static constexpr size_t ALL_DATA_SIZE_OFF = 4;
-	static constexpr size_t DATA_CHUNK_SIZE_OFF = 40;
+static inline unsigned char sample_16_8(short v)
+{
+	// Range: -32767...32767, zero is 0
+	return std::min(std::max(v / 32767.0, -1.0), 1.0) * 127.0 + 127.0;
+}
 
-	FILE *outfile;
-	size_t bytesWritten;
-	size_t channels;
-	capture::pcm_type resampleTo;
+static inline unsigned char sample_32_8(float v)
+{
+	// Range: [-1, 1]
+	double data = v;
+	return std::min(std::max(data, -1.0), 1.0) * 127.0 + 127.0;
+}
 
-	bool write_pass(const void *buf, size_t framecount);
-	bool write_8_16(const unsigned char *buf, size_t framecount);
-	bool write_16_8(const short *buf, size_t framecount);
-	bool write_32_8(const float *buf, size_t framecount);
-	bool write_32_16(const float *buf, size_t framecount);
-	bool update();
-};
+static inline short sample_32_16(float v)
+{
+	// Range: [-1, 1]
+	double data = v;
+	return std::min(std::max(data, -1.0), 1.0) * 32767.0;
+}
 
-writer::writer(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype)
-: outfile(nullptr)
-, bytesWritten(0)
-, channels(nchannels)
-, resampleTo(outtype)
+static inline float sample_8_32(unsigned char v)
+{
+	return (v - 127) / 127.0f;
+}
+
+static inline float sample_16_32(short v)
 {
-	if (outtype == capture::pcm_type::pcm_f32)
-		throw std::runtime_error("Float is not supported");
+	return v / 32767.0f;
+}
 
-	outfile = fopen(dest, "wb");
-	if (outfile == nullptr)
-		throw std::runtime_error("Cannot open output file");
+static void convert_8_16(short *dest, const unsigned char *src, size_t samplecount)
+{
+	TRACE_SCOPE("convert_8_16");
 
-	size_t bps = pcmtype_size(outtype);
-	fwrite("RIFF\0\0\0\0WAVEfmt ", 1, 16, outfile);
-	writeint<unsigned int>(outfile, FMT_HEADER_SIZE);
-	writeint<unsigned short>(outfile, 1); // PCM
-	writeint<unsigned short>(outfile, nchannels);
-	writeint<unsigned int>(outfile, samplerate);
-	writeint<unsigned int>(outfile, 1ULL * samplerate * nchannels * bps);
-	writeint<unsigned short>(outfile, nchannels * bps);
-	writeint<unsigned short>(outfile, bps * 8);
-	fwrite("data\0\0\0\0", 1, 8, outfile);
+	// FIXME: Performance
+	for (size_t i = 0; i < samplecount; i++)
+		dest[i] = sample_8_16(src[i]);
 }
 
+static void convert_16_8(unsigned char *dest, const short *src, size_t samplecount)
+{
+	TRACE_SCOPE("convert_16_8");
 
-writer::~writer()
+	// FIXME: Performance
+	for (size_t i = 0; i < samplecount; i++)
+		dest[i] = sample_16_8(src[i]);
+}
+
+static void convert_32_8(unsigned char *dest, const float *src, size_t samplecount)
 {
-	fclose(outfile);
+	TRACE_SCOPE("convert_32_8");
+
+	for (size_t i = 0; i < samplecount; i++)
+		dest[i] = sample_32_8(src[i]);
 }
 
-bool writer::write(const void *buf, size_t framecount, capture::pcm_type intype)
+static void convert_32_16(short *dest, const float *src, size_t samplecount)
 {
-	if (intype == capture::pcm_type::unknown)
-		intype = resampleTo;
+	TRACE_SCOPE("convert_32_16");
+
+	for (size_t i = 0; i < samplecount; i++)
+		dest[i] = sample_32_16(src[i]);
+}
+
+static void convert_8_32(float *dest, const unsigned char *src, size_t samplecount)
+{
+	TRACE_SCOPE("convert_8_32");
+
+	for (size_t i = 0; i < samplecount; i++)
+		dest[i] = sample_8_32(src[i]);
+}
+
+static void convert_16_32(float *dest, const short *src, size_t samplecount)
+{
+	TRACE_SCOPE("convert_16_32");
+
+	for (size_t i = 0; i < samplecount; i++)
+		dest[i] = sample_16_32(src[i]);
+}
+
+bool convert(void *dest, capture::pcm_type outtype, const void *src, capture::pcm_type intype, size_t samplecount)
+{
+	if (intype == outtype)
+	{
+		const unsigned char *in = (const unsigned char *) src;
+		std::copy(in, in + samplecount * pcmtype_size(intype), (unsigned char *) dest);
+		return true;
+	}
 
 	switch (intype)
 	{
 		case capture::pcm_type::pcm_u8:
 		{
-			switch (resampleTo)
+			switch (outtype)
 			{
-			case capture::pcm_type::pcm_u8:
-				return write_pass(buf, framecount);
 			case capture::pcm_type::pcm_s16:
-				return write_8_16((const unsigned char *) buf, framecount);
+				convert_8_16((short *) dest, (const unsigned char *) src, samplecount);
+				return true;
+			case capture::pcm_type::pcm_f32:
+				convert_8_32((float *) dest, (const unsigned char *) src, samplecount);
+				return true;
 			default:
 				break;
 			}
@@ -103,12 +200,14 @@ bool writer::write(const void *buf, size_t framecount, capture::pcm_type intype)
 		}
 		case capture::pcm_type::pcm_s16:
 		{
-			switch (resampleTo)
+			switch (outtype)
 			{
 			case capture::pcm_type::pcm_u8:
-				return write_16_8((const short *) buf, framecount);
-			case capture::pcm_type::pcm_s16:
-				return write_pass(buf, framecount);
+				convert_16_8((unsigned char *) dest, (const short *) src, samplecount);
+				return true;
+			case capture::pcm_type::pcm_f32:
+				convert_16_32((float *) dest, (const short *) src, samplecount);
+				return true;
 			default:
 				break;
 			}
@@ -116,12 +215,14 @@ bool writer::write(const void *buf, size_t framecount, capture::pcm_type intype)
 		}
 		case capture::pcm_type::pcm_f32:
 		{
-			switch (resampleTo)
+			switch (outtype)
 			{
 			case capture::pcm_type::pcm_u8:
-				return write_32_8((const float *) buf, framecount);
+				convert_32_8((unsigned char *) dest, (const float *) src, samplecount);
+				return true;
 			case capture::pcm_type::pcm_s16:
-				return write_32_16((const float *) buf, framecount);
+				convert_32_16((short *) dest, (const float *) src, samplecount);
+				return true;
 			default:
 				break;
 			}
@@ -134,117 +235,1041 @@ bool writer::write(const void *buf, size_t framecount, capture::pcm_type intype)
 	return false;
 }
 
-bool writer::update()
+// Magnitude of a sample in its own units, and full scale in those units as
+// the sample_* functions above see it. Integers stay integers so that
+// measuring them is as cheap as converting them.
+static inline int magnitude(unsigned char v)
 {
-	fseek(outfile, (long) ALL_DATA_SIZE_OFF, SEEK_SET);
-	writeint<unsigned int>(outfile, bytesWritten + 4 + 8 + FMT_HEADER_SIZE + 4 + 4);
-	fseek(outfile, (long) DATA_CHUNK_SIZE_OFF, SEEK_SET);
-	writeint<unsigned int>(outfile, bytesWritten);
-	fseek(outfile, 0, SEEK_END);
-	return true;
+	return std::abs(v - 127);
 }
 
-bool writer::write_pass(const void *buf, size_t framecount)
+static inline int magnitude(short v)
 {
-	size_t bps = pcmtype_size(resampleTo);
-	size_t framesize = bps * channels;
-	size_t writesz = framesize * framecount;
+	return std::abs((int) v);
+}
 
-	if (fwrite(buf, 1, writesz, outfile) != writesz)
-		return false;
+static inline float magnitude(float v)
+{
+	return std::fabs(v);
+}
 
-	bytesWritten += writesz;
-	return update();
+static inline int fullscale(unsigned char)
+{
+	return 127;
 }
 
-bool writer::write_8_16(const unsigned char *buf, size_t framecount)
+static inline int fullscale(short)
 {
-	for (size_t i = 0; i < framecount; i++)
+	return 32767;
+}
+
+static inline float fullscale(float)
+{
+	return 1.0f;
+}
+
+// Enough lanes for the loops below to vectorize, like peaks::summarize()
+static constexpr size_t LEVEL_LANES = 64;
+
+// Sample j goes to lane j, so "count" is at most LEVEL_LANES
+template<typename In, typename M>
+static inline void measure_lanes(const In *src, size_t count, M full, uint32_t *clipped, M *peak)
+{
+	for (size_t j = 0; j < count; j++)
+	{
+		M m = magnitude(src[j]);
+		clipped[j] += m > full;
+		peak[j] = std::max(peak[j], m);
+	}
+}
+
+// Folds the lanes of a stride of whole frames into one entry per channel
+template<typename M>
+static void addlevels(channel_levels *levels, size_t channels, size_t stride, M full, const uint32_t *clipped, const M *peak)
+{
+	for (size_t j = 0; j < stride; j++)
+	{
+		channel_levels &l = levels[j % channels];
+		l.clipped += clipped[j];
+		l.peak = std::max(l.peak, (float) peak[j] / full);
+	}
+}
+
+// For more channels than lanes, one frame at a time
+template<typename In, typename M>
+static void measure_frames(const In *src, size_t framecount, size_t channels, M full, channel_levels *levels)
+{
+	for (size_t i = 0; i < framecount * channels; i += channels)
 	{
 		for (size_t c = 0; c < channels; c++)
 		{
-			unsigned char data = buf[i * channels + c];
-			// Range: 0...255, zero is 127
-			// FIXME: Performance
-			double data2 = (data - 127) / 127.0;
-			short data3 = std::min(std::max(data2, -1.0), 1.0) * 32767;
-			if (!writeint(outfile, data3))
-				return false;
-
-			bytesWritten += 2;
+			M m = magnitude(src[i + c]);
+			levels[c].clipped += m > full;
+			levels[c].peak = std::max(levels[c].peak, (float) m / full);
 		}
 	}
+}
 
-	return update();
+template<typename In, typename Out, Out (*F)(In)>
+static void convert_levels(Out *dest, const In *src, size_t framecount, size_t channels, channel_levels *levels)
+{
+	TRACE_SCOPE("convert_levels");
+
+	typedef decltype(magnitude(In())) M;
+	const M full = fullscale(In());
+	size_t samplecount = framecount * channels;
+
+	if (channels > LEVEL_LANES)
+	{
+		measure_frames(src, framecount, channels, full, levels);
+		for (size_t i = 0; i < samplecount; i++)
+			dest[i] = F(src[i]);
+
+		return;
+	}
+
+	size_t stride = channels * (LEVEL_LANES / channels);
+	size_t whole = samplecount / stride * stride;
+	uint32_t clipped[LEVEL_LANES] = {};
+	M peak[LEVEL_LANES] = {};
+
+	// Measured and converted in two loops over the same stride, while it is
+	// in cache, so that each of them vectorizes
+	for (size_t i = 0; i < whole; i += stride)
+	{
+		measure_lanes(src + i, stride, full, clipped, peak);
+
+		for (size_t j = 0; j < stride; j++)
+			dest[i + j] = F(src[i + j]);
+	}
+
+	// A partial stride always starts at channel 0
+	measure_lanes(src + whole, samplecount - whole, full, clipped, peak);
+	for (size_t j = whole; j < samplecount; j++)
+		dest[j] = F(src[j]);
+
+	addlevels(levels, channels, stride, full, clipped, peak);
 }
 
-bool writer::write_16_8(const short *buf, size_t framecount)
+bool convert(void *dest, capture::pcm_type outtype, const void *src, capture::pcm_type intype, size_t framecount, int channels, channel_levels *levels)
 {
-	for (size_t i = 0; i < framecount; i++)
+	if (channels <= 0)
+		return false;
+
+	switch (outtype)
 	{
-		for (size_t c = 0; c < channels; c++)
+	case capture::pcm_type::pcm_u8:
+		switch (intype)
+		{
+		case capture::pcm_type::pcm_s16:
+			convert_levels<short, unsigned char, sample_16_8>((unsigned char *) dest, (const short *) src, framecount, channels, levels);
+			return true;
+		case capture::pcm_type::pcm_f32:
+			convert_levels<float, unsigned char, sample_32_8>((unsigned char *) dest, (const float *) src, framecount, channels, levels);
+			return true;
+		default:
+			break;
+		}
+		break;
+	case capture::pcm_type::pcm_s16:
+		switch (intype)
 		{
-			short data = buf[i * channels + c];
-			// Range: -32767...32767, zero is 0
-			// FIXME: Performance
-			unsigned char data2 = std::min(std::max(data / 32767.0, -1.0), 1.0) * 127.0 + 127.0;
-			if (!writeint(outfile, data2))
-				return false;
-
-			bytesWritten += 1;
+		case capture::pcm_type::pcm_u8:
+			convert_levels<unsigned char, short, sample_8_16>((short *) dest, (const unsigned char *) src, framecount, channels, levels);
+			return true;
+		case capture::pcm_type::pcm_f32:
+			convert_levels<float, short, sample_32_16>((short *) dest, (const float *) src, framecount, channels, levels);
+			return true;
+		default:
+			break;
 		}
+		break;
+	default:
+		break;
 	}
 
-	return update();
+	return false;
+}
+
+template<typename T>
+static inline T sample_copy(T v)
+{
+	return v;
 }
 
-bool writer::write_32_8(const float *buf, size_t framecount)
+// Calls K::run<In, Out, F>() for a pair of PCM types
+template<typename K, typename... Args>
+static bool dispatch(capture::pcm_type outtype, capture::pcm_type intype, Args... args)
 {
+	switch (intype)
+	{
+		case capture::pcm_type::pcm_u8:
+		{
+			switch (outtype)
+			{
+			case capture::pcm_type::pcm_u8:
+				K::template run<unsigned char, unsigned char, sample_copy<unsigned char>>(args...);
+				return true;
+			case capture::pcm_type::pcm_s16:
+				K::template run<unsigned char, short, sample_8_16>(args...);
+				return true;
+			case capture::pcm_type::pcm_f32:
+				K::template run<unsigned char, float, sample_8_32>(args...);
+				return true;
+			default:
+				break;
+			}
+			break;
+		}
+		case capture::pcm_type::pcm_s16:
+		{
+			switch (outtype)
+			{
+			case capture::pcm_type::pcm_u8:
+				K::template run<short, unsigned char, sample_16_8>(args...);
+				return true;
+			case capture::pcm_type::pcm_s16:
+				K::template run<short, short, sample_copy<short>>(args...);
+				return true;
+			case capture::pcm_type::pcm_f32:
+				K::template run<short, float, sample_16_32>(args...);
+				return true;
+			default:
+				break;
+			}
+			break;
+		}
+		case capture::pcm_type::pcm_f32:
+		{
+			switch (outtype)
+			{
+			case capture::pcm_type::pcm_u8:
+				K::template run<float, unsigned char, sample_32_8>(args...);
+				return true;
+			case capture::pcm_type::pcm_s16:
+				K::template run<float, short, sample_32_16>(args...);
+				return true;
+			case capture::pcm_type::pcm_f32:
+				K::template run<float, float, sample_copy<float>>(args...);
+				return true;
+			default:
+				break;
+			}
+			break;
+		}
+		default:
+			break;
+	}
+
+	return false;
+}
+
+// With the channel count known at compile time the frame loop reads one
+// interleaved group and stores to every channel, which the compiler turns
+// into vector loads and shuffles
+template<int CH, typename In, typename Out, Out (*F)(In)>
+static void deinterleave_fixed(Out *const *dest, const In *src, size_t first, size_t framecount)
+{
+	Out *out[CH];
+	for (int c = 0; c < CH; c++)
+		out[c] = dest[c] + first;
+
+	src += first * CH;
+
 	for (size_t i = 0; i < framecount; i++)
 	{
-		for (size_t c = 0; c < channels; c++)
+		for (int c = 0; c < CH; c++)
+			out[c][i] = F(src[i * CH + c]);
+	}
+}
+
+// The same the other way around
+template<int CH, typename In, typename Out, Out (*F)(In)>
+static void interleave_fixed(Out *dest, const In *const *src, size_t framecount)
+{
+	const In *in[CH];
+	for (int c = 0; c < CH; c++)
+		in[c] = src[c];
+
+	for (size_t i = 0; i < framecount; i++)
+	{
+		for (int c = 0; c < CH; c++)
+			dest[i * CH + c] = F(in[c][i]);
+	}
+}
+
+// Frames "first" to "first" + "framecount" of "src" into the same place of
+// every buffer in "dest"
+template<typename In, typename Out, Out (*F)(In)>
+static void deinterleave_frames(Out *const *dest, const In *src, size_t first, size_t framecount, int channels)
+{
+	switch (channels)
+	{
+	case 1:
+		return deinterleave_fixed<1, In, Out, F>(dest, src, first, framecount);
+	case 2:
+		return deinterleave_fixed<2, In, Out, F>(dest, src, first, framecount);
+	case 4:
+		return deinterleave_fixed<4, In, Out, F>(dest, src, first, framecount);
+	case 6:
+		return deinterleave_fixed<6, In, Out, F>(dest, src, first, framecount);
+	case 8:
+		return deinterleave_fixed<8, In, Out, F>(dest, src, first, framecount);
+	default:
+		break;
+	}
+
+	// Uncommon layouts, one strided pass per channel
+	for (int c = 0; c < channels; c++)
+	{
+		Out *o = dest[c] + first;
+		for (size_t i = first; i < first + framecount; i++)
+			*o++ = F(src[i * channels + c]);
+	}
+}
+
+// Strides of lanes measured per piece of the input before it is split, so
+// the piece is still in cache
+static constexpr size_t LEVEL_PIECE_STRIDES = 16;
+
+struct deinterleave_kernel
+{
+	template<typename In, typename Out, Out (*F)(In)>
+	static void run(void *const *dest, const void *src, size_t framecount, int channels, channel_levels *levels)
+	{
+		TRACE_SCOPE("deinterleave");
+
+		Out *const *out = (Out *const *) dest;
+		const In *in = (const In *) src;
+
+		if (!levels)
+			return deinterleave_frames<In, Out, F>(out, in, 0, framecount, channels);
+
+		typedef decltype(magnitude(In())) M;
+		const M full = fullscale(In());
+
+		if ((size_t) channels > LEVEL_LANES)
 		{
-			double data = buf[i * channels + c];
-			// Range: [-1, 1]
-			unsigned char data2 = std::min(std::max(data, -1.0), 1.0) * 127.0 + 127.0;
-			if (!writeint(outfile, data2))
-				return false;
+			measure_frames(in, framecount, channels, full, levels);
+			return deinterleave_frames<In, Out, F>(out, in, 0, framecount, channels);
+		}
+
+		// The same lanes as convert_levels(), a piece of whole strides at a
+		// time
+		size_t stride = channels * (LEVEL_LANES / channels);
+		size_t pieceFrames = LEVEL_LANES / channels * LEVEL_PIECE_STRIDES;
+		uint32_t clipped[LEVEL_LANES] = {};
+		M peak[LEVEL_LANES] = {};
 
-			bytesWritten += 1;
+		for (size_t i = 0; i < framecount; i += pieceFrames)
+		{
+			size_t count = std::min(pieceFrames, framecount - i);
+			const In *piece = in + i * channels;
+			size_t samplecount = count * channels;
+			size_t whole = samplecount / stride * stride;
+
+			for (size_t j = 0; j < whole; j += stride)
+				measure_lanes(piece + j, stride, full, clipped, peak);
+
+			// Only the last piece has a partial stride, starting at channel 0
+			measure_lanes(piece + whole, samplecount - whole, full, clipped, peak);
+			deinterleave_frames<In, Out, F>(out, in, i, count, channels);
 		}
+
+		addlevels(levels, channels, stride, full, clipped, peak);
 	}
+};
 
-	return update();
+struct interleave_kernel
+{
+	template<typename In, typename Out, Out (*F)(In)>
+	static void run(void *dest, const void *const *src, size_t framecount, int channels)
+	{
+		TRACE_SCOPE("interleave");
+
+		Out *out = (Out *) dest;
+		const In *const *in = (const In *const *) src;
+
+		switch (channels)
+		{
+		case 1:
+			return interleave_fixed<1, In, Out, F>(out, in, framecount);
+		case 2:
+			return interleave_fixed<2, In, Out, F>(out, in, framecount);
+		case 4:
+			return interleave_fixed<4, In, Out, F>(out, in, framecount);
+		case 6:
+			return interleave_fixed<6, In, Out, F>(out, in, framecount);
+		case 8:
+			return interleave_fixed<8, In, Out, F>(out, in, framecount);
+		default:
+			break;
+		}
+
+		for (int c = 0; c < channels; c++)
+		{
+			const In *plane = in[c];
+			for (size_t i = 0; i < framecount; i++)
+				out[i * channels + c] = F(plane[i]);
+		}
+	}
+};
+
+bool deinterleave(void *const *dest, capture::pcm_type outtype, const void *src, capture::pcm_type intype, size_t framecount, int channels, channel_levels *levels)
+{
+	if (levels && channels <= 0)
+		return false;
+
+	return dispatch<deinterleave_kernel>(outtype, intype, dest, src, framecount, channels, levels);
 }
 
-bool writer::write_32_16(const float *buf, size_t framecount)
+bool interleave(void *dest, capture::pcm_type outtype, const void *const *src, capture::pcm_type intype, size_t framecount, int channels)
 {
-	for (size_t i = 0; i < framecount; i++)
+	return dispatch<interleave_kernel>(outtype, intype, dest, src, framecount, channels);
+}
+
+static const int ima_index_table[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const int ima_step_table[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+	19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+	130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+	876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+	5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+// Encodes one IMA ADPCM block of "perblock" frames from interleaved 16-bit
+// input. "index" carries the step index of each channel between blocks.
+//
+// The inner loop runs over channels with no data dependency between them and
+// no branches, so it vectorizes across channels.
+static void encode_ima_block(unsigned char *dest, const short *src, size_t channels, size_t perblock, int *index, int *predictor, unsigned char *nibbles)
+{
+	// Block header: first sample and step index of every channel
+	for (size_t c = 0; c < channels; c++)
+	{
+		predictor[c] = src[c];
+		dest[c * 4] = (unsigned char) (src[c] & 0xFF);
+		dest[c * 4 + 1] = (unsigned char) ((src[c] >> 8) & 0xFF);
+		dest[c * 4 + 2] = (unsigned char) index[c];
+		dest[c * 4 + 3] = 0;
+	}
+
+	for (size_t i = 1; i < perblock; i++)
+	{
+		const short *frame = src + i * channels;
+		unsigned char *out = nibbles + (i - 1) * channels;
+
+		for (size_t c = 0; c < channels; c++)
+		{
+			int step = ima_step_table[index[c]];
+			int diff = frame[c] - predictor[c];
+			int sign = diff < 0 ? 8 : 0;
+			diff = diff < 0 ? -diff : diff;
+
+			int code = 0;
+			int delta = step >> 3;
+			int bit = diff >= step;
+			code |= bit << 2;
+			diff -= bit * step;
+			delta += bit * step;
+
+			step >>= 1;
+			bit = diff >= step;
+			code |= bit << 1;
+			diff -= bit * step;
+			delta += bit * step;
+
+			step >>= 1;
+			bit = diff >= step;
+			code |= bit;
+			delta += bit * step;
+
+			int value = predictor[c] + (sign ? -delta : delta);
+			predictor[c] = std::min(std::max(value, -32768), 32767);
+			index[c] = std::min(std::max(index[c] + ima_index_table[code], 0), 88);
+			out[c] = (unsigned char) (code | sign);
+		}
+	}
+
+	// Pack 8 samples per channel into 4 bytes, channels interleaved, low nibble first
+	unsigned char *data = dest + channels * 4;
+	for (size_t g = 0; g < (perblock - 1) / 8; g++)
 	{
 		for (size_t c = 0; c < channels; c++)
 		{
-			double data = buf[i * channels + c];
-			// Range: [-1, 1]
-			short data2 = std::min(std::max(data, -1.0), 1.0) * 32767.0;
-			if (!writeint(outfile, data2))
-				return false;
+			for (size_t k = 0; k < 4; k++)
+			{
+				size_t i = g * 8 + k * 2;
+				*data++ = nibbles[i * channels + c] | (nibbles[(i + 1) * channels + c] << 4);
+			}
+		}
+	}
+}
+
+static std::string segmentname(const std::string &tmpl, size_t index, time_t when)
+{
+	std::string result = tmpl;
+	char number[32];
+	snprintf(number, sizeof(number), "%04u", (unsigned int) index);
+
+	size_t pos = result.find("{n}");
+	if (pos == std::string::npos)
+	{
+		// No placeholder. Put the segment number before the extension.
+		size_t dot = result.find_last_of('.');
+		size_t slash = result.find_last_of("/\\");
+		if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+			dot = result.length();
 
-			bytesWritten += 2;
+		result.insert(dot, std::string("_") + number);
+	}
+	else
+	{
+		for (; pos != std::string::npos; pos = result.find("{n}", pos))
+			result.replace(pos, 3, number);
+	}
+
+	if (result.find('%') != std::string::npos)
+	{
+		char name[1024];
+		struct tm *tm = localtime(&when);
+		if (tm && strftime(name, sizeof(name), result.c_str(), tm) > 0)
+			result = name;
+	}
+
+	return result;
+}
+
+struct writer
+{
+	writer(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype, const options &opts);
+	~writer();
+
+	bool write(const void *buf, size_t framecount, capture::pcm_type intype);
+	bool nextsegment();
+	bool addcue();
+	bool writeend();
+	void getlevels(channel_levels *dest) const;
+private:
+	static constexpr size_t IMA_FMT_HEADER_SIZE = 20;
+	static constexpr size_t ALL_DATA_SIZE_OFF = 4;
+	static constexpr size_t FACT_SAMPLES_OFF = 48;
+
+	typedef struct segment
+	{
+		FILE *file;
+		std::string name;
+	} segment;
+
+	FILE *outfile;
+	size_t bytesWritten;
+	size_t framesWritten;
+	size_t channels;
+	int sampleRate;
+	capture::pcm_type resampleTo;
+	encoding format;
+	size_t headerSize;
+	std::vector<unsigned char> staging;
+	std::vector<channel_levels> levels;
+
+	// IMA ADPCM
+	size_t blockAlign;
+	size_t framesPerBlock;
+	size_t blockFill;
+	std::vector<short> blockInput;
+	std::vector<unsigned char> blockOutput;
+	std::vector<unsigned char> nibbles;
+	std::vector<int> stepIndex;
+	std::vector<int> predictor;
+
+	// Cue points of the current file, in frames
+	std::vector<unsigned int> cues;
+
+	// Overview of the current file
+	bool withPeaks;
+	peaks::builder *peakFile;
+
+	// Header refresh and sync policy
+	std::chrono::steady_clock::duration refreshInterval;
+	std::chrono::steady_clock::duration syncInterval;
+	std::chrono::steady_clock::time_point lastRefresh;
+	std::chrono::steady_clock::time_point lastSync;
+
+	// Segmenting
+	std::string nameTemplate;
+	bool segmented;
+	size_t segmentLimit;
+	size_t segmentFrames;
+	size_t segmentIndex;
+	time_t segmentStart;
+	std::future<segment> nextSegment;
+
+	segment opensegment(const std::string &name) const;
+	void openpeaks(const std::string &name);
+	void preparesegment();
+	bool rotate(bool onrequest = false);
+	bool writeframes(const void *buf, size_t framecount, capture::pcm_type intype);
+	bool write_pass(const void *buf, size_t framecount);
+	bool write_ima(const short *buf, size_t framecount);
+	bool flushblock();
+	bool writecues();
+	bool update();
+	bool refresh();
+	bool sync();
+};
+
+writer::writer(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype, const options &opts)
+: outfile(nullptr)
+, bytesWritten(0)
+, framesWritten(0)
+, channels(nchannels)
+, sampleRate(samplerate)
+, resampleTo(outtype)
+, format(opts.format)
+, headerSize(44)
+, staging()
+, levels(nchannels, channel_levels {0, 0.0f})
+, blockAlign(0)
+, framesPerBlock(0)
+, blockFill(0)
+, blockInput()
+, blockOutput()
+, nibbles()
+, stepIndex(nchannels, 0)
+, predictor(nchannels, 0)
+, cues()
+, withPeaks(opts.peaks)
+, peakFile(nullptr)
+, refreshInterval(std::chrono::milliseconds(std::max(opts.headerRefreshMs, 0)))
+, syncInterval(std::chrono::milliseconds(std::max(opts.syncMs, 0)))
+, lastRefresh(std::chrono::steady_clock::now())
+, lastSync(lastRefresh)
+, nameTemplate()
+, segmented(false)
+, segmentLimit(0)
+, segmentFrames(0)
+, segmentIndex(0)
+, segmentStart(time(nullptr))
+, nextSegment()
+{
+	size_t framesize = pcmtype_size(outtype) * nchannels;
+	size_t byteLimit = opts.segmentBytes / framesize;
+
+	if (format == encoding::ima_adpcm)
+	{
+		if (outtype != capture::pcm_type::pcm_s16)
+			throw std::runtime_error("IMA ADPCM needs 16-bit input");
+		// Common decoders (ACM, libsndfile) stop at stereo
+		if (nchannels > 2)
+			throw std::runtime_error("IMA ADPCM supports mono or stereo only");
+
+		// 256 bytes per channel at 22050Hz, scaled with the sample rate
+		blockAlign = 256 * nchannels * std::max(samplerate / 22050, 1);
+		framesPerBlock = (blockAlign - 4 * nchannels) * 2 / nchannels + 1;
+		headerSize = 60;
+		blockInput.resize(framesPerBlock * nchannels);
+		blockOutput.resize(blockAlign);
+		nibbles.resize(framesPerBlock * nchannels);
+		byteLimit = opts.segmentBytes / blockAlign * framesPerBlock;
+	}
+
+	segmentLimit = opts.segmentFrames;
+	if (opts.segmentBytes > 0)
+	{
+		byteLimit = std::max<size_t>(byteLimit, 1);
+		segmentLimit = segmentLimit > 0 ? std::min(segmentLimit, byteLimit) : byteLimit;
+	}
+
+	segmented = segmentLimit > 0 || opts.splitOnRequest;
+	std::string name = dest;
+	if (segmented)
+	{
+		nameTemplate = dest;
+		name = segmentname(nameTemplate, 0, segmentStart);
+	}
+
+	outfile = opensegment(name).file;
+	if (outfile == nullptr)
+		throw std::runtime_error("Cannot open output file");
+
+	try
+	{
+		openpeaks(name);
+	}
+	catch (const std::runtime_error &)
+	{
+		fclose(outfile);
+		throw;
+	}
+
+	preparesegment();
+}
+
+
+writer::~writer()
+{
+	fclose(outfile);
+
+	if (peakFile)
+		peaks::close(peakFile);
+
+	if (nextSegment.valid())
+	{
+		// Prepared but never used
+		segment next = nextSegment.get();
+		if (next.file)
+		{
+			fclose(next.file);
+			remove(next.name.c_str());
+		}
+	}
+}
+
+writer::segment writer::opensegment(const std::string &name) const
+{
+	FILE *f = fopen(name.c_str(), "wb");
+	if (f == nullptr)
+		return {nullptr, name};
+
+	if (format != encoding::ima_adpcm)
+	{
+		unsigned char header[PCM_HEADER_SIZE];
+		fwrite(header, 1, pcmheader(header, channels, sampleRate, resampleTo, 0), f);
+		return {f, name};
+	}
+
+	fwrite("RIFF\0\0\0\0WAVEfmt ", 1, 16, f);
+	writeint<unsigned int>(f, IMA_FMT_HEADER_SIZE);
+	writeint<unsigned short>(f, 0x11); // IMA ADPCM
+	writeint<unsigned short>(f, channels);
+	writeint<unsigned int>(f, sampleRate);
+	writeint<unsigned int>(f, 1ULL * sampleRate * blockAlign / framesPerBlock);
+	writeint<unsigned short>(f, blockAlign);
+	writeint<unsigned short>(f, 4);
+	writeint<unsigned short>(f, 2);
+	writeint<unsigned short>(f, framesPerBlock);
+	fwrite("fact\4\0\0\0\0\0\0\0", 1, 12, f);
+	fwrite("data\0\0\0\0", 1, 8, f);
+	return {f, name};
+}
+
+void writer::openpeaks(const std::string &name)
+{
+	if (withPeaks)
+		peakFile = peaks::newbuilder((name + ".peaks").c_str(), channels, sampleRate);
+}
+
+void writer::preparesegment()
+{
+	if (!segmented)
+		return;
+
+	// Open the next file and write its header ahead of time so the switch
+	// itself is only a pointer swap.
+	size_t index = segmentIndex + 1;
+	time_t when = segmentLimit > 0 ? segmentStart + (time_t) (segmentLimit / sampleRate) : time(nullptr);
+	std::string name = segmentname(nameTemplate, index, when);
+	nextSegment = std::async(std::launch::async, [this, name]()
+	{
+		return opensegment(name);
+	});
+}
+
+bool writer::rotate(bool onrequest)
+{
+	if (!flushblock() || !update() || !writecues() || !sync())
+		return false;
+
+	segment next = nextSegment.get();
+	time_t start = (segmentLimit > 0 && !onrequest) ? segmentStart + (time_t) (segmentLimit / sampleRate) : time(nullptr);
+
+	// The time of a requested split is not known in advance
+	if (onrequest && nameTemplate.find('%') != std::string::npos)
+	{
+		std::string name = segmentname(nameTemplate, segmentIndex + 1, start);
+		if (name != next.name)
+		{
+			if (next.file)
+			{
+				fclose(next.file);
+				remove(next.name.c_str());
+			}
+
+			next = opensegment(name);
+		}
+	}
+
+	if (next.file == nullptr)
+		return false;
+
+	fclose(outfile);
+	outfile = next.file;
+	bytesWritten = 0;
+
+	framesWritten = 0;
+	segmentFrames = 0;
+	segmentIndex++;
+	segmentStart = start;
+
+	preparesegment();
+
+	if (peakFile)
+	{
+		bool result = peaks::close(peakFile);
+		peakFile = nullptr;
+
+		try
+		{
+			openpeaks(next.name);
 		}
+		catch (const std::runtime_error &)
+		{
+			return false;
+		}
+
+		return result;
+	}
+
+	return true;
+}
+
+bool writer::write(const void *buf, size_t framecount, capture::pcm_type intype)
+{
+	if (intype == capture::pcm_type::unknown)
+		intype = resampleTo;
+
+	if (segmentLimit == 0)
+		return writeframes(buf, framecount, intype);
+
+	const unsigned char *data = (const unsigned char *) buf;
+	size_t framesize = pcmtype_size(intype) * channels;
+
+	while (framecount > 0)
+	{
+		if (segmentFrames >= segmentLimit && !rotate())
+			return false;
+
+		// Split at the exact frame where the segment ends
+		size_t count = std::min(framecount, segmentLimit - segmentFrames);
+		if (!writeframes(data, count, intype))
+			return false;
+
+		segmentFrames += count;
+		data += count * framesize;
+		framecount -= count;
 	}
 
+	return true;
+}
+
+bool writer::nextsegment()
+{
+	if (!segmented)
+		return false;
+
+	return rotate(true);
+}
+
+bool writer::addcue()
+{
+	cues.push_back((unsigned int) (framesWritten + blockFill));
+	return true;
+}
+
+bool writer::writeframes(const void *buf, size_t framecount, capture::pcm_type intype)
+{
+	if (intype != resampleTo)
+	{
+		size_t samplecount = framecount * channels;
+		staging.resize(samplecount * pcmtype_size(resampleTo));
+
+		// Nothing is clamped on the way to float
+		bool result = resampleTo == capture::pcm_type::pcm_f32
+			? convert(staging.data(), resampleTo, buf, intype, samplecount)
+			: convert(staging.data(), resampleTo, buf, intype, framecount, channels, levels.data());
+
+		if (!result)
+			return false;
+
+		buf = staging.data();
+	}
+
+	// While the converted block is still in cache
+	if (peakFile && !peaks::add(peakFile, buf, framecount, resampleTo))
+		return false;
+
+	if (format == encoding::ima_adpcm)
+		return write_ima((const short *) buf, framecount);
+
+	return write_pass(buf, framecount);
+}
+
+bool writer::update()
+{
+	TRACE_SCOPE("update");
+
+	fseek(outfile, (long) ALL_DATA_SIZE_OFF, SEEK_SET);
+	writeint<unsigned int>(outfile, bytesWritten + headerSize - 8);
+
+	if (format == encoding::ima_adpcm)
+	{
+		fseek(outfile, (long) FACT_SAMPLES_OFF, SEEK_SET);
+		writeint<unsigned int>(outfile, framesWritten);
+	}
+
+	fseek(outfile, (long) (headerSize - 4), SEEK_SET);
+	writeint<unsigned int>(outfile, bytesWritten);
+	fseek(outfile, 0, SEEK_END);
+	return true;
+}
+
+bool writer::write_pass(const void *buf, size_t framecount)
+{
+	TRACE_SCOPE("write_pass");
+
+	size_t writesz = pcmtype_size(resampleTo) * channels * framecount;
+
+	if (fwrite(buf, 1, writesz, outfile) != writesz)
+		return false;
+
+	bytesWritten += writesz;
+	framesWritten += framecount;
+	return refresh();
+}
+
+bool writer::write_ima(const short *buf, size_t framecount)
+{
+	TRACE_SCOPE("write_ima");
+
+	while (framecount > 0)
+	{
+		size_t count = std::min(framecount, framesPerBlock - blockFill);
+		std::copy(buf, buf + count * channels, blockInput.begin() + blockFill * channels);
+		blockFill += count;
+		buf += count * channels;
+		framecount -= count;
+
+		if (blockFill == framesPerBlock && !flushblock())
+			return false;
+	}
+
+	return refresh();
+}
+
+// The header follows the data every "refreshInterval", and reaches the disk
+// every "syncInterval"
+bool writer::refresh()
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	if (syncInterval.count() > 0 && now - lastSync >= syncInterval)
+	{
+		// Data first, so a crash in between leaves sizes that are too small
+		lastRefresh = now;
+		return syncfile(outfile) && update() && sync();
+	}
+
+	if (now - lastRefresh < refreshInterval)
+		return true;
+
+	lastRefresh = now;
 	return update();
 }
 
+// Everything written so far reaches the disk, if a sync interval is set
+bool writer::sync()
+{
+	lastSync = std::chrono::steady_clock::now();
+	return syncInterval.count() == 0 || syncfile(outfile);
+}
+
+bool writer::writecues()
+{
+	if (cues.empty())
+		return true;
+
+	// Chunks start on even offsets
+	if (bytesWritten % 2)
+		fputc(0, outfile);
+
+	fwrite("cue ", 1, 4, outfile);
+	writeint<unsigned int>(outfile, 4 + cues.size() * 24);
+	writeint<unsigned int>(outfile, cues.size());
+
+	for (size_t i = 0; i < cues.size(); i++)
+	{
+		writeint<unsigned int>(outfile, i + 1);
+		writeint<unsigned int>(outfile, cues[i]);
+		fwrite("data", 1, 4, outfile);
+		writeint<unsigned int>(outfile, 0);
+		writeint<unsigned int>(outfile, 0);
+		writeint<unsigned int>(outfile, cues[i]);
+	}
+
+	cues.clear();
+
+	long end = ftell(outfile);
+	fseek(outfile, (long) ALL_DATA_SIZE_OFF, SEEK_SET);
+	bool result = writeint<unsigned int>(outfile, end - 8);
+	fseek(outfile, 0, SEEK_END);
+	return result;
+}
+
+bool writer::flushblock()
+{
+	if (blockFill == 0)
+		return true;
+
+	size_t frames = blockFill;
+
+	// Pad a partial block by holding the last sample. The fact chunk keeps
+	// the real length.
+	for (; blockFill < framesPerBlock; blockFill++)
+	{
+		for (size_t c = 0; c < channels; c++)
+			blockInput[blockFill * channels + c] = blockInput[(frames - 1) * channels + c];
+	}
+
+	blockFill = 0;
+	encode_ima_block(blockOutput.data(), blockInput.data(), channels, framesPerBlock, stepIndex.data(), predictor.data(), nibbles.data());
+
+	if (fwrite(blockOutput.data(), 1, blockAlign, outfile) != blockAlign)
+		return false;
+
+	bytesWritten += blockAlign;
+	framesWritten += frames;
+	return true;
+}
 
 bool writer::writeend()
 {
-	return update();
+	bool result = flushblock() && update() && writecues() && sync();
+
+	if (peakFile)
+	{
+		result = peaks::close(peakFile) && result;
+		peakFile = nullptr;
+	}
+
+	return result;
+}
+
+void writer::getlevels(channel_levels *dest) const
+{
+	std::copy(levels.begin(), levels.end(), dest);
 }
 
-writer *newwriter(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype)
+writer *newwriter(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype, const options &opts)
 {
-	return new writer(dest, nchannels, samplerate, outtype);
+	return new writer(dest, nchannels, samplerate, outtype, opts);
 }
 
 bool write(writer *writer, const void *buf, size_t framecount, capture::pcm_type intype)
@@ -252,6 +1277,21 @@ bool write(writer *writer, const void *buf, size_t framecount, capture::pcm_type
 	return writer->write(buf, framecount, intype);
 }
 
+bool nextsegment(writer *writer)
+{
+	return writer->nextsegment();
+}
+
+bool addcue(writer *writer)
+{
+	return writer->addcue();
+}
+
+void getlevels(writer *writer, channel_levels *dest)
+{
+	writer->getlevels(dest);
+}
+
 bool close(writer *writer)
 {
 	bool result = writer->writeend();
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <cstdio>
 
 #include "capture.hxx"
@@ -9,8 +10,80 @@ namespace wave
 
 typedef struct writer writer;
 
-writer *newwriter(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype);
+typedef enum class encoding
+{
+	pcm,
+	ima_adpcm,
+	max_enum
+} encoding;
+
+typedef struct options
+{
+	// IMA ADPCM takes 16-bit input and stores 4 bits per sample.
+	encoding format = encoding::pcm;
+	// Start a new file once the current one holds this many frames. 0 disables it.
+	size_t segmentFrames = 0;
+	// Start a new file once the current data chunk would exceed this size. 0 disables it.
+	size_t segmentBytes = 0;
+	// Allow nextsegment() even without a size or duration limit.
+	bool splitOnRequest = false;
+	// Write a waveform overview next to every file, named after it plus
+	// ".peaks". See peaks.hxx.
+	bool peaks = false;
+	// Refresh the size fields in the header at most this often. 0 refreshes
+	// after every write. A file cut short keeps stale sizes, see
+	// fileio::repairwav().
+	int headerRefreshMs = 0;
+	// Flush data and header to disk this often, and when a file is
+	// finished. The data goes first, so the header never claims more than
+	// what survived. 0 leaves it to the OS.
+	int syncMs = 0;
+} options;
+
+typedef struct channel_levels
+{
+	// Samples past full scale, clamped by the conversion
+	uint64_t clipped;
+	// Largest magnitude before clamping, 1.0 is full scale
+	float peak;
+} channel_levels;
+
+// When segmenting, "dest" is a file name template. "{n}" is replaced with the
+// segment number and strftime() specifiers with the segment start time.
+writer *newwriter(const char *dest, int nchannels, int samplerate, capture::pcm_type outtype, const options &opts = options());
 bool write(writer *writer, const void *buf, size_t framecount, capture::pcm_type intype = capture::pcm_type::unknown);
+// Finishes the current file and continues in the next segment.
+bool nextsegment(writer *writer);
+// Adds a cue point at the current position. Written when the file is finished.
+bool addcue(writer *writer);
+// Clipping and peak of every channel so far, over all segments. Only input
+// the writer had to convert to an integer type is measured. Call from the
+// writing thread.
+void getlevels(writer *writer, channel_levels *dest);
 bool close(writer *writer);
 
+// Size of one sample in bytes
+size_t pcmtype_size(capture::pcm_type t);
+
+static constexpr size_t PCM_HEADER_SIZE = 44;
+
+// Fills in the header of a PCM (or float) WAV file with "datasize" bytes of
+// samples. Returns PCM_HEADER_SIZE.
+size_t pcmheader(unsigned char *buf, int nchannels, int samplerate, capture::pcm_type type, uint32_t datasize);
+
+// Converts interleaved samples between PCM types. Returns false if the
+// conversion is not supported.
+bool convert(void *dest, capture::pcm_type outtype, const void *src, capture::pcm_type intype, size_t samplecount);
+// The same for conversions to an integer type, also adding clipped samples
+// and peaks to "levels", one per channel, in the same pass.
+bool convert(void *dest, capture::pcm_type outtype, const void *src, capture::pcm_type intype, size_t framecount, int channels, channel_levels *levels);
+// Splits interleaved frames into one buffer per channel, converting on the
+// way. "dest" holds "channels" buffers of "framecount" samples each. With
+// "levels", clipped samples and peaks of the input are added to it in the
+// same pass, as convert() does.
+bool deinterleave(void *const *dest, capture::pcm_type outtype, const void *src, capture::pcm_type intype, size_t framecount, int channels, channel_levels *levels = nullptr);
+// Joins one buffer per channel into interleaved frames, converting on the
+// way.
+bool interleave(void *dest, capture::pcm_type outtype, const void *const *src, capture::pcm_type intype, size_t framecount, int channels);
+
 }